@@ -61,6 +61,7 @@
 #endif
 
 #include "ops.h"
+#include "uring.h"
 
 typedef enum { SRV_FILEDES, SRV_NORMAL } srvmode_t;
 
@@ -521,6 +522,7 @@ _service_run (srvmode_t mode, int rfdno, int wfdno)
     List l = diod_conf_get_listen ();
     int nwthreads = diod_conf_get_nwthreads ();
     int flags = diod_conf_get_debuglevel ();
+    char *runqueue = diod_conf_get_runqueue ();
     uid_t euid = geteuid ();
     int n;
 
@@ -596,10 +598,38 @@ _service_run (srvmode_t mode, int rfdno, int wfdno)
     }
     if (!diod_conf_get_userdb ())
         flags |= SRV_FLAGS_NOUSERDB;
-    if (!(ss.srv = np_srv_create (nwthreads, flags))) /* starts threads */
+    if (!strcmp (runqueue, "ring"))
+        flags |= SRV_FLAGS_TPOOL_RING;
+    else if (!strcmp (runqueue, "steal"))
+        flags |= SRV_FLAGS_TPOOL_STEAL;
+    else if (!strcmp (runqueue, "shared"))
+        flags |= SRV_FLAGS_TPOOL_SHARED;
+    else if (strcmp (runqueue, "fifo") != 0)
+        msg_exit ("unknown runqueue type: %s", runqueue);
+    if (diod_conf_get_nreactors () > 0)
+        flags |= SRV_FLAGS_REACTOR;
+    if (diod_conf_get_zerocopy ())
+        flags |= SRV_FLAGS_ZEROCOPY;
+    if (!(ss.srv = np_srv_create (nwthreads, flags)))
         errn_exit (np_rerror (), "np_srv_create");
+    if (diod_conf_get_nwthreads_max () > nwthreads)
+        ss.srv->nwthread_max = diod_conf_get_nwthreads_max ();
+    if (diod_conf_get_wthread_growms () > 0)
+        ss.srv->wthread_growms = diod_conf_get_wthread_growms ();
+    if (diod_conf_get_wthread_idlesecs () > 0)
+        ss.srv->wthread_idlesecs = diod_conf_get_wthread_idlesecs ();
+    if (diod_conf_get_nwthreads_reserved () >= 0)
+        ss.srv->nwthread_reserve = diod_conf_get_nwthreads_reserved ();
+    if (diod_conf_get_nwthreads_meta () > 0)
+        ss.srv->nwthread_meta = diod_conf_get_nwthreads_meta ();
+    if (diod_conf_get_nreactors () > 0)
+        ss.srv->nreactor = diod_conf_get_nreactors ();
+    ss.srv->slowreq_ms = diod_conf_get_slowreq_ms ();
+    ss.srv->sendwait_us = diod_conf_get_sendwait_us ();
     if (diod_register_ops (ss.srv) < 0)
         errn_exit (np_rerror (), "diod_register_ops");
+    if (diod_conf_get_io_uring () && diod_uring_init () < 0)
+        errn (np_rerror (), "io_uring unavailable, using synchronous I/O");
 
     if ((n = pthread_create (&ss.t, NULL, _service_loop, NULL)))
         errn_exit (n, "pthread_create _service_loop");
@@ -622,6 +652,7 @@ _service_run (srvmode_t mode, int rfdno, int wfdno)
         errn_exit (n, "pthread_join _service_loop_rdma");
 #endif
 
+    diod_uring_fini ();
     np_srv_destroy (ss.srv);
 }
 
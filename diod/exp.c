@@ -193,6 +193,28 @@ done:
     return res;
 }
 
+/* Called when a tpool is created to get its share of the shared workers.
+ */
+int
+diod_export_weight (char *path)
+{
+    List exports = diod_conf_get_exports ();
+    ListIterator itr;
+    Export *x;
+    int weight = 1;
+
+    if (!exports || !(itr = list_iterator_create (exports)))
+        return weight;
+    while ((x = list_next (itr))) {
+        if (_match_export_path (x, path)) {
+            weight = x->weight;
+            break;
+        }
+    }
+    list_iterator_destroy (itr);
+    return weight;
+}
+
 /**
  ** ctl/exports handling
  **/
@@ -1,3 +1,4 @@
 
 int diod_match_exports (char *path, Npconn *conn, Npuser *user, int *xfp);
 char *diod_get_exports (char *name, void *a);
+int diod_export_weight (char *path);
@@ -92,6 +92,7 @@
 
 #include "ops.h"
 #include "exp.h"
+#include "uring.h"
 
 typedef struct {
     char            *path;
@@ -114,6 +115,7 @@ Npfcall     *diod_write  (Npfid *fid, u64 offset, u32 count, u8 *data,
 Npfcall     *diod_clunk  (Npfid *fid);
 Npfcall     *diod_remove (Npfid *fid);
 void         diod_fiddestroy(Npfid *fid);
+char        *diod_fidpath(Npfid *fid);
 
 Npfcall     *diod_statfs (Npfid *fid);
 Npfcall     *diod_lopen  (Npfid *fid, u32 mode);
@@ -128,7 +130,7 @@ Npfcall     *diod_getattr(Npfid *fid, u64 request_mask);
 Npfcall     *diod_setattr (Npfid *fid, u32 valid, u32 mode, u32 uid, u32 gid, u64 size,
                         u64 atime_sec, u64 atime_nsec, u64 mtime_sec, u64 mtime_nsec);
 Npfcall     *diod_readdir(Npfid *fid, u64 offset, u32 count, Npreq *req);
-Npfcall     *diod_fsync (Npfid *fid);
+Npfcall     *diod_fsync (Npfid *fid, Npreq *req);
 Npfcall     *diod_lock (Npfid *fid, u8 type, u32 flags, u64 start, u64 length,
                         u32 proc_id, Npstr *client_id);
 Npfcall     *diod_getlock (Npfid *fid, u8 type, u64 start, u64 length,
@@ -147,6 +149,8 @@ diod_register_ops (Npsrv *srv)
 {
     srv->msize = 65536;
     srv->fiddestroy = diod_fiddestroy;
+    srv->fidpath = diod_fidpath;
+    srv->tpool_weight = diod_export_weight;
     srv->logmsg = diod_log_msg;
     srv->remapuser = diod_remapuser;
     srv->auth_required = diod_auth_required;
@@ -230,6 +234,16 @@ diod_fiddestroy (Npfid *fid)
     fid->aux = NULL;
 }
 
+/* Name the file a fid refers to in npfs' slow request records.
+ */
+char *
+diod_fidpath (Npfid *fid)
+{
+    Fid *f = fid->aux;
+
+    return f ? f->path : NULL;
+}
+
 /* Create a 9P qid from a file's stat info.
  * N.B. v9fs maps st_ino = qid->path + 2
  */
@@ -482,10 +496,16 @@ diod_read (Npfid *fid, u64 offset, u32 count, Npreq *req)
     Npfcall *ret = NULL;
     ssize_t n;
 
+    if ((ret = np_create_rread_splice (req, f->fd, offset, count)))
+        return ret;
+    if (np_rerror ())
+        goto error_quiet;
     if (!(ret = np_alloc_rread (count))) {
         np_uerror (ENOMEM);
         goto error;
     }
+    if (diod_uring_read (req, f->fd, offset, count, ret) == 0)
+        return NULL;
     if ((n = pread (f->fd, ret->u.rread.data, count, offset)) < 0) {
         np_uerror (errno);
         goto error_quiet;
@@ -497,7 +517,7 @@ error:
           fid->user->uname, np_conn_get_client_id (fid->conn), f->path);
 error_quiet:
     if (ret)
-        free (ret);
+        np_free_fcall (ret);
     return NULL; 
 }
 
@@ -514,9 +534,15 @@ diod_write (Npfid *fid, u64 offset, u32 count, u8 *data, Npreq *req)
         np_uerror (EROFS);
         goto error_quiet;
     }
-    if ((n = pwrite (f->fd, data, count, offset)) < 0) {
-        np_uerror (errno);
-        goto error_quiet;
+    if ((n = np_splice_write (req, f->fd, offset)) < 0) {
+        if (np_rerror ())
+            goto error_quiet;
+        if (diod_uring_write (req, f->fd, offset, count, data) == 0)
+            return NULL;
+        if ((n = pwrite (f->fd, data, count, offset)) < 0) {
+            np_uerror (errno);
+            goto error_quiet;
+        }
     }
     if (!(ret = np_create_rwrite (n))) {
         np_uerror (ENOMEM);
@@ -1102,7 +1128,7 @@ diod_readdir(Npfid *fid, u64 offset, u32 count, Npreq *req)
     }
     n = _read_dir_linux (f, ret->u.rreaddir.data, offset, count);
     if (np_rerror ()) {
-        free (ret);
+        np_free_fcall (ret);
         ret = NULL;
     } else
         np_finalize_rreaddir (ret, n);
@@ -1114,7 +1140,7 @@ error:
 }
 
 Npfcall*
-diod_fsync (Npfid *fid)
+diod_fsync (Npfid *fid, Npreq *req)
 {
     Fid *f = fid->aux;
     Npfcall *ret;
@@ -1123,6 +1149,8 @@ diod_fsync (Npfid *fid)
         np_uerror (EROFS);
         goto error_quiet;
     }
+    if (diod_uring_fsync (req, f->fd) == 0)
+        return NULL;
     if (fsync(f->fd) < 0) {
         np_uerror (errno);
         goto error_quiet;
@@ -0,0 +1,495 @@
+/*****************************************************************************
+ *  Copyright (C) 2011 Lawrence Livermore National Security, LLC.
+ *  Written by Jim Garlick <garlick@llnl.gov> LLNL-CODE-423279
+ *  All Rights Reserved.
+ *
+ *  This file is part of the Distributed I/O Daemon (diod).
+ *  For details, see <http://code.google.com/p/diod/>.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/* uring.c - io_uring backend for read, write, and fsync */
+
+/* With "io_uring = 1" in diod.conf, reads, writes, and fsyncs on files
+ * are submitted to an io_uring and the worker thread moves on to the next
+ * request.  A completion thread reaps the results and queues the replies
+ * with np_req_complete_nowait (), which hands them to libnpfs sender
+ * threads, so a client that isn't reading can't stall other completions.
+ * The ring is set up with raw system calls so liburing is not needed.
+ * If the kernel lacks io_uring or its read, write, and fsync ops, or the
+ * ring is full, the operation is performed synchronously as before.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#endif
+
+#include "9p.h"
+#include "npfs.h"
+
+#include "diod_log.h"
+#include "uring.h"
+
+#if HAVE_LINUX_IO_URING_H && defined(__NR_io_uring_setup)
+
+#define URING_ENTRIES   256
+
+typedef struct {
+    Npreq           *req;
+    int              op;        /* IORING_OP_* */
+    int              fd;
+    u64              offset;
+    u32              count;
+    u8              *data;
+    Npfcall         *rc;        /* Rread being filled */
+} Aio;
+
+typedef struct {
+    int                  fd;
+    void                *sq_ptr;
+    size_t               sq_len;
+    void                *cq_ptr;
+    size_t               cq_len;
+    struct io_uring_sqe *sqes;
+    size_t               sqes_len;
+    unsigned            *sq_head;
+    unsigned            *sq_tail;
+    unsigned            *sq_mask;
+    unsigned            *sq_array;
+    unsigned             sq_entries;
+    unsigned            *cq_head;
+    unsigned            *cq_tail;
+    unsigned            *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned             cq_entries;
+    pthread_mutex_t      lock;      /* protects SQ tail, inflight */
+    pthread_cond_t       cond;      /* signalled as completions are reaped */
+    int                  inflight;  /* kept <= cq_entries */
+    pthread_t            thread;
+} Uring;
+
+static Uring *ring = NULL;
+
+static int
+_setup (unsigned entries, struct io_uring_params *p)
+{
+    return syscall (__NR_io_uring_setup, entries, p);
+}
+
+static int
+_enter (int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall (__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                    NULL, 0);
+}
+
+/* Ops were added to io_uring piecemeal:  read and write arrived in 5.6,
+ * along with IORING_REGISTER_PROBE to ask about them.  Fail with ENOSYS
+ * if the ring can't do all of read, write, and fsync.
+ */
+static int
+_probe (int fd)
+{
+#ifdef IO_URING_OP_SUPPORTED
+    static const int need[] = { IORING_OP_READ, IORING_OP_WRITE,
+                                IORING_OP_FSYNC };
+    struct io_uring_probe *probe;
+    size_t size = sizeof (*probe) + 256 * sizeof (struct io_uring_probe_op);
+    int i, ok = 1;
+
+    if (!(probe = malloc (size))) {
+        np_uerror (ENOMEM);
+        return -1;
+    }
+    memset (probe, 0, size);
+    if (syscall (__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+                 probe, 256) < 0)
+        ok = 0;
+    for (i = 0; ok && i < sizeof (need) / sizeof (need[0]); i++) {
+        if (need[i] > probe->last_op
+                || !(probe->ops[need[i]].flags & IO_URING_OP_SUPPORTED))
+            ok = 0;
+    }
+    free (probe);
+    if (!ok) {
+        np_uerror (ENOSYS);
+        return -1;
+    }
+    return 0;
+#else
+    np_uerror (ENOSYS);
+    return -1;
+#endif
+}
+
+/* Reply to aio's request given res, the result of the read, write, or
+ * fsync system call, or -errno.  Set nowait on the completion thread.
+ */
+static void
+_aio_done (Aio *a, int res, int nowait)
+{
+    Npfcall *rc = NULL;
+    int ecode = 0;
+
+    if (res < 0) {
+        if (a->rc)
+            np_free_fcall (a->rc);
+        ecode = -res;
+        goto done;
+    }
+    switch (a->op) {
+        case IORING_OP_READ:
+            rc = a->rc;
+            np_set_rread_count (rc, res);
+            break;
+        case IORING_OP_WRITE:
+            if (!(rc = np_create_rwrite (res)))
+                ecode = ENOMEM;
+            break;
+        case IORING_OP_FSYNC:
+            if (!(rc = np_create_rfsync ()))
+                ecode = ENOMEM;
+            break;
+    }
+done:
+    if (nowait)
+        np_req_complete_nowait (a->req, rc, ecode);
+    else
+        np_req_complete (a->req, rc, ecode);
+    free (a);
+}
+
+/* Perform aio synchronously, as without io_uring.
+ */
+static void
+_aio_sync (Aio *a)
+{
+    ssize_t n = 0;
+
+    switch (a->op) {
+        case IORING_OP_READ:
+            n = pread (a->fd, a->rc->u.rread.data, a->count, a->offset);
+            break;
+        case IORING_OP_WRITE:
+            n = pwrite (a->fd, a->data, a->count, a->offset);
+            break;
+        case IORING_OP_FSYNC:
+            n = fsync (a->fd);
+            break;
+    }
+    _aio_done (a, n < 0 ? -errno : n, 0);
+}
+
+static void *
+_completion_proc (void *arg)
+{
+    Uring *r = arg;
+    struct io_uring_cqe *cqe;
+    unsigned head, tail;
+    Aio *a;
+    int res;
+
+    for (;;) {
+        head = *r->cq_head;
+        tail = __atomic_load_n (r->cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            if (_enter (r->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0
+                                            && errno != EINTR) {
+                err ("io_uring_enter");
+                break;
+            }
+            continue;
+        }
+        cqe = &r->cqes[head & *r->cq_mask];
+        a = (Aio *)(uintptr_t)cqe->user_data;
+        res = cqe->res;
+        __atomic_store_n (r->cq_head, head + 1, __ATOMIC_RELEASE);
+        if (!a)         /* NOP from diod_uring_fini () */
+            break;
+        pthread_mutex_lock (&r->lock);
+        r->inflight--;
+        pthread_mutex_unlock (&r->lock);
+        pthread_cond_broadcast (&r->cond);
+        _aio_done (a, res, 1);
+    }
+    return NULL;
+}
+
+static int
+_full (Uring *r, Aio *a)
+{
+    unsigned used = *r->sq_tail - __atomic_load_n (r->sq_head, __ATOMIC_ACQUIRE);
+
+    return (used >= r->sq_entries || (a && r->inflight >= r->cq_entries));
+}
+
+/* Queue an sqe for aio (NULL for a NOP) and submit it.
+ * Returns -1 if the request can't be deferred, or if the ring is full
+ * for a NOP.  Once deferred, aio is performed synchronously if the ring
+ * is full or submission fails.
+ */
+static int
+_submit (Uring *r, Aio *a)
+{
+    struct io_uring_sqe *sqe;
+    unsigned tail, idx;
+
+    /* The request must be deferred before its completion can run.
+     * np_req_defer () takes the tpool lock, so do it outside r->lock.
+     */
+    if (a && np_req_defer (a->req) < 0)
+        return -1;
+    pthread_mutex_lock (&r->lock);
+    if (_full (r, a)) {
+        pthread_mutex_unlock (&r->lock);
+        if (!a)
+            return -1;
+        _aio_sync (a);
+        return 0;
+    }
+    tail = *r->sq_tail;
+    idx = tail & *r->sq_mask;
+    sqe = &r->sqes[idx];
+    memset (sqe, 0, sizeof (*sqe));
+    sqe->opcode = a ? a->op : IORING_OP_NOP;
+    sqe->user_data = (uintptr_t)a;
+    if (a) {
+        sqe->fd = a->fd;
+        sqe->off = a->offset;
+        sqe->len = a->count;
+        if (a->op == IORING_OP_READ)
+            sqe->addr = (uintptr_t)a->rc->u.rread.data;
+        else if (a->op == IORING_OP_WRITE)
+            sqe->addr = (uintptr_t)a->data;
+    }
+    r->sq_array[idx] = idx;
+    __atomic_store_n (r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    if (_enter (r->fd, 1, 0, 0) != 1) {
+        __atomic_store_n (r->sq_tail, tail, __ATOMIC_RELEASE);
+        pthread_mutex_unlock (&r->lock);
+        if (a)
+            _aio_sync (a);
+        return 0;
+    }
+    if (a)
+        r->inflight++;
+    pthread_mutex_unlock (&r->lock);
+    return 0;
+}
+
+static int
+_aio_submit (Npreq *req, int op, int fd, u64 offset, u32 count, u8 *data,
+             Npfcall *rc)
+{
+    Aio *a;
+
+    if (!ring || !(a = malloc (sizeof (*a))))
+        return -1;
+    a->req = req;
+    a->op = op;
+    a->fd = fd;
+    a->offset = offset;
+    a->count = count;
+    a->data = data;
+    a->rc = rc;
+    if (_submit (ring, a) < 0) {
+        free (a);
+        return -1;
+    }
+    return 0;
+}
+
+int
+diod_uring_read (Npreq *req, int fd, u64 offset, u32 count, Npfcall *rc)
+{
+    return _aio_submit (req, IORING_OP_READ, fd, offset, count, NULL, rc);
+}
+
+int
+diod_uring_write (Npreq *req, int fd, u64 offset, u32 count, u8 *data)
+{
+    return _aio_submit (req, IORING_OP_WRITE, fd, offset, count, data, NULL);
+}
+
+int
+diod_uring_fsync (Npreq *req, int fd)
+{
+    return _aio_submit (req, IORING_OP_FSYNC, fd, 0, 0, NULL, NULL);
+}
+
+int
+diod_uring_init (void)
+{
+    struct io_uring_params p;
+    Uring *r;
+    int err;
+
+    if (!(r = malloc (sizeof (*r)))) {
+        np_uerror (ENOMEM);
+        return -1;
+    }
+    memset (r, 0, sizeof (*r));
+    pthread_mutex_init (&r->lock, NULL);
+    pthread_cond_init (&r->cond, NULL);
+    memset (&p, 0, sizeof (p));
+    if ((r->fd = _setup (URING_ENTRIES, &p)) < 0) {
+        np_uerror (errno);
+        goto error;
+    }
+    if (_probe (r->fd) < 0)
+        goto error;
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP)) {
+        if (r->cq_len > r->sq_len)
+            r->sq_len = r->cq_len;
+        r->cq_len = r->sq_len;
+    }
+    r->sq_ptr = mmap (NULL, r->sq_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) {
+        r->sq_ptr = NULL;
+        np_uerror (errno);
+        goto error;
+    }
+    if ((p.features & IORING_FEAT_SINGLE_MMAP))
+        r->cq_ptr = r->sq_ptr;
+    else {
+        r->cq_ptr = mmap (NULL, r->cq_len, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, r->fd,
+                          IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED) {
+            r->cq_ptr = NULL;
+            np_uerror (errno);
+            goto error;
+        }
+    }
+    r->sqes_len = p.sq_entries * sizeof (struct io_uring_sqe);
+    r->sqes = mmap (NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        np_uerror (errno);
+        goto error;
+    }
+    r->sq_head = r->sq_ptr + p.sq_off.head;
+    r->sq_tail = r->sq_ptr + p.sq_off.tail;
+    r->sq_mask = r->sq_ptr + p.sq_off.ring_mask;
+    r->sq_array = r->sq_ptr + p.sq_off.array;
+    r->sq_entries = p.sq_entries;
+    r->cq_head = r->cq_ptr + p.cq_off.head;
+    r->cq_tail = r->cq_ptr + p.cq_off.tail;
+    r->cq_mask = r->cq_ptr + p.cq_off.ring_mask;
+    r->cqes = r->cq_ptr + p.cq_off.cqes;
+    r->cq_entries = p.cq_entries;
+    if ((err = pthread_create (&r->thread, NULL, _completion_proc, r))) {
+        np_uerror (err);
+        goto error;
+    }
+    ring = r;
+    return 0;
+error:
+    if (r->sqes)
+        munmap (r->sqes, r->sqes_len);
+    if (r->cq_ptr && r->cq_ptr != r->sq_ptr)
+        munmap (r->cq_ptr, r->cq_len);
+    if (r->sq_ptr)
+        munmap (r->sq_ptr, r->sq_len);
+    if (r->fd >= 0)
+        close (r->fd);
+    pthread_cond_destroy (&r->cond);
+    pthread_mutex_destroy (&r->lock);
+    free (r);
+    return -1;
+}
+
+/* Call when no requests are outstanding.
+ */
+void
+diod_uring_fini (void)
+{
+    Uring *r = ring;
+
+    if (!r)
+        return;
+    ring = NULL;
+    while (_submit (r, NULL) < 0) {
+        pthread_mutex_lock (&r->lock);
+        while (_full (r, NULL))
+            pthread_cond_wait (&r->cond, &r->lock);
+        pthread_mutex_unlock (&r->lock);
+    }
+    pthread_join (r->thread, NULL);
+    munmap (r->sqes, r->sqes_len);
+    if (r->cq_ptr != r->sq_ptr)
+        munmap (r->cq_ptr, r->cq_len);
+    munmap (r->sq_ptr, r->sq_len);
+    close (r->fd);
+    pthread_cond_destroy (&r->cond);
+    pthread_mutex_destroy (&r->lock);
+    free (r);
+}
+
+#else /* !HAVE_LINUX_IO_URING_H */
+
+int
+diod_uring_read (Npreq *req, int fd, u64 offset, u32 count, Npfcall *rc)
+{
+    return -1;
+}
+
+int
+diod_uring_write (Npreq *req, int fd, u64 offset, u32 count, u8 *data)
+{
+    return -1;
+}
+
+int
+diod_uring_fsync (Npreq *req, int fd)
+{
+    return -1;
+}
+
+int
+diod_uring_init (void)
+{
+    np_uerror (ENOSYS);
+    return -1;
+}
+
+void
+diod_uring_fini (void)
+{
+}
+
+#endif
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
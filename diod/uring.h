@@ -0,0 +1,36 @@
+/*****************************************************************************
+ *  Copyright (C) 2010 Lawrence Livermore National Security, LLC.
+ *  Written by Jim Garlick <garlick@llnl.gov> LLNL-CODE-423279
+ *  All Rights Reserved.
+ *
+ *  This file is part of the Distributed I/O Daemon (diod).
+ *  For details, see <http://code.google.com/p/diod/>.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/* Submit an operation to the io_uring backend, deferring req.
+ * Returns -1 if the operation should be performed synchronously instead.
+ */
+int diod_uring_read (Npreq *req, int fd, u64 offset, u32 count, Npfcall *rc);
+int diod_uring_write (Npreq *req, int fd, u64 offset, u32 count, u8 *data);
+int diod_uring_fsync (Npreq *req, int fd);
+
+int diod_uring_init (void);
+void diod_uring_fini (void);
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -81,10 +81,31 @@
 #define RO_EXPORTALL        0x1000
 #define RO_ALLSQUASH        0x2000
 #define RO_SQUASHUSER       0x4000
+#define RO_RUNQUEUE         0x8000
+#define RO_NWTHREADS_MAX    0x10000
+#define RO_NWTHREADS_RESERVED 0x20000
+#define RO_NWTHREADS_META   0x40000
+#define RO_NREACTORS        0x80000
+#define RO_IO_URING         0x100000
+#define RO_ZEROCOPY         0x200000
+#define RO_SLOWREQ_MS       0x400000
+#define RO_SENDWAIT_US      0x800000
+#define RO_WTHREAD_GROWMS   0x1000000
+#define RO_WTHREAD_IDLESECS 0x2000000
 
 typedef struct {
     int          debuglevel;
     int          nwthreads;
+    int          nwthreads_max;
+    int          wthread_growms;
+    int          wthread_idlesecs;
+    int          nwthreads_reserved;
+    int          nwthreads_meta;
+    int          nreactors;
+    int          io_uring;
+    int          zerocopy;
+    int          slowreq_ms;
+    int          sendwait_us;
     int          foreground;
     int          auth_required;
     int          userdb;
@@ -96,6 +117,7 @@ typedef struct {
     List         exports;
     char        *configpath;
     char        *logdest;
+    char        *runqueue;
     int          ro_mask; 
 } Conf;
 
@@ -140,6 +162,7 @@ _create_export (char *path)
     x->hosts = NULL;
     x->users = NULL;
     x->oflags = 0;
+    x->weight = 1;
     return x;
 }
 
@@ -170,6 +193,16 @@ diod_conf_init (void)
 {
     config.debuglevel = DFLT_DEBUGLEVEL;
     config.nwthreads = DFLT_NWTHREADS;
+    config.nwthreads_max = DFLT_NWTHREADS_MAX;
+    config.wthread_growms = DFLT_WTHREAD_GROWMS;
+    config.wthread_idlesecs = DFLT_WTHREAD_IDLESECS;
+    config.nwthreads_reserved = DFLT_NWTHREADS_RESERVED;
+    config.nwthreads_meta = DFLT_NWTHREADS_META;
+    config.nreactors = DFLT_NREACTORS;
+    config.io_uring = DFLT_IO_URING;
+    config.zerocopy = DFLT_ZEROCOPY;
+    config.slowreq_ms = DFLT_SLOWREQ_MS;
+    config.sendwait_us = DFLT_SENDWAIT_US;
     config.foreground = DFLT_FOREGROUND;
     config.auth_required = DFLT_AUTH_REQUIRED;
     config.userdb = DFLT_USERDB;
@@ -186,6 +219,7 @@ diod_conf_init (void)
     config.configpath = NULL;
 #endif
     config.logdest = _xstrdup (DFLT_LOGDEST);
+    config.runqueue = _xstrdup (DFLT_RUNQUEUE);
     config.ro_mask = 0;
 }
 
@@ -202,6 +236,8 @@ diod_conf_fini (void)
         free (config.logdest);
     if (config.squashuser)
         free (config.squashuser);
+    if (config.runqueue)
+        free (config.runqueue);
 }
 
 /* logdest - logging destination
@@ -242,6 +278,106 @@ void diod_conf_set_nwthreads (int i)
     config.ro_mask |= RO_NWTHREADS;
 }
 
+/* nwthreads_max - let busy tpools grow beyond nwthreads up to this many
+ */
+int diod_conf_get_nwthreads_max (void) { return config.nwthreads_max; }
+int diod_conf_opt_nwthreads_max (void) { return config.ro_mask & RO_NWTHREADS_MAX; }
+void diod_conf_set_nwthreads_max (int i)
+{
+    config.nwthreads_max = i;
+    config.ro_mask |= RO_NWTHREADS_MAX;
+}
+
+/* wthread_growms - grow a tpool when a request has been queued this long
+ */
+int diod_conf_get_wthread_growms (void) { return config.wthread_growms; }
+int diod_conf_opt_wthread_growms (void) { return config.ro_mask & RO_WTHREAD_GROWMS; }
+void diod_conf_set_wthread_growms (int i)
+{
+    config.wthread_growms = i;
+    config.ro_mask |= RO_WTHREAD_GROWMS;
+}
+
+/* wthread_idlesecs - extra workers exit after being idle this long
+ */
+int diod_conf_get_wthread_idlesecs (void) { return config.wthread_idlesecs; }
+int diod_conf_opt_wthread_idlesecs (void) { return config.ro_mask & RO_WTHREAD_IDLESECS; }
+void diod_conf_set_wthread_idlesecs (int i)
+{
+    config.wthread_idlesecs = i;
+    config.ro_mask |= RO_WTHREAD_IDLESECS;
+}
+
+/* nwthreads_reserved - workers dedicated to each aname (shared runqueue)
+ */
+int diod_conf_get_nwthreads_reserved (void) { return config.nwthreads_reserved; }
+int diod_conf_opt_nwthreads_reserved (void) { return config.ro_mask & RO_NWTHREADS_RESERVED; }
+void diod_conf_set_nwthreads_reserved (int i)
+{
+    config.nwthreads_reserved = i;
+    config.ro_mask |= RO_NWTHREADS_RESERVED;
+}
+
+/* nwthreads_meta - workers per aname that only handle metadata requests
+ */
+int diod_conf_get_nwthreads_meta (void) { return config.nwthreads_meta; }
+int diod_conf_opt_nwthreads_meta (void) { return config.ro_mask & RO_NWTHREADS_META; }
+void diod_conf_set_nwthreads_meta (int i)
+{
+    config.nwthreads_meta = i;
+    config.ro_mask |= RO_NWTHREADS_META;
+}
+
+/* nreactors - epoll threads reading connections (0 = thread per connection)
+ */
+int diod_conf_get_nreactors (void) { return config.nreactors; }
+int diod_conf_opt_nreactors (void) { return config.ro_mask & RO_NREACTORS; }
+void diod_conf_set_nreactors (int i)
+{
+    config.nreactors = i;
+    config.ro_mask |= RO_NREACTORS;
+}
+
+/* io_uring - submit file reads, writes, and fsyncs to io_uring
+ */
+int diod_conf_get_io_uring (void) { return config.io_uring; }
+int diod_conf_opt_io_uring (void) { return config.ro_mask & RO_IO_URING; }
+void diod_conf_set_io_uring (int i)
+{
+    config.io_uring = i;
+    config.ro_mask |= RO_IO_URING;
+}
+
+/* zerocopy - splice file data between the socket and files
+ */
+int diod_conf_get_zerocopy (void) { return config.zerocopy; }
+int diod_conf_opt_zerocopy (void) { return config.ro_mask & RO_ZEROCOPY; }
+void diod_conf_set_zerocopy (int i)
+{
+    config.zerocopy = i;
+    config.ro_mask |= RO_ZEROCOPY;
+}
+
+/* sendwait_us - let a reply wait this long for others on its connection
+ */
+int diod_conf_get_sendwait_us (void) { return config.sendwait_us; }
+int diod_conf_opt_sendwait_us (void) { return config.ro_mask & RO_SENDWAIT_US; }
+void diod_conf_set_sendwait_us (int i)
+{
+    config.sendwait_us = i;
+    config.ro_mask |= RO_SENDWAIT_US;
+}
+
+/* slowreq_ms - record requests slower than this in the slowreqs ctl file
+ */
+int diod_conf_get_slowreq_ms (void) { return config.slowreq_ms; }
+int diod_conf_opt_slowreq_ms (void) { return config.ro_mask & RO_SLOWREQ_MS; }
+void diod_conf_set_slowreq_ms (int i)
+{
+    config.slowreq_ms = i;
+    config.ro_mask |= RO_SLOWREQ_MS;
+}
+
 /* foreground - run daemon in foreground
  */
 int diod_conf_get_foreground (void) { return config.foreground; }
@@ -295,6 +431,18 @@ void diod_conf_set_squashuser(char *user)
     config.ro_mask |= RO_SQUASHUSER;
 }
 
+/* runqueue - how worker threads are handed requests (fifo, ring, steal, shared)
+ */
+char *diod_conf_get_runqueue (void) { return config.runqueue; }
+int diod_conf_opt_runqueue (void) { return config.ro_mask & RO_RUNQUEUE; }
+void diod_conf_set_runqueue (char *s)
+{
+    if (config.runqueue)
+        free (config.runqueue);
+    config.runqueue = _xstrdup (s);
+    config.ro_mask |= RO_RUNQUEUE;
+}
+
 /* runasuid - set to run server as one user (mount -o access=uid)
  */
 uid_t diod_conf_get_runasuid (void) { return config.runasuid; }
@@ -405,9 +553,10 @@ void diod_conf_validate_exports (void)
 
 #if defined(HAVE_LUA_H) && defined(HAVE_LUALIB_H)
 static void
-_parse_expopt (char *s, int *fp)
+_parse_expopt (char *s, int *fp, int *wp)
 {
     int flags = 0;
+    int weight = 1;
     char *cpy, *item;
     char *saveptr = NULL;
 
@@ -419,12 +568,17 @@ _parse_expopt (char *s, int *fp)
             flags |= XFLAGS_RO;
         else if (!strcmp (item, "suppress"))
             flags |= XFLAGS_SUPPRESS;
-        else
+        else if (!strncmp (item, "weight=", 7)) {
+            weight = strtoul (item + 7, NULL, 10);
+            if (weight < 1)
+                msg_exit ("export option weight must be >= 1: %s", item);
+        } else
             msg_exit ("unknown export option: %s", item);
         item = strtok_r (NULL, ",", &saveptr);
     }
     free (cpy);
     *fp = flags;
+    *wp = weight;
 }
 
 static int
@@ -548,7 +702,7 @@ _lua_getglobal_exports (char *path, lua_State *L, List *lp)
                 free (p);
                 _lua_get_expattr (path, i, L, "opts", &x->opts);
                 if (x->opts)
-                    _parse_expopt (x->opts, &x->oflags);
+                    _parse_expopt (x->opts, &x->oflags, &x->weight);
                 _lua_get_expattr (path, i, L, "users", &x->users);
                 _lua_get_expattr (path, i, L, "hosts", &x->hosts);
                 /* FIXME: check for illegal export attributes */
@@ -601,6 +755,52 @@ diod_conf_init_config_file (char *path) /* FIXME: ENOMEM is fatal */
             config.nwthreads = DFLT_NWTHREADS;
             _lua_getglobal_int (path, L, "nwthreads", &config.nwthreads);
         }
+        if (!(config.ro_mask & RO_NWTHREADS_MAX)) {
+            config.nwthreads_max = DFLT_NWTHREADS_MAX;
+            _lua_getglobal_int (path, L, "nwthreads_max",
+                                &config.nwthreads_max);
+        }
+        if (!(config.ro_mask & RO_WTHREAD_GROWMS)) {
+            config.wthread_growms = DFLT_WTHREAD_GROWMS;
+            _lua_getglobal_int (path, L, "wthread_growms",
+                                &config.wthread_growms);
+        }
+        if (!(config.ro_mask & RO_WTHREAD_IDLESECS)) {
+            config.wthread_idlesecs = DFLT_WTHREAD_IDLESECS;
+            _lua_getglobal_int (path, L, "wthread_idlesecs",
+                                &config.wthread_idlesecs);
+        }
+        if (!(config.ro_mask & RO_NWTHREADS_RESERVED)) {
+            config.nwthreads_reserved = DFLT_NWTHREADS_RESERVED;
+            _lua_getglobal_int (path, L, "nwthreads_reserved",
+                                &config.nwthreads_reserved);
+        }
+        if (!(config.ro_mask & RO_NWTHREADS_META)) {
+            config.nwthreads_meta = DFLT_NWTHREADS_META;
+            _lua_getglobal_int (path, L, "nwthreads_meta",
+                                &config.nwthreads_meta);
+        }
+        if (!(config.ro_mask & RO_NREACTORS)) {
+            config.nreactors = DFLT_NREACTORS;
+            _lua_getglobal_int (path, L, "nreactors",
+                                &config.nreactors);
+        }
+        if (!(config.ro_mask & RO_IO_URING)) {
+            config.io_uring = DFLT_IO_URING;
+            _lua_getglobal_int (path, L, "io_uring", &config.io_uring);
+        }
+        if (!(config.ro_mask & RO_ZEROCOPY)) {
+            config.zerocopy = DFLT_ZEROCOPY;
+            _lua_getglobal_int (path, L, "zerocopy", &config.zerocopy);
+        }
+        if (!(config.ro_mask & RO_SLOWREQ_MS)) {
+            config.slowreq_ms = DFLT_SLOWREQ_MS;
+            _lua_getglobal_int (path, L, "slowreq_ms", &config.slowreq_ms);
+        }
+        if (!(config.ro_mask & RO_SENDWAIT_US)) {
+            config.sendwait_us = DFLT_SENDWAIT_US;
+            _lua_getglobal_int (path, L, "sendwait_us", &config.sendwait_us);
+        }
         if (!(config.ro_mask & RO_AUTH_REQUIRED)) {
             config.auth_required = DFLT_AUTH_REQUIRED;
             _lua_getglobal_int (path, L, "auth_required",
@@ -630,6 +830,11 @@ diod_conf_init_config_file (char *path) /* FIXME: ENOMEM is fatal */
             config.logdest = _xstrdup (DFLT_LOGDEST);
             _lua_getglobal_string (path, L, "logdest", &config.logdest);
         }
+        if (!(config.ro_mask & RO_RUNQUEUE)) {
+            free (config.runqueue);
+            config.runqueue = _xstrdup (DFLT_RUNQUEUE);
+            _lua_getglobal_string (path, L, "runqueue", &config.runqueue);
+        }
         if (!(config.ro_mask & RO_EXPORTALL)) {
             config.exportall = DFLT_EXPORTALL;
             _lua_getglobal_int (path, L, "exportall", &config.exportall);
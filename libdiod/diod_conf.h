@@ -23,6 +23,16 @@
 
 #define DFLT_DEBUGLEVEL     0
 #define DFLT_NWTHREADS      16
+#define DFLT_NWTHREADS_MAX  0
+#define DFLT_WTHREAD_GROWMS 100
+#define DFLT_WTHREAD_IDLESECS 60
+#define DFLT_NWTHREADS_RESERVED 1
+#define DFLT_NWTHREADS_META 0
+#define DFLT_NREACTORS      0
+#define DFLT_IO_URING       0
+#define DFLT_ZEROCOPY       0
+#define DFLT_SLOWREQ_MS     1000
+#define DFLT_SENDWAIT_US    0
 #define DFLT_FOREGROUND     0
 #define DFLT_AUTH_REQUIRED  1
 #define DFLT_USERDB         1
@@ -35,6 +45,7 @@
 #define DFLT_CONFIGPATH     X_SYSCONFDIR "/diod.conf"
 #endif
 #define DFLT_LOGDEST        "syslog:daemon:err"
+#define DFLT_RUNQUEUE       "fifo"
 
 void	diod_conf_init (void);
 void	diod_conf_fini (void);
@@ -55,6 +66,46 @@ int     diod_conf_get_nwthreads (void);
 int     diod_conf_opt_nwthreads (void);
 void    diod_conf_set_nwthreads (int i);
 
+int     diod_conf_get_nwthreads_max (void);
+int     diod_conf_opt_nwthreads_max (void);
+void    diod_conf_set_nwthreads_max (int i);
+
+int     diod_conf_get_wthread_growms (void);
+int     diod_conf_opt_wthread_growms (void);
+void    diod_conf_set_wthread_growms (int i);
+
+int     diod_conf_get_wthread_idlesecs (void);
+int     diod_conf_opt_wthread_idlesecs (void);
+void    diod_conf_set_wthread_idlesecs (int i);
+
+int     diod_conf_get_nwthreads_reserved (void);
+int     diod_conf_opt_nwthreads_reserved (void);
+void    diod_conf_set_nwthreads_reserved (int i);
+
+int     diod_conf_get_nwthreads_meta (void);
+int     diod_conf_opt_nwthreads_meta (void);
+void    diod_conf_set_nwthreads_meta (int i);
+
+int     diod_conf_get_nreactors (void);
+int     diod_conf_opt_nreactors (void);
+void    diod_conf_set_nreactors (int i);
+
+int     diod_conf_get_io_uring (void);
+int     diod_conf_opt_io_uring (void);
+void    diod_conf_set_io_uring (int i);
+
+int     diod_conf_get_zerocopy (void);
+int     diod_conf_opt_zerocopy (void);
+void    diod_conf_set_zerocopy (int i);
+
+int     diod_conf_get_sendwait_us (void);
+int     diod_conf_opt_sendwait_us (void);
+void    diod_conf_set_sendwait_us (int i);
+
+int     diod_conf_get_slowreq_ms (void);
+int     diod_conf_opt_slowreq_ms (void);
+void    diod_conf_set_slowreq_ms (int i);
+
 int     diod_conf_get_foreground (void);
 int     diod_conf_opt_foreground (void);
 void    diod_conf_set_foreground (int i);
@@ -79,6 +130,10 @@ uid_t   diod_conf_get_runasuid (void);
 int     diod_conf_opt_runasuid (void);
 void    diod_conf_set_runasuid (uid_t uid);
 
+char   *diod_conf_get_runqueue (void);
+int     diod_conf_opt_runqueue (void);
+void    diod_conf_set_runqueue (char *s);
+
 List    diod_conf_get_listen (void);
 int     diod_conf_opt_listen (void);
 void    diod_conf_clr_listen (void);
@@ -91,6 +146,7 @@ typedef struct {
     char         *path;
     char         *opts;
     int          oflags;
+    int          weight;
     char         *users;
     char         *hosts;
 } Export;
@@ -166,6 +166,6 @@ done:
 	if (tag != P9_NOTAG)
 		npc_put_id(fs->tagpool, tag);
 	if (ret < 0 && rc != NULL)
-		free (rc);
+		np_free_fcall (rc);
 	return ret;
 }
@@ -57,9 +57,9 @@ npc_mkdir (Npcfid *fid, char *name, u32 mode)
 	ret = 0;
 done:
 	if (tc)
-		free(tc);
+		np_free_fcall(tc);
 	if (rc)
-		free(rc);	
+		np_free_fcall(rc);	
 	return ret;
 }
 
@@ -76,9 +76,9 @@ npc_start (int rfd, int wfd, int msize, int flags)
 	}
 done:
 	if (tc)
-		free (tc);
+		np_free_fcall (tc);
 	if (rc)
-		free (rc);
+		np_free_fcall (rc);
 	if (np_rerror () && fs) {
 		npc_finish (fs);
 		fs = NULL;
@@ -114,9 +114,9 @@ npc_auth (Npcfsys *fs, char *aname, u32 uid, AuthFun auth)
 	}
 done:
         if (tc)
-                free(tc);
+                np_free_fcall(tc);
         if (rc)
-                free(rc);
+                np_free_fcall(rc);
         return afid;
 }
 
@@ -137,9 +137,9 @@ npc_attach (Npcfsys *fs, Npcfid *afid, char *aname, uid_t uid)
 		goto done;
 done:
 	if (tc)
-		free (tc);
+		np_free_fcall (tc);
 	if (rc)
-		free (rc);
+		np_free_fcall (rc);
 	if (np_rerror () && fid) {
 		npc_fid_free (fid);
 		fid = NULL;
@@ -163,9 +163,9 @@ npc_clunk (Npcfid *fid)
 	ret = 0;
 done:
 	if (tc)
-        	free (tc);
+        	np_free_fcall (tc);
 	if (rc)
-        	free (rc);
+        	np_free_fcall (rc);
         return ret;
 }
 
@@ -276,8 +276,8 @@ npc_cancel_fid_requests(Npcfid *fid)
 			npc_put_id(fs->tagpool, ftags[i]);
 		}
 
-		free(tc);
-		free(rc);
+		np_free_fcall(tc);
+		np_free_fcall(rc);
 	}
 	free(ftags);
 
@@ -327,12 +327,12 @@ npc_read_proc(void *a)
 
 		if (!req) {
 			xpthread_mutex_unlock(&fs->lock);
-			free(fc);
+			np_free_fcall(fc);
 			fc = NULL;
 		}
 	}
 	if (fc)
-		free(fc);
+		np_free_fcall(fc);
 	xpthread_mutex_lock(&fs->lock);
 	unsent = fs->unsent_first;
 	fs->unsent_first = NULL;
@@ -501,14 +501,14 @@ npc_rpc(Npcfsys *fs, Npfcall *tc, Npfcall **rc)
 	/* N.B. allow for auth returning error with ecode == 0 */
 	if (r.ecode || r.rc->type == P9_RLERROR) {
 		np_uerror(r.ecode);
-		free(r.rc);
+		np_free_fcall(r.rc);
 		return -1;
 	}
 
 	if (rc)
 		*rc = r.rc;
 	else
-		free(r.rc);
+		np_free_fcall(r.rc);
 
 	return 0;
 }
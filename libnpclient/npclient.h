@@ -173,6 +173,11 @@ int npc_get(Npcfid *root, char *path, void *buf, u32 count);
  */
 char *npc_aget(Npcfid *root, char *path);
 
+/* Same as npc_aget but the length is stored in *lenp, for files that
+ * may contain NUL bytes.
+ */
+char *npc_aget_len(Npcfid *root, char *path, int *lenp);
+
 /* npc_read_all() up to and including the next '\n' character, or until buffer
  * is exhausted, whichever comes first.
  * Returns bytes read, 0 on EOF, or -1 on error (retrieve with np_rerror ()).
@@ -63,9 +63,9 @@ npc_create (Npcfid *fid, char *name, u32 flags, u32 mode, gid_t gid)
 	ret = 0;
 done:
 	if (tc)
-		free(tc);
+		np_free_fcall(tc);
 	if (rc)
-		free(rc);	
+		np_free_fcall(rc);	
 	return ret;
 }
 
@@ -124,9 +124,9 @@ npc_open (Npcfid *fid, u32 flags)
 	ret = 0;
 done:
 	if (tc)
-		free(tc);
+		np_free_fcall(tc);
 	if (rc)
-		free(rc);
+		np_free_fcall(rc);
 	return ret;
 }
 
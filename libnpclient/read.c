@@ -61,9 +61,9 @@ npc_pread(Npcfid *fid, void *buf, u32 count, u64 offset)
 	ret = rc->u.rread.count;
 done:
 	if (rc)
-		free(rc);
+		np_free_fcall(rc);
 	if (tc)
-		free(tc);
+		np_free_fcall(tc);
 
 	return ret;
 }
@@ -106,6 +106,14 @@ npc_get(Npcfid *root, char *path, void *buf, u32 count)
 #define AGET_CHUNK 4096
 char *
 npc_aget(Npcfid *root, char *path)
+{
+	int len;
+
+	return npc_aget_len(root, path, &len);
+}
+
+char *
+npc_aget_len(Npcfid *root, char *path, int *lenp)
 {
 	int n, len;
 	Npcfid *fid = NULL;
@@ -140,6 +148,7 @@ npc_aget(Npcfid *root, char *path)
 	if (npc_clunk (fid) < 0)
 		goto error;
 	s[len] = '\0';
+	*lenp = len;
 	return s;
 error:
 	if (s)
@@ -75,9 +75,9 @@ npc_getattr (Npcfid *fid, struct stat *sb)
 	ret = 0;
 done:
 	if (tc)
-		free(tc);
+		np_free_fcall(tc);
 	if (rc)
-		free(rc);	
+		np_free_fcall(rc);	
 	return ret;
 }
 
@@ -89,8 +89,8 @@ npc_walk(Npcfid *nfid, char *path)
 			np_uerror(ENOENT);
 			goto error;
 		}
-		free(tc);
-		free(rc);
+		np_free_fcall(tc);
+		np_free_fcall(rc);
 		if (!t || *s=='\0')
 			break;
 	}
@@ -100,9 +100,9 @@ npc_walk(Npcfid *nfid, char *path)
 
 error:
 	if (rc)
-		free(rc);
+		np_free_fcall(rc);
 	if (tc)
-		free(tc);
+		np_free_fcall(tc);
 	if (fid && nfid->fid == fid->fid) {
 		int saved_err = np_rerror ();
 		(void)npc_clunk (fid);
@@ -60,9 +60,9 @@ npc_pwrite(Npcfid *fid, void *buf, u32 count, u64 offset)
 	ret = rc->u.rwrite.count;
 done:
 	if (tc)
-		free(tc);
+		np_free_fcall(tc);
 	if (rc)
-		free(rc);
+		np_free_fcall(rc);
 	return ret;
 }
 
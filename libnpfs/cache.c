@@ -0,0 +1,397 @@
+/*****************************************************************************
+ *  Copyright (C) 2011 Lawrence Livermore National Security, LLC.
+ *  Written by Jim Garlick <garlick@llnl.gov> LLNL-CODE-423279
+ *  All Rights Reserved.
+ *
+ *  This file is part of the Distributed I/O Daemon (diod).
+ *  For details, see <http://code.google.com/p/diod/>.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/* cache.c - per-thread object caches */
+
+/* Objects of one size are kept in "magazines" (stacks of up to magsize
+ * objects).  Each thread has two magazines per cache, loaded and previous,
+ * and allocates from and frees to them without locking.  When both are
+ * empty (alloc) or full (free), a full or empty magazine is exchanged
+ * with the cache's depot, under the cache lock.  So a thread that only
+ * allocates (a connection reader) and one that only frees (a worker)
+ * meet at the depot once per magazine rather than once per object.
+ * (After J. Bonwick's magazine layer for the slab allocator.)
+ *
+ * Objects are allocated individually with malloc, so one that escapes
+ * the cache may simply be freed.  When a thread exits, the objects in its
+ * magazines are freed rather than kept in the depot, so workers that come
+ * and go with an elastic tpool don't leave memory behind.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <errno.h>
+#include <assert.h>
+#include "9p.h"
+#include "npfs.h"
+#include "xpthread.h"
+#include "npfsimpl.h"
+
+/* Aim for magazines and depots of about this many bytes.
+ */
+#define CACHE_MAG_BYTES		(256*1024)
+#define CACHE_MAG_MIN		4
+#define CACHE_MAG_MAX		64
+#define CACHE_DEPOT_BYTES	(8*1024*1024)
+#define CACHE_DEPOT_MIN		4
+
+typedef struct Npmag Npmag;
+struct Npmag {
+	Npmag		*next;
+	int		n;
+	void		*obj[];
+};
+
+typedef struct Npcachet Npcachet;
+struct Npcachet {
+	Npcache		*cache;
+	Npmag		*loaded;
+	Npmag		*prev;
+	u64		allocs;
+	u64		maghits;
+	u64		depothits;
+	u64		frees;
+	u64		releases;	/* frees that went back to malloc */
+	Npcachet	*next;
+};
+
+struct Npcache {
+	char		*name;
+	int		size;
+	int		magsize;
+	int		depotmax;
+	void		(*ctor)(void *);
+	void		(*dtor)(void *);
+	pthread_key_t	key;
+	pthread_mutex_t	lock;		/* protects all below */
+	Npmag		*full;
+	Npmag		*empty;
+	int		nfull;
+	int		nempty;
+	Npcachet	*threads;
+	u64		allocs;		/* totals from exited threads */
+	u64		maghits;
+	u64		depothits;
+	u64		frees;
+	u64		releases;
+	Npcache		*next;
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static Npcache *caches = NULL;
+
+static void *
+_obj_create (Npcache *c)
+{
+	void *obj;
+
+	if (!(obj = malloc (c->size)))
+		return NULL;
+	if (c->ctor)
+		c->ctor (obj);
+	return obj;
+}
+
+static void
+_obj_destroy (Npcache *c, void *obj)
+{
+	if (c->dtor)
+		c->dtor (obj);
+	free (obj);
+}
+
+static Npmag *
+_mag_create (Npcache *c)
+{
+	Npmag *m;
+
+	if (!(m = malloc (sizeof (*m) + c->magsize * sizeof (void *))))
+		return NULL;
+	m->next = NULL;
+	m->n = 0;
+	return m;
+}
+
+static void
+_mag_destroy (Npcache *c, Npmag *m)
+{
+	while (m->n > 0)
+		_obj_destroy (c, m->obj[--m->n]);
+	free (m);
+}
+
+/* Hand a thread's magazine back to the depot, or free it if the depot
+ * has enough.
+ */
+static void
+_mag_return (Npcache *c, Npmag *m)
+{
+	/* assert: c->lock held */
+	if (m->n > 0 && c->nfull < c->depotmax) {
+		m->next = c->full;
+		c->full = m;
+		c->nfull++;
+	} else if (m->n == 0 && c->nempty < c->depotmax) {
+		m->next = c->empty;
+		c->empty = m;
+		c->nempty++;
+	} else
+		_mag_destroy (c, m);
+}
+
+/* Called on thread exit (the c->key destructor):  flush the thread's
+ * magazines back to malloc.
+ */
+static void
+_thread_destroy (void *arg)
+{
+	Npcachet *t = arg;
+	Npcache *c = t->cache;
+	Npcachet **tp;
+
+	t->releases += t->loaded->n + t->prev->n;
+	xpthread_mutex_lock (&c->lock);
+	for (tp = &c->threads; *tp != NULL; tp = &(*tp)->next) {
+		if (*tp == t) {
+			*tp = t->next;
+			break;
+		}
+	}
+	c->allocs += t->allocs;
+	c->maghits += t->maghits;
+	c->depothits += t->depothits;
+	c->frees += t->frees;
+	c->releases += t->releases;
+	xpthread_mutex_unlock (&c->lock);
+	_mag_destroy (c, t->loaded);
+	_mag_destroy (c, t->prev);
+	free (t);
+}
+
+static Npcachet *
+_thread_get (Npcache *c)
+{
+	Npcachet *t;
+
+	if ((t = pthread_getspecific (c->key)))
+		return t;
+	if (!(t = malloc (sizeof (*t))))
+		return NULL;
+	memset (t, 0, sizeof (*t));
+	t->cache = c;
+	if (!(t->loaded = _mag_create (c)) || !(t->prev = _mag_create (c)))
+		goto error;
+	if (pthread_setspecific (c->key, t) != 0)
+		goto error;
+	xpthread_mutex_lock (&c->lock);
+	t->next = c->threads;
+	c->threads = t;
+	xpthread_mutex_unlock (&c->lock);
+	return t;
+error:
+	if (t->loaded)
+		free (t->loaded);
+	if (t->prev)
+		free (t->prev);
+	free (t);
+	return NULL;
+}
+
+Npcache *
+np_cache_create (char *name, int size, void (*ctor)(void *),
+		 void (*dtor)(void *))
+{
+	Npcache *c;
+	int err;
+
+	if (!(c = malloc (sizeof (*c)))) {
+		np_uerror (ENOMEM);
+		return NULL;
+	}
+	memset (c, 0, sizeof (*c));
+	if (!(c->name = strdup (name))) {
+		free (c);
+		np_uerror (ENOMEM);
+		return NULL;
+	}
+	if ((err = pthread_key_create (&c->key, _thread_destroy))) {
+		free (c->name);
+		free (c);
+		np_uerror (err);
+		return NULL;
+	}
+	c->size = size;
+	c->magsize = CACHE_MAG_BYTES / size;
+	if (c->magsize < CACHE_MAG_MIN)
+		c->magsize = CACHE_MAG_MIN;
+	if (c->magsize > CACHE_MAG_MAX)
+		c->magsize = CACHE_MAG_MAX;
+	c->depotmax = CACHE_DEPOT_BYTES / (size * c->magsize);
+	if (c->depotmax < CACHE_DEPOT_MIN)
+		c->depotmax = CACHE_DEPOT_MIN;
+	c->ctor = ctor;
+	c->dtor = dtor;
+	pthread_mutex_init (&c->lock, NULL);
+
+	xpthread_mutex_lock (&cache_lock);
+	c->next = caches;
+	caches = c;
+	xpthread_mutex_unlock (&cache_lock);
+	return c;
+}
+
+void *
+np_cache_alloc (Npcache *c)
+{
+	Npcachet *t;
+	Npmag *m;
+
+	if (!(t = _thread_get (c)))
+		return _obj_create (c);
+	t->allocs++;
+	if (t->loaded->n == 0 && t->prev->n > 0) {
+		m = t->loaded;
+		t->loaded = t->prev;
+		t->prev = m;
+	}
+	if (t->loaded->n > 0) {
+		t->maghits++;
+		return t->loaded->obj[--t->loaded->n];
+	}
+	xpthread_mutex_lock (&c->lock);
+	if ((m = c->full)) {
+		c->full = m->next;
+		c->nfull--;
+		_mag_return (c, t->prev);
+		t->prev = t->loaded;
+		t->loaded = m;
+	}
+	xpthread_mutex_unlock (&c->lock);
+	if (!m)
+		return _obj_create (c);
+	t->depothits++;
+	return t->loaded->obj[--t->loaded->n];
+}
+
+void
+np_cache_free (Npcache *c, void *obj)
+{
+	Npcachet *t;
+	Npmag *m = NULL;
+
+	if (!(t = _thread_get (c))) {
+		_obj_destroy (c, obj);
+		return;
+	}
+	t->frees++;
+	if (t->loaded->n == c->magsize && t->prev->n == 0) {
+		m = t->loaded;
+		t->loaded = t->prev;
+		t->prev = m;
+	}
+	if (t->loaded->n < c->magsize) {
+		t->loaded->obj[t->loaded->n++] = obj;
+		return;
+	}
+	xpthread_mutex_lock (&c->lock);
+	if (c->nfull < c->depotmax) {
+		if ((m = c->empty)) {
+			c->empty = m->next;
+			c->nempty--;
+		} else
+			m = _mag_create (c);
+		if (m) {
+			t->prev->next = c->full;
+			c->full = t->prev;
+			c->nfull++;
+			t->prev = t->loaded;
+			t->loaded = m;
+		}
+	} else
+		m = NULL;
+	xpthread_mutex_unlock (&c->lock);
+	if (!m) {
+		t->releases++;
+		_obj_destroy (c, obj);
+		return;
+	}
+	t->loaded->obj[t->loaded->n++] = obj;
+}
+
+/* Append one line per cache to *sp:
+ *   name objsize magsize allocs maghits depothits frees releases depotmags
+ *   retained
+ * where retained is the bytes of free objects held in the depot and in
+ * thread magazines.  Counters of running threads are read without their
+ * cooperation, so they may lag a little.
+ */
+int
+np_cache_report (char **sp, int *lp)
+{
+	Npcache *c;
+	Npcachet *t;
+	Npmag *m;
+	u64 allocs, maghits, depothits, frees, releases, nobj;
+	int n = 0;
+
+	xpthread_mutex_lock (&cache_lock);
+	for (c = caches; c != NULL && n >= 0; c = c->next) {
+		xpthread_mutex_lock (&c->lock);
+		allocs = c->allocs;
+		maghits = c->maghits;
+		depothits = c->depothits;
+		frees = c->frees;
+		releases = c->releases;
+		nobj = 0;
+		for (m = c->full; m != NULL; m = m->next)
+			nobj += m->n;
+		for (t = c->threads; t != NULL; t = t->next) {
+			allocs += t->allocs;
+			maghits += t->maghits;
+			depothits += t->depothits;
+			frees += t->frees;
+			releases += t->releases;
+			nobj += __atomic_load_n (&t->loaded->n, __ATOMIC_RELAXED);
+			nobj += __atomic_load_n (&t->prev->n, __ATOMIC_RELAXED);
+		}
+		n = aspf (sp, lp, "%s %d %d %"PRIu64" %"PRIu64" %"PRIu64
+			  " %"PRIu64" %"PRIu64" %d %"PRIu64"\n", c->name,
+			  c->size, c->magsize, allocs, maghits, depothits,
+			  frees, releases, c->nfull, nobj * c->size);
+		xpthread_mutex_unlock (&c->lock);
+	}
+	xpthread_mutex_unlock (&cache_lock);
+	if (n < 0) {
+		np_uerror (ENOMEM);
+		return -1;
+	}
+	return 0;
+}
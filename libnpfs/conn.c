@@ -32,6 +32,7 @@
 #include <errno.h>
 #include <pthread.h>
 #include <signal.h>
+#include <time.h>
 #include <assert.h>
 
 #include "9p.h"
@@ -39,6 +40,10 @@
 #include "xpthread.h"
 #include "npfsimpl.h"
 
+/* Most responses handed to the transport in one np_trans_sendv ().
+ */
+#define NP_CONN_SENDMAX	64
+
 static void *np_conn_read_proc(void *);
 static void np_conn_flush (Npconn *conn);
 static void np_conn_destroy(Npconn *conn);
@@ -56,8 +61,16 @@ np_conn_create(Npsrv *srv, Nptrans *trans, char *client_id)
 	pthread_mutex_init(&conn->lock, NULL);
 	pthread_mutex_init(&conn->wlock, NULL);
 	pthread_cond_init(&conn->refcond, NULL);
+	pthread_cond_init(&conn->sendcond, NULL);
+	pthread_mutex_init(&conn->tlock, NULL);
+	memset(conn->tagtab, 0, sizeof(conn->tagtab));
+	memset(&conn->acct, 0, sizeof(conn->acct));
+	conn->qdepth = 0;
 
 	conn->refcount = 0;
+	conn->refwaiters = 0;
+	conn->sendq_first = conn->sendq_last = NULL;
+	conn->sending = 0;
 	conn->srv = srv;
 	conn->msize = srv->msize;
 	conn->shutdown = 0;
@@ -71,8 +84,29 @@ np_conn_create(Npsrv *srv, Nptrans *trans, char *client_id)
 
 	conn->trans = trans;
 	conn->aux = NULL;
-	np_srv_add_conn(srv, conn);
+	conn->reactor = NULL;
+	conn->rnext = NULL;
+	conn->rbusy = 0;
+	conn->snext = NULL;
+	if ((srv->flags & SRV_FLAGS_ZEROCOPY) && trans->splice)
+		trans->zcrecv = 1;
+	if (!np_srv_add_conn(srv, conn)) {
+		np_fidpool_destroy (conn->fidpool);
+		free (conn);
+		np_trans_destroy (trans);
+		return NULL;
+	}
 
+	/* With SRV_FLAGS_REACTOR, a shared epoll thread reads the connection
+	 * in place of a dedicated read thread, if the transport allows.
+	 */
+	if ((srv->flags & SRV_FLAGS_REACTOR) && trans->recv_nb
+				&& trans->fd >= 0) {
+		Npreactor *r = np_srv_get_reactor (srv);
+
+		if (r && np_reactor_add (r, conn) == 0)
+			return conn;
+	}
 	err = pthread_create(&conn->rthread, NULL, np_conn_read_proc, conn);
 	if (err != 0) {
 		np_conn_destroy (conn);
@@ -83,22 +117,58 @@ np_conn_create(Npsrv *srv, Nptrans *trans, char *client_id)
 	return conn;
 }
 
+/* The refcount is adjusted atomically.  conn->lock is only taken by a
+ * decref that may need to wake a thread on refcond:  the last one, which
+ * np_conn_finish () waits for, or any while refwaiters is nonzero.
+ * The others don't touch conn after their decrement, since the conn may
+ * be destroyed as soon as the count reaches zero.  A waiter that arrives
+ * during a lockless decref may miss it, but only np_conn_sendwait () waits
+ * for a count other than zero, and it does so with a timeout.
+ */
 void
 np_conn_incref(Npconn *conn)
 {
-	xpthread_mutex_lock(&conn->lock);
-	conn->refcount++;
-	xpthread_mutex_unlock(&conn->lock);
+	__atomic_add_fetch (&conn->refcount, 1, __ATOMIC_SEQ_CST);
 }
 
 void
 np_conn_decref(Npconn *conn)
 {
+	int n = __atomic_load_n (&conn->refcount, __ATOMIC_SEQ_CST);
+
+	assert(n > 0);
+	while (n > 1 && __atomic_load_n (&conn->refwaiters,
+					 __ATOMIC_SEQ_CST) == 0) {
+		if (__atomic_compare_exchange_n (&conn->refcount, &n, n - 1, 0,
+				__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+			return;
+	}
+	xpthread_mutex_lock(&conn->lock);
+	__atomic_sub_fetch (&conn->refcount, 1, __ATOMIC_SEQ_CST);
+	xpthread_cond_broadcast(&conn->refcond);
+	xpthread_mutex_unlock(&conn->lock);
+}
+
+/* Wait until conn's refcount is at most n, or until the absolute time
+ * ts if not NULL.
+ */
+static void
+np_conn_waitref(Npconn *conn, int n, struct timespec *ts)
+{
+	int err = 0;
+
 	xpthread_mutex_lock(&conn->lock);
-	assert(conn->refcount > 0);
-	conn->refcount--;
+	__atomic_add_fetch (&conn->refwaiters, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n (&conn->refcount, __ATOMIC_SEQ_CST) > n
+							&& err != ETIMEDOUT) {
+		if (ts)
+			err = pthread_cond_timedwait(&conn->refcond,
+						     &conn->lock, ts);
+		else
+			xpthread_cond_wait(&conn->refcond, &conn->lock);
+	}
+	__atomic_sub_fetch (&conn->refwaiters, 1, __ATOMIC_SEQ_CST);
 	xpthread_mutex_unlock(&conn->lock);
-	xpthread_cond_signal(&conn->refcond);
 }
 
 static void
@@ -115,8 +185,11 @@ np_conn_destroy(Npconn *conn)
 		conn->trans = NULL;
 	}
 	pthread_mutex_destroy(&conn->lock);
+	assert(conn->sendq_first == NULL);
 	pthread_mutex_destroy(&conn->wlock);
 	pthread_cond_destroy(&conn->refcond);
+	pthread_cond_destroy(&conn->sendcond);
+	pthread_mutex_destroy(&conn->tlock);
 
 	np_srv_remove_conn (conn->srv, conn);
 	free(conn);
@@ -131,6 +204,80 @@ _debug_trace (Npsrv *srv, Npfcall *fc)
 	np_logmsg(srv, "%s", s);
 }
 
+/* Encapsulate fc in a request and hand it to srv worker threads.
+ * Returns -1 (having freed fc) if the connection must be dropped.
+ */
+int
+np_conn_dispatch(Npconn *conn, Npfcall *fc)
+{
+	Npsrv *srv = conn->srv;
+	Npreq *req;
+
+	if ((srv->flags & SRV_FLAGS_DEBUG_9PTRACE))
+		_debug_trace (srv, fc);
+
+	/* In np_req_alloc, req->fid is looked up/initialized.
+	 */
+	req = np_req_alloc(conn, fc);
+	if (!req) {
+		np_logmsg (srv, "out of memory in receive path - "
+			   "dropping connection to '%s'",
+			   conn->client_id);
+		np_free_fcall (fc);
+		return -1;
+	}
+
+	/* Enqueue request for processing by next available worker
+	 * thread, except P9_TFLUSH which is handled immediately.
+	 * A reactor mustn't wait on one client's socket, so it leaves
+	 * sending the Rflush to a sender thread.
+	 */
+	if (fc->type == P9_TFLUSH) {
+		Npfcall *rc;
+
+		if (conn->reactor)
+			req->nowait = 1;
+		rc = np_flush (req, fc);
+		np_req_respond (req, rc);
+		np_req_unref(req);
+		np_tpool_account(srv->tpool, P9_TFLUSH, NULL);
+	} else
+		np_srv_add_req(srv, req);
+	return 0;
+}
+
+/* Tear down a connection after EOF on read, or some other fatal error
+ * for the connection like out of memory.
+ */
+static void
+np_conn_finish(Npconn *conn)
+{
+	np_conn_flush (conn);
+
+	np_conn_waitref(conn, 0, NULL);
+	np_conn_destroy(conn);
+}
+
+static void *
+np_conn_finish_proc(void *a)
+{
+	pthread_detach(pthread_self());
+	np_conn_finish ((Npconn *)a);
+	return NULL;
+}
+
+/* Like np_conn_finish (), but don't make a reactor thread wait for
+ * in-flight requests to complete.
+ */
+void
+np_conn_finish_async(Npconn *conn)
+{
+	pthread_t t;
+
+	if (pthread_create (&t, NULL, np_conn_finish_proc, conn) != 0)
+		np_conn_finish (conn);
+}
+
 /* Per-connection read thread.
  */
 static void *
@@ -138,7 +285,6 @@ np_conn_read_proc(void *a)
 {
 	Npconn *conn = (Npconn *)a;
 	Npsrv *srv = conn->srv;
-	Npreq *req;
 	Npfcall *fc;
 
 	pthread_detach(pthread_self());
@@ -152,85 +298,205 @@ np_conn_read_proc(void *a)
 		}
 		if (!fc)
 			break;
-		if ((srv->flags & SRV_FLAGS_DEBUG_9PTRACE))
-			_debug_trace (srv, fc);
-
-		/* Encapsulate fc in a request and hand to srv worker threads.
-		 * In np_req_alloc, req->fid is looked up/initialized.
-		 */
-		req = np_req_alloc(conn, fc);
-		if (!req) {
-			np_logmsg (srv, "out of memory in receive path - "
-				   "dropping connection to '%s'",
-				   conn->client_id);
-			free (fc);
+		if (np_conn_dispatch (conn, fc) < 0)
 			break;
-		}
+	}
+	np_conn_finish (conn);
+
+	return NULL;
+}
+
+static void
+np_conn_flush (Npconn *conn)
+{
+	np_srv_flush_reqs(conn, -1);
+}
 
-		/* Enqueue request for processing by next available worker
-		 * thread, except P9_TFLUSH which is handled immediately.
-		 */
-		if (fc->type == P9_TFLUSH) {
-			Npfcall *rc;
-
-			rc = np_flush (req, fc);
-			np_req_respond (req, rc);
-			np_req_unref(req);
-
-			xpthread_mutex_lock (&srv->lock);
-			srv->tpool->stats.nreqs[P9_TFLUSH]++;
-			xpthread_mutex_unlock (&srv->lock);
-		} else {
-			xpthread_mutex_lock(&srv->lock);	
-			np_srv_add_req(srv, req);
-			xpthread_mutex_unlock(&srv->lock);	
+/* Send responses from conn->sendq until it is empty, then zc (if not NULL)
+ * once everything queued ahead of it has gone.  Up to NP_CONN_SENDMAX
+ * responses go to the transport at a time.
+ * Called and returns with conn->wlock held and conn->sending set.
+ */
+static void
+np_conn_drain(Npconn *conn, Npfcall *zc)
+{
+	Npfcall *fc, *batch[NP_CONN_SENDMAX + 1];
+	int i, n;
+
+	for (;;) {
+		for (n = 0; n < NP_CONN_SENDMAX && conn->sendq_first; n++) {
+			fc = conn->sendq_first;
+			conn->sendq_first = fc->next;
+			fc->next = NULL;
+			batch[n] = fc;
 		}
+		if (!conn->sendq_first)
+			conn->sendq_last = NULL;
+		if (zc && !conn->sendq_first) {
+			batch[n++] = zc;
+			zc = NULL;
+		}
+		if (n == 0)
+			break;
+		xpthread_mutex_unlock(&conn->wlock);
+		if (np_trans_sendv(conn->trans, batch, n) < 0)
+			np_logerr (conn->srv, "send to '%s'", conn->client_id);
+		for (i = 0; i < n; i++) {
+			if (!batch[i]->zcpipe)
+				np_free_fcall(batch[i]);
+		}
+		xpthread_mutex_lock(&conn->wlock);
 	}
-	/* Just got EOF on read, or some other fatal error for the
-	 * connection like out of memory.
-	 */
+}
 
-	np_conn_flush (conn);
+/* Give the other requests on conn up to srv->sendwait_us to respond, so
+ * their responses go out with this one.  Each request holds a conn
+ * reference until it has responded (or been flushed), ours included.
+ * Called and returns with conn->wlock held.
+ */
+static void
+np_conn_sendwait(Npconn *conn)
+{
+	struct timespec ts;
 
-	xpthread_mutex_lock(&conn->lock);
-	while (conn->refcount > 0)
-		xpthread_cond_wait(&conn->refcond, &conn->lock);
-	xpthread_mutex_unlock(&conn->lock);
-	np_conn_destroy(conn);
+	if (__atomic_load_n (&conn->refcount, __ATOMIC_SEQ_CST) <= 1)
+		return;
+	xpthread_mutex_unlock(&conn->wlock);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += conn->srv->sendwait_us * 1000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec += ts.tv_nsec / 1000000000L;
+		ts.tv_nsec %= 1000000000L;
+	}
+	np_conn_waitref(conn, 1, &ts);
+	xpthread_mutex_lock(&conn->wlock);
+}
+
+/* Threads that reply with req->nowait set, such as reactors answering
+ * Tflush or I/O completion threads, mustn't block on a client that isn't
+ * reading.  If nobody is sending on the connection, they take the sender
+ * role on its behalf and hand the connection to one of SENDER_THREADS
+ * threads, started on first use.  A sender blocked on one client leaves
+ * the others free for other connections.
+ */
+#define SENDER_THREADS	4
+
+static void
+np_conn_send_queued(Npconn *conn)
+{
+	xpthread_mutex_lock(&conn->wlock);
+	np_conn_drain(conn, NULL);
+	conn->sending = 0;
+	xpthread_mutex_unlock(&conn->wlock);
+	xpthread_cond_broadcast(&conn->sendcond);
+}
+
+static void *
+np_conn_sender_proc(void *a)
+{
+	Npsrv *srv = (Npsrv *)a;
+	Npconn *conn;
+
+	xpthread_mutex_lock(&srv->sendlock);
+	for (;;) {
+		while (!srv->sendconns_first && !srv->sendshutdown)
+			xpthread_cond_wait(&srv->sendcond, &srv->sendlock);
+		if (!(conn = srv->sendconns_first))
+			break;
+		if (!(srv->sendconns_first = conn->snext))
+			srv->sendconns_last = NULL;
+		conn->snext = NULL;
+		xpthread_mutex_unlock(&srv->sendlock);
+
+		np_conn_send_queued(conn);
+		np_conn_decref(conn);
 
+		xpthread_mutex_lock(&srv->sendlock);
+	}
+	xpthread_mutex_unlock(&srv->sendlock);
 	return NULL;
 }
 
-static void
-np_conn_flush (Npconn *conn)
+static int
+np_conn_senders_create(Npsrv *srv)
 {
-	Nptpool *tp;
-	Npreq *creq, *nextreq;
-
-	xpthread_mutex_lock(&conn->srv->lock);
-	for (tp = conn->srv->tpool; tp != NULL; tp = tp->next) {
-		for (creq = tp->reqs_first; creq != NULL; creq = nextreq) {
-			nextreq = creq->next;
-			if (creq->conn != conn)
-				continue;
-			np_srv_remove_req(tp, creq);
-			np_req_unref(creq);
+	int err;
+
+	/* assert: srv->sendlock held */
+	if (!(srv->senders = malloc (SENDER_THREADS * sizeof (pthread_t)))) {
+		np_uerror (ENOMEM);
+		return -1;
+	}
+	for (srv->nsender = 0; srv->nsender < SENDER_THREADS; srv->nsender++) {
+		err = pthread_create (&srv->senders[srv->nsender], NULL,
+				      np_conn_sender_proc, srv);
+		if (err) {
+			np_uerror (err);
+			break;
 		}
-		for (creq = tp->workreqs; creq != NULL; creq = creq->next) {
-			if (creq->conn != conn)
-				continue;
-			creq->flushed = 1;
-			if (conn->srv->flags & SRV_FLAGS_FLUSHSIG)
-				pthread_kill (creq->wthread->thread, SIGUSR2);
+	}
+	return srv->nsender > 0 ? 0 : -1;
+}
+
+void
+np_conn_senders_destroy(Npsrv *srv)
+{
+	int i, err;
+
+	xpthread_mutex_lock(&srv->sendlock);
+	srv->sendshutdown = 1;
+	xpthread_cond_broadcast(&srv->sendcond);
+	xpthread_mutex_unlock(&srv->sendlock);
+	for (i = 0; i < srv->nsender; i++) {
+		if ((err = pthread_join (srv->senders[i], NULL))) {
+			np_uerror (err);
+			np_logerr (srv, "join sender thread");
 		}
 	}
-	xpthread_mutex_unlock(&conn->srv->lock);
+	if (srv->senders)
+		free (srv->senders);
+	srv->senders = NULL;
+	srv->nsender = 0;
 }
 
+/* Hand conn, whose sender role the caller has taken, to a sender thread.
+ */
+static void
+np_conn_handoff(Npconn *conn)
+{
+	Npsrv *srv = conn->srv;
+
+	np_conn_incref(conn);
+	xpthread_mutex_lock(&srv->sendlock);
+	if (srv->sendshutdown
+		|| (!srv->senders && np_conn_senders_create (srv) < 0)) {
+		xpthread_mutex_unlock(&srv->sendlock);
+		np_conn_send_queued(conn);
+		np_conn_decref(conn);
+		return;
+	}
+	if (srv->sendconns_last)
+		srv->sendconns_last->snext = conn;
+	else
+		srv->sendconns_first = conn;
+	srv->sendconns_last = conn;
+	xpthread_cond_signal(&srv->sendcond);
+	xpthread_mutex_unlock(&srv->sendlock);
+}
+
+/* Responses are appended to conn->sendq, and whichever thread finds no
+ * other sending drains it, so responses that become ready while a send is
+ * in progress go out together in the next one.  Only if srv->sendwait_us
+ * is set does the sender also wait for outstanding requests on the
+ * connection to join in:  that holds up every reply on a pipelined
+ * connection, so it is off by default.  Workers other than the sender
+ * return without waiting at all.
+ * The queue takes ownership of req->rcall, except for an Rread with data
+ * in a (per-thread) splice pipe, which is sent before returning.
+ */
 void
 np_conn_respond(Npreq *req)
 {
-	int n;
 	Npconn *conn = req->conn;
 	Npsrv *srv = conn->srv;
 	Npfcall *rc = req->rcall;
@@ -238,10 +504,67 @@ np_conn_respond(Npreq *req)
 	if ((srv->flags & SRV_FLAGS_DEBUG_9PTRACE))
 		_debug_trace (srv, rc);
 	xpthread_mutex_lock(&conn->wlock);
-	n = np_trans_send(conn->trans, rc);
+	if (rc->zcpipe) {	/* never nowait */
+		while (conn->sending)
+			xpthread_cond_wait(&conn->sendcond, &conn->wlock);
+	} else {
+		req->rcall = NULL;
+		if (conn->sendq_last)
+			conn->sendq_last->next = rc;
+		else
+			conn->sendq_first = rc;
+		conn->sendq_last = rc;
+		rc = NULL;
+		if (conn->sending) {
+			xpthread_mutex_unlock(&conn->wlock);
+			return;
+		}
+	}
+	conn->sending = 1;
+	if (!rc && req->nowait) {
+		xpthread_mutex_unlock(&conn->wlock);
+		np_conn_handoff(conn);
+		return;
+	}
+	if (!rc && srv->sendwait_us > 0)
+		np_conn_sendwait(conn);
+	np_conn_drain(conn, rc);
+	conn->sending = 0;
 	xpthread_mutex_unlock(&conn->wlock);
-	if (n < 0)
-		np_logerr (srv, "send to '%s'", conn->client_id);
+	xpthread_cond_broadcast(&conn->sendcond);
+}
+
+/* Requests are indexed by tag from np_req_alloc () until freed, so that
+ * np_srv_flush_reqs () need only look at this connection's requests.
+ */
+void
+np_conn_add_req(Npconn *conn, Npreq *req)
+{
+	Npreq **head = &conn->tagtab[req->tag % TAG_HTABLE_SIZE];
+
+	xpthread_mutex_lock(&conn->tlock);
+	req->tprev = NULL;
+	req->tnext = *head;
+	if (*head)
+		(*head)->tprev = req;
+	*head = req;
+	__atomic_add_fetch (&conn->acct.outstanding, 1, __ATOMIC_RELAXED);
+	xpthread_mutex_unlock(&conn->tlock);
+}
+
+void
+np_conn_remove_req(Npconn *conn, Npreq *req)
+{
+	xpthread_mutex_lock(&conn->tlock);
+	if (req->tprev)
+		req->tprev->tnext = req->tnext;
+	else
+		conn->tagtab[req->tag % TAG_HTABLE_SIZE] = req->tnext;
+	if (req->tnext)
+		req->tnext->tprev = req->tprev;
+	req->tnext = req->tprev = NULL;
+	__atomic_sub_fetch (&conn->acct.outstanding, 1, __ATOMIC_RELAXED);
+	xpthread_mutex_unlock(&conn->tlock);
 }
 
 char *
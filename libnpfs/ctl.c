@@ -47,6 +47,7 @@
 typedef struct {
 	Npfile	*file;
 	void	*data;
+	int	len;
 } Fid;
 
 static char *_ctl_get_version (char *name, void *a);
@@ -217,6 +218,21 @@ np_ctl_addfile (Npfile *parent, char *name, SynGetF getf, void *arg, int flags)
 	return file;
 }
 
+/* Add a file whose content may contain NUL bytes, so getf returns
+ * its length.
+ */
+Npfile *
+np_ctl_addfile_bin (Npfile *parent, char *name, SynGetBinF getf, void *arg,
+		    int flags)
+{
+	Npfile *file;
+
+	if (!(file = np_ctl_addfile (parent, name, NULL, arg, flags)))
+		return NULL;
+	file->getbinf = getf;
+	return file;
+}
+
 Npfile *
 np_ctl_adddir (Npfile *parent, char *name)
 {
@@ -392,7 +408,7 @@ np_ctl_lopen(Npfid *fid, u32 mode)
 		goto done;
 	}
 	if (((mode & O_RDONLY) || (mode & O_RDWR)) && !f->file->getf
-				&& !(fid->type & P9_QTDIR)
+				&& !f->file->getbinf && !(fid->type & P9_QTDIR)
 				&& !(f->file->flags & NP_CTL_FLAGS_ZEROSRC)){
 		np_uerror (EACCES);
 		goto done;
@@ -427,8 +443,14 @@ np_ctl_read(Npfid *fid, u64 offset, u32 count, Npreq *req)
 		f->data = f->file->getf (f->file->name, f->file->getf_arg);
 		if (!f->data && np_rerror ())
 			goto done;
+		f->len = f->data ? strlen (f->data) : 0;
+	} else if (!f->data && f->file->getbinf) {
+		f->data = f->file->getbinf (f->file->name, f->file->getf_arg,
+					    &f->len);
+		if (!f->data && np_rerror ())
+			goto done;
 	}
-	len = f->data ? strlen (f->data) : 0;
+	len = f->data ? f->len : 0;
 	if (offset > len)
 		offset = len;
 	if (count > len - offset)
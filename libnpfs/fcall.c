@@ -251,31 +251,9 @@ error:
 Npfcall*
 np_flush(Npreq *req, Npfcall *tc)
 {
-	u16 oldtag = tc->u.tflush.oldtag;
-	Npreq *creq;
 	Npfcall *ret;
-	Nptpool *tp;
-
-	xpthread_mutex_lock(&req->conn->srv->lock);
-	for (tp = req->conn->srv->tpool; tp != NULL; tp = tp->next) {
-		for(creq = tp->reqs_first; creq != NULL; creq = creq->next) {
-			if (!(creq->conn==req->conn && creq->tag==oldtag))
-				continue;
-			np_srv_remove_req(tp, creq);
-			np_req_unref(creq);
-			goto done;
-		}
-		for(creq = tp->workreqs; creq != NULL; creq = creq->next) {
-			if (!(creq->conn==req->conn && creq->tag==oldtag))
-				continue;
-			creq->flushed = 1;
-			if (req->conn->srv->flags & SRV_FLAGS_FLUSHSIG)
-				pthread_kill (creq->wthread->thread, SIGUSR2);
-			goto done;
-		}
-	}
-done:
-	xpthread_mutex_unlock(&req->conn->srv->lock);
+
+	np_srv_flush_reqs(req->conn, tc->u.tflush.oldtag);
 	if (!(ret = np_create_rflush ()))
 		np_uerror (ENOMEM);
 	return ret;
@@ -412,7 +390,7 @@ np_read(Npreq *req, Npfcall *tc)
 			if (n >= 0) 
 				np_set_rread_count(rc, n);
 			else {
-				free(rc);
+				np_free_fcall(rc);
 				rc = NULL;
 			}
 		} else
@@ -455,6 +433,12 @@ np_write(Npreq *req, Npfcall *tc)
 		np_logerr (conn->srv, "write: invalid fid");
 		goto done;
 	}
+	/* Only srv->write takes data left in a pipe by the transport.
+	 */
+	if (tc->zcpipe && (fid->type & (P9_QTAUTH | P9_QTTMP))) {
+		if (np_splice_pull(tc, tc->u.twrite.data) < 0)
+			goto done;
+	}
 	if (fid->type & P9_QTAUTH) {
 		if (conn->srv->auth) {
 			n = conn->srv->auth->write(fid, tc->u.twrite.offset,
@@ -976,7 +960,7 @@ np_fsync(Npreq *req, Npfcall *tc)
 			np_uerror (ENOSYS);
 			goto done;
 		}
-		rc = (*req->conn->srv->fsync)(fid);
+		rc = (*req->conn->srv->fsync)(fid, req);
 	}
 done:
 	return rc;
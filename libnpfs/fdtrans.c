@@ -29,24 +29,58 @@
 #include <stdint.h>
 #include <stdarg.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <errno.h>
 #include <assert.h>
 #include "9p.h"
 #include "npfs.h"
 #include "npfsimpl.h"
 
+/* Incoming data is read into a per-connection buffer, FDTRANS_BUFSIZE
+ * at a time, and complete messages are copied out of it, so a client that
+ * pipelines small requests costs one read(2) per buffer-full rather than
+ * per message.  Messages larger than FDTRANS_DIRECT are instead read
+ * straight into their Npfcall once their header has been seen.
+ * The buffer is released while the connection is idle:  at once in
+ * non-blocking mode (SRV_FLAGS_REACTOR), else after FDTRANS_IDLE_MS.
+ * With Nptrans->zcrecv, the payload of a large Twrite is instead spliced
+ * into a pipe (see splice.c), and the buffer is filled FDTRANS_DIRECT at
+ * a time so that little of that payload is read with the header.
+ */
+#define FDTRANS_BUFSIZE		65536
+#define FDTRANS_DIRECT		8192
+#define FDTRANS_IDLE_MS		1000
+
+/* Most iovecs written at once by np_fdtrans_sendv () */
+#define FDTRANS_IOVMAX		128
+
+/* size[4] Twrite tag[2] fid[4] offset[8] count[4] */
+#define FDTRANS_TWRITEHDR	23
+
 typedef struct Fdtrans Fdtrans;
 
 struct Fdtrans {
 	Nptrans*	trans;
 	int 		fdin;
 	int		fdout;
-	Npfcall		*fc;
-	int		fc_msize;
+	u8		*rbuf;
+	int		rpos;	/* start of unconsumed data in rbuf */
+	int		rlen;	/* length of unconsumed data */
+	Npfcall		*pfc;	/* large message being read in place */
+	int		plen;	/*   bytes of it read so far */
+	int		nonblock;
+	int		nodelay;	/* TCP_NODELAY set (or not TCP) */
 };
 
 static int np_fdtrans_recv(Npfcall **fcp, u32 msize, void *a);
+static int np_fdtrans_recv_nb(Npfcall **fcp, u32 msize, void *a);
 static int np_fdtrans_send(Npfcall *fc, void *a);
+static int np_fdtrans_sendv(Npfcall **fcs, int n, void *a);
 static void np_fdtrans_destroy(void *a);
 
 Nptrans *
@@ -63,8 +97,12 @@ np_fdtrans_create(int fdin, int fdout)
 
 	fdt->fdin = fdin;
 	fdt->fdout = fdout;
-	fdt->fc = NULL;
-	fdt->fc_msize = 0;
+	fdt->rbuf = NULL;
+	fdt->rpos = fdt->rlen = 0;
+	fdt->pfc = NULL;
+	fdt->plen = 0;
+	fdt->nonblock = 0;
+	fdt->nodelay = 0;
 	npt = np_trans_create(fdt, np_fdtrans_recv,
 				   np_fdtrans_send,
 				   np_fdtrans_destroy);
@@ -72,6 +110,10 @@ np_fdtrans_create(int fdin, int fdout)
 		free(fdt);
 		return NULL;
 	}
+	npt->fd = fdin;
+	npt->recv_nb = np_fdtrans_recv_nb;
+	npt->splice = 1;
+	npt->sendv = np_fdtrans_sendv;
 
 	fdt->trans = npt;
 	return npt;
@@ -87,88 +129,361 @@ np_fdtrans_destroy(void *a)
 		(void)close(fdt->fdin);
 	if (fdt->fdout >= 0 && fdt->fdout != fdt->fdin)
 		(void)close(fdt->fdout);
-	if (fdt->fc)
-		free(fdt->fc);
+	if (fdt->rbuf)
+		free(fdt->rbuf);
+	if (fdt->pfc)
+		np_free_fcall(fdt->pfc);
 
 	free(fdt);
 }
 
+/* Start splicing the rest of a large Twrite into a pipe.  The payload
+ * already read is moved to the pipe too, so it holds all of the data.
+ * On failure, carry on reading the message in place.
+ */
+static void
+np_fdtrans_zcstart(Fdtrans *fdt, Npfcall *fc, int size)
+{
+	int n, len = fdt->plen - FDTRANS_TWRITEHDR;
+
+	if (!(fc->zcpipe = np_pipe_get(size - FDTRANS_TWRITEHDR)))
+		return;
+	if (len > 0) {
+		n = write(fc->zcpipe->wfd, fc->pkt + FDTRANS_TWRITEHDR, len);
+		if (n > 0)
+			fc->zclen = n;
+		if (n != len) {
+			np_splice_pull(fc, fc->pkt + FDTRANS_TWRITEHDR);
+			return;
+		}
+	}
+	fdt->plen = FDTRANS_TWRITEHDR;
+}
+
+/* Splice more of a Twrite payload into its pipe.  Returns > 0 on
+ * progress, else as read(2).
+ * If the pipe fills up (each packet takes at least a page of it), fall
+ * back to reading the message in place.
+ */
+static int
+np_fdtrans_zcread(Fdtrans *fdt, Npfcall *fc, int size)
+{
+	struct pollfd pfd = { .fd = fc->zcpipe->wfd, .events = POLLOUT };
+	int n, len;
+
+	for (;;) {
+		n = splice(fdt->fdin, NULL, fc->zcpipe->wfd, NULL,
+			   size - fdt->plen - fc->zclen,
+			   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (n > 0) {
+			fc->zclen += n;
+			return n;
+		}
+		if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+			return n;
+		if (poll(&pfd, 1, 0) == 0) {
+			len = fc->zclen;
+			if (np_splice_pull(fc, fc->pkt + fdt->plen) < 0)
+				return -1;
+			fdt->plen += len;
+			return 1;
+		}
+		if (fdt->nonblock) {
+			errno = EAGAIN;
+			return -1;
+		}
+		pfd.fd = fdt->fdin;	/* wait for the socket */
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			return -1;
+		pfd.fd = fc->zcpipe->wfd;
+		pfd.events = POLLOUT;
+	}
+}
+
+/* In blocking mode, wait for more input once the buffer is drained, and
+ * release the buffer if none arrives within FDTRANS_IDLE_MS.
+ * Returns 0 when input is ready, or -1 as poll(2), e.g. on EINTR.
+ */
+static int
+np_fdtrans_idle(Fdtrans *fdt)
+{
+	struct pollfd pfd = { .fd = fdt->fdin, .events = POLLIN };
+	int n;
+
+	if ((n = poll(&pfd, 1, FDTRANS_IDLE_MS)) == 0) {
+		free (fdt->rbuf);
+		fdt->rbuf = NULL;
+		fdt->rpos = 0;
+		n = poll(&pfd, 1, -1);
+	}
+	return n < 0 ? -1 : 0;
+}
+
+/* Return 1 with the next message in *fcp (NULL on EOF), or 0 if the fd
+ * is non-blocking and a complete message has yet to arrive, or -1 on error.
+ * The Npfcall is allocated to fit the message rather than at msize:
+ * small requests may sit in a tpool queue for a while, and
+ * np_alloc_fcall () can take them from a small size class.
+ */
+static int
+np_fdtrans_fill(Fdtrans *fdt, Npfcall **fcp, u32 msize)
+{
+	Npfcall *fc;
+	int n, size;
+
+	for (;;) {
+		if ((fc = fdt->pfc)) {
+			size = np_peek_size(fc->pkt, fdt->plen);
+			if (fdt->plen + fc->zclen == size) {
+				fdt->pfc = NULL;
+				break;
+			}
+			if (fc->zcpipe) {
+				if ((n = np_fdtrans_zcread(fdt, fc, size)) <= 0)
+					goto readerr;
+				continue;
+			}
+			n = read(fdt->fdin, fc->pkt + fdt->plen,
+				 size - fdt->plen);
+			if (n <= 0)
+				goto readerr;
+			fdt->plen += n;
+			continue;
+		}
+		if (fdt->rlen >= 4) {
+			size = np_peek_size(fdt->rbuf + fdt->rpos, fdt->rlen);
+			if (size < 4 + sizeof(u8) + sizeof(u16) || size > msize) {
+				np_uerror(EPROTO);
+				return -1;
+			}
+			if (fdt->rlen >= size || size > FDTRANS_DIRECT) {
+				if (!(fc = np_alloc_fcall (size))) {
+					np_uerror (ENOMEM);
+					return -1;
+				}
+				n = fdt->rlen < size ? fdt->rlen : size;
+				memcpy (fc->pkt, fdt->rbuf + fdt->rpos, n);
+				fdt->rpos += n;
+				fdt->rlen -= n;
+				if (n == size)
+					break;
+				fdt->pfc = fc;
+				fdt->plen = n;
+				if (fdt->trans->zcrecv && fc->pkt[4] == P9_TWRITE
+				    && n >= FDTRANS_TWRITEHDR
+				    && size - n >= FDTRANS_DIRECT)
+					np_fdtrans_zcstart(fdt, fc, size);
+				continue;
+			}
+		}
+		if (!fdt->nonblock && fdt->rbuf && fdt->rlen == 0
+				   && (n = np_fdtrans_idle(fdt)) < 0)
+			goto readerr;
+		if (!fdt->rbuf && !(fdt->rbuf = malloc (FDTRANS_BUFSIZE))) {
+			np_uerror (ENOMEM);
+			return -1;
+		}
+		if (fdt->rpos > 0) {
+			memmove (fdt->rbuf, fdt->rbuf + fdt->rpos, fdt->rlen);
+			fdt->rpos = 0;
+		}
+		n = FDTRANS_BUFSIZE - fdt->rlen;
+		if (fdt->trans->zcrecv && n > FDTRANS_DIRECT)
+			n = FDTRANS_DIRECT;
+		n = read(fdt->fdin, fdt->rbuf + fdt->rlen, n);
+		if (n <= 0)
+			goto readerr;
+		fdt->rlen += n;
+	}
+	*fcp = fc;
+	return 1;
+readerr:
+	if (n == 0) {	/* EOF */
+		*fcp = NULL;
+		return 1;
+	}
+	if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		if (fdt->rbuf && fdt->rlen == 0) {
+			free (fdt->rbuf);
+			fdt->rbuf = NULL;
+			fdt->rpos = 0;
+		}
+		return 0;
+	}
+	np_uerror (errno);
+	return -1;
+}
+
 static int
 np_fdtrans_recv(Npfcall **fcp, u32 msize, void *a)
 {
 	Fdtrans *fdt = (Fdtrans *)a;
-	Npfcall *fc = NULL;
-	int n, size, len;
-
-	if (fdt->fc) {
-		assert (fdt->fc_msize >= msize);
-		fc = fdt->fc;
-		len = fdt->fc->size;
-		fdt->fc = NULL;
-		size = np_peek_size (fc->pkt, len);
-	} else {
-		if (!(fc = np_alloc_fcall (msize))) {
-			np_uerror (ENOMEM);
-			goto error;
+
+	if (np_fdtrans_fill(fdt, fcp, msize) < 0)
+		return -1;
+	return 0;
+}
+
+static int
+np_fdtrans_recv_nb(Npfcall **fcp, u32 msize, void *a)
+{
+	Fdtrans *fdt = (Fdtrans *)a;
+	int flags;
+
+	if (!fdt->nonblock) {
+		if ((flags = fcntl(fdt->fdin, F_GETFL)) < 0
+			|| fcntl(fdt->fdin, F_SETFL, flags | O_NONBLOCK) < 0) {
+			np_uerror (errno);
+			return -1;
 		}
-		len = 0;
-		size = 0;
+		fdt->nonblock = 1;
 	}
-	while (len < size || len < 4) {
-		n = read(fdt->fdin, fc->pkt + len, msize - len);
+	return np_fdtrans_fill(fdt, fcp, msize);
+}
+
+/* Wait until fdout, made non-blocking by np_fdtrans_recv_nb (),
+ * is writable again.  Returns 0 to retry, or -1 on error.
+ */
+static int
+np_fdtrans_wait(Fdtrans *fdt)
+{
+	struct pollfd pfd = { .fd = fdt->fdout, .events = POLLOUT };
+
+	if (poll(&pfd, 1, -1) >= 0 || errno == EINTR)
+		return 0;
+	return -1;
+}
+
+/* Write out iov[cnt] (which is modified).
+ */
+static int
+np_fdtrans_writev(Fdtrans *fdt, struct iovec *v, int cnt)
+{
+	int n, len = 0;
+
+	while (cnt > 0) {
+		n = writev(fdt->fdout, v, cnt);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			if (np_fdtrans_wait(fdt) == 0)
+				continue;
+		}
 		if (n < 0) {
-			np_uerror (errno);
-			goto error;
-		}	
-		if (n == 0) {	/* EOF */
-			free (fc);
-			fc = NULL;
-			goto done;
+			np_uerror(errno);
+			return -1;
 		}
 		len += n;
-		if (size == 0)
-			size = np_peek_size(fc->pkt, len);
-		if (size > msize) {
-			np_uerror(EPROTO);
-			goto error;
+		while (cnt > 0 && n >= v->iov_len) {
+			n -= v->iov_len;
+			v++;
+			cnt--;
+		}
+		if (cnt > 0) {
+			v->iov_base = (u8 *)v->iov_base + n;
+			v->iov_len -= n;
 		}
 	}
-	if (len > size) {
-		if (!(fdt->fc = np_alloc_fcall (msize))) {
-			np_uerror(ENOMEM);
-			goto error;
-		}
-		fdt->fc_msize = msize;
-		memcpy (fdt->fc->pkt, fc->pkt + size, len - size);
-		fdt->fc->size = len - size;
+
+	return len;
+}
+
+/* Write the parts of fc that are in memory.
+ */
+static int
+np_fdtrans_write(Fdtrans *fdt, Npfcall *fc)
+{
+	struct iovec iov[NP_FCALL_IOVMAX];
+	int cnt;
+
+	/* N.B. Reading fc->size once, in np_fcall_iov (), avoids a race with
+  	 * mtfsys.c where fc is replaced under us - see issue 72.
+	 */
+	cnt = np_fcall_iov(fc, iov);
+	return np_fdtrans_writev(fdt, iov, cnt);
+}
+
+/* An Rread header and its spliced data are sent separately, and the
+ * tail of the data would be held by Nagle's algorithm until the client
+ * acknowledges the head, which it may delay.  So TCP_NODELAY is set once
+ * a connection splices;  other connections keep the socket's default.
+ */
+static void
+np_fdtrans_nodelay(Fdtrans *fdt)
+{
+	int on = 1;
+
+	if (!fdt->nodelay) {
+		(void)setsockopt(fdt->fdout, IPPROTO_TCP, TCP_NODELAY,
+				 &on, sizeof(on));
+		fdt->nodelay = 1;
 	}
-	fc->size = size;
-done:
-	*fcp = fc;
-	return 0;
-error:
-	if (fc)
-		free (fc);
-	return -1;
 }
 
 static int
 np_fdtrans_send(Npfcall *fc, void *a)
 {
 	Fdtrans *fdt = (Fdtrans *)a;
-	int n, len = 0, size = fc->size;
+	int n, len;
+
+	if (!fc->zcpipe)
+		return np_fdtrans_write(fdt, fc);
 
-	/* N.B. Caching fc->size avoids a race with mtfsys.c where fc
-  	 * is replaced under us before the do conditional - see issue 72.
+	/* Rread from np_create_rread_splice ():  data follows in a pipe.
 	 */
-	do {
-		n = write(fdt->fdout, fc->pkt + len, size - len);
-		if (n < 0) {
+	np_fdtrans_nodelay(fdt);
+	if ((len = np_fdtrans_write(fdt, fc)) < 0)
+		return -1;
+	while (fc->zclen > 0) {
+		n = splice(fc->zcpipe->rfd, NULL, fdt->fdout, NULL, fc->zclen,
+			   SPLICE_F_MOVE);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			if (np_fdtrans_wait(fdt) == 0)
+				continue;
+		}
+		if (n == 0)
+			errno = EIO;
+		if (n <= 0) {
 			np_uerror(errno);
 			return -1;
 		}
+		fc->zclen -= n;
 		len += n;
-	} while (len < size);
+	}
 
-	return len;		
-}	
+	return len;
+}
+
+/* Send a batch of responses (see np_conn_respond ()) with one writev(2),
+ * or as few as FDTRANS_IOVMAX and any spliced Rreads in it allow.
+ */
+static int
+np_fdtrans_sendv(Npfcall **fcs, int n, void *a)
+{
+	Fdtrans *fdt = (Fdtrans *)a;
+	struct iovec iov[FDTRANS_IOVMAX];
+	int i, ret, cnt = 0, len = 0;
+
+	for (i = 0; i < n; i++) {
+		if (cnt > 0 && (fcs[i]->zcpipe
+				|| cnt + NP_FCALL_IOVMAX > FDTRANS_IOVMAX)) {
+			if ((ret = np_fdtrans_writev(fdt, iov, cnt)) < 0)
+				return -1;
+			len += ret;
+			cnt = 0;
+		}
+		if (fcs[i]->zcpipe) {
+			if ((ret = np_fdtrans_send(fcs[i], fdt)) < 0)
+				return -1;
+			len += ret;
+			continue;
+		}
+		cnt += np_fcall_iov(fcs[i], iov + cnt);
+	}
+	if (cnt > 0) {
+		if ((ret = np_fdtrans_writev(fdt, iov, cnt)) < 0)
+			return -1;
+		len += ret;
+	}
+
+	return len;
+}
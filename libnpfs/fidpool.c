@@ -36,21 +36,37 @@
 #include "xpthread.h"
 #include "npfsimpl.h"
 
+/* Fids are kept in an open addressed hash table that doubles in size
+ * when it gets 3/4 full, so lookups stay short with the tens of thousands
+ * of fids a client with a big dentry cache may hold.  Lookups, which are
+ * most of the traffic, only take the lock for reading.
+ */
+static inline int
+_fid_hash(Npfidpool *fp, u32 fid)
+{
+	return (fid * 2654435761U) & (fp->size - 1);
+}
+
 Npfidpool *
 np_fidpool_create(void)
 {
 	Npfidpool *fp;
 
-	fp = malloc(sizeof(*fp) + FID_HTABLE_SIZE * sizeof(Npfid *));
+	fp = malloc(sizeof(*fp));
 	if (!fp) {
 		np_uerror (ENOMEM);
 		return NULL;
 	}
+	fp->htable = calloc(FID_HTABLE_SIZE, sizeof(Npfid *));
+	if (!fp->htable) {
+		free(fp);
+		np_uerror (ENOMEM);
+		return NULL;
+	}
 
-	pthread_mutex_init(&fp->lock, NULL);
+	pthread_rwlock_init(&fp->lock, NULL);
 	fp->size = FID_HTABLE_SIZE;
-	fp->htable = (Npfid **)((char *) fp + sizeof(*fp));
-	memset(fp->htable, 0, fp->size * sizeof(Npfid *));
+	fp->count = 0;
 
 	return fp;
 }
@@ -59,96 +75,108 @@ void
 np_fidpool_destroy(Npfidpool *pool)
 {
 	int i;
-	Npfid *f, *ff;
+	Npfid *f;
 	Npsrv *srv;
 
 	for(i = 0; i < pool->size; i++) {
-		f = pool->htable[i];
-		while (f != NULL) {
-			ff = f->next;
-			srv = f->conn->srv;
-			np_logmsg (srv, "%s@%s:%s fid %d not clunked",
-			           f->user ? f->user->uname : "<unknown>",
-				   np_conn_get_client_id(f->conn),
-				   f->aname ? f->aname : "<NULL>", f->fid);
-			if ((f->type & P9_QTAUTH)) {
-				if (srv->auth && srv->auth->clunk)
-					(*srv->auth->clunk)(f);
-			} else if ((f->type & P9_QTTMP)) {
-				np_ctl_fiddestroy (f);
-			} else {
-				if (srv->fiddestroy)
-					(*srv->fiddestroy)(f);
-			}
-			if (f->aname)
-				free(f->aname);
-			if (f->user)
-				np_user_decref(f->user);
-			if (f->tpool)
-				np_tpool_decref(f->tpool);
-			free(f);
-			f = ff;
+		if (!(f = pool->htable[i]))
+			continue;
+		srv = f->conn->srv;
+		np_logmsg (srv, "%s@%s:%s fid %d not clunked",
+			   f->user ? f->user->uname : "<unknown>",
+			   np_conn_get_client_id(f->conn),
+			   f->aname ? f->aname : "<NULL>", f->fid);
+		if ((f->type & P9_QTAUTH)) {
+			if (srv->auth && srv->auth->clunk)
+				(*srv->auth->clunk)(f);
+		} else if ((f->type & P9_QTTMP)) {
+			np_ctl_fiddestroy (f);
+		} else {
+			if (srv->fiddestroy)
+				(*srv->fiddestroy)(f);
 		}
+		if (f->aname)
+			free(f->aname);
+		if (f->user)
+			np_user_decref(f->user);
+		if (f->tpool)
+			np_tpool_decref(f->tpool);
+		free(f);
 	}
 
+	pthread_rwlock_destroy(&pool->lock);
+	free(pool->htable);
 	free(pool);
 }
 
 int
 np_fidpool_count(Npfidpool *pool)
 {
-	int i;
-	Npfid *f;
-	int count = 0;
+	int count;
 
-	xpthread_mutex_lock(&pool->lock);
-	for(i = 0; i < pool->size; i++) {
-		for (f = pool->htable[i]; f != NULL; f = f->next)
-			count++;
-	}
-	xpthread_mutex_unlock(&pool->lock);
+	xpthread_rwlock_rdlock(&pool->lock);
+	count = pool->count;
+	xpthread_rwlock_unlock(&pool->lock);
 
 	return count;
 }
 
-Npfid *
-np_fid_lookup(Npfidpool *fp, u32 fid, int hash)
+int
+np_fidpool_size(Npfidpool *pool)
 {
-	Npfid **htable, *f;
-
-	htable = fp->htable;
-	for(f = htable[hash]; f != NULL; f = f->next) {
-		if (f->fid == fid) {
-			if (f != htable[hash]) {
-				if (f->next)
-					f->next->prev = f->prev;
-
-				f->prev->next = f->next;
-				f->prev = NULL;
-				f->next = htable[hash];
-				htable[hash]->prev = f;
-				htable[hash] = f;
-			}
+	int size;
 
-			break;
-		}
-	}
+	xpthread_rwlock_rdlock(&pool->lock);
+	size = pool->size;
+	xpthread_rwlock_unlock(&pool->lock);
 
-	return f;
+	return size;
+}
+
+/* Return the slot holding fid, or the empty slot that ends its probe.
+ */
+static int
+np_fid_slot(Npfidpool *fp, u32 fid)
+{
+	int i = _fid_hash(fp, fid);
+
+	while (fp->htable[i] && fp->htable[i]->fid != fid)
+		i = (i + 1) & (fp->size - 1);
+	return i;
+}
+
+/* Double the size of the table.
+ */
+static int
+np_fidpool_grow(Npfidpool *fp)
+{
+	Npfid **old = fp->htable;
+	int i, oldsize = fp->size;
+
+	/* assert: fp->lock held for writing */
+	if (!(fp->htable = calloc(oldsize * 2, sizeof(Npfid *)))) {
+		fp->htable = old;
+		return -1;
+	}
+	fp->size = oldsize * 2;
+	for (i = 0; i < oldsize; i++) {
+		if (old[i])
+			fp->htable[np_fid_slot(fp, old[i]->fid)] = old[i];
+	}
+	free(old);
+	return 0;
 }
 
 Npfid*
 np_fid_find(Npconn *conn, u32 fid)
 {
-	int hash;
 	Npfidpool *fp;
 	Npfid *ret;
 
 	fp = conn->fidpool;
-	xpthread_mutex_lock(&fp->lock);
-	hash = fid % fp->size;
-	ret = np_fid_lookup(fp, fid, hash);
-	xpthread_mutex_unlock(&fp->lock);
+	xpthread_rwlock_rdlock(&fp->lock);
+	ret = fp->htable[np_fid_slot(fp, fid)];
+	xpthread_rwlock_unlock(&fp->lock);
 
 	return ret;
 }
@@ -156,25 +184,31 @@ np_fid_find(Npconn *conn, u32 fid)
 Npfid*
 np_fid_create(Npconn *conn, u32 fid, void *aux)
 {
-	int hash;
+	int i;
 	Npfidpool *fp;
-	Npfid **htable, *f;
+	Npfid *f;
 
 	fp = conn->fidpool;
-	xpthread_mutex_lock(&fp->lock);
-	htable = fp->htable;
-	hash = fid % FID_HTABLE_SIZE;
-	f = np_fid_lookup(fp, fid, hash);
+	xpthread_rwlock_wrlock(&fp->lock);
+	i = np_fid_slot(fp, fid);
+	f = fp->htable[i];
 	if (!f) {
+		if ((fp->count + 1) * 4 > fp->size * 3) {
+			if (np_fidpool_grow(fp) < 0) {
+				np_uerror (ENOMEM);
+				xpthread_rwlock_unlock(&fp->lock);
+				return NULL;
+			}
+			i = np_fid_slot(fp, fid);
+		}
 		f = malloc(sizeof(*f));
 		if (!f) {
 			np_uerror (ENOMEM);
-			xpthread_mutex_unlock(&fp->lock);
+			xpthread_rwlock_unlock(&fp->lock);
 			return NULL;
 		}
 		f->aname = NULL;
 		f->tpool = NULL;
-		pthread_mutex_init(&f->lock, NULL);
 		f->fid = fid;
 		f->conn = conn;
 		f->refcount = 0;
@@ -184,27 +218,48 @@ np_fid_create(Npconn *conn, u32 fid, void *aux)
 		f->user = NULL;
 		f->aux = aux;
 
-		f->next = htable[hash];
-		f->prev = NULL;
-		if (htable[hash])
-			htable[hash]->prev = f;
-
-		htable[hash] = f;
+		fp->htable[i] = f;
+		fp->count++;
 	}
 
-	xpthread_mutex_unlock(&fp->lock);
+	xpthread_rwlock_unlock(&fp->lock);
 
 	return f;
 }
 
+/* Remove the fid in slot i, moving later members of its probe sequence
+ * back so that no lookup stops short at the hole.
+ */
+static void
+np_fid_unslot(Npfidpool *fp, int i)
+{
+	int j = i, k, mask = fp->size - 1;
+
+	/* assert: fp->lock held for writing */
+	for (;;) {
+		fp->htable[i] = NULL;
+		for (;;) {
+			j = (j + 1) & mask;
+			if (!fp->htable[j])
+				return;
+			k = _fid_hash(fp, fp->htable[j]->fid);
+			/* leave it if its home k lies cyclically in (i, j] */
+			if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+				continue;
+			break;
+		}
+		fp->htable[i] = fp->htable[j];
+		i = j;
+	}
+}
+
 void
 np_fid_destroy(Npfid *fid)
 {
-	int hash;
 	Npconn *conn;
 	Npsrv *srv;
 	Npfidpool *fp;
-	Npfid **htable;
+	int i;
 
 	conn = fid->conn;
 	srv = conn->srv;
@@ -212,19 +267,13 @@ np_fid_destroy(Npfid *fid)
 	if (!fp)
 		return;
 
-//	printf("destroy conn %p fid %d\n", conn, fid->fid);
-	xpthread_mutex_lock(&fp->lock);
-	hash = fid->fid % fp->size;
-	htable = fp->htable;
-	if (fid->prev)
-		fid->prev->next = fid->next;
-	else
-		htable[hash] = fid->next;
-
-	if (fid->next)
-		fid->next->prev = fid->prev;
-
-	xpthread_mutex_unlock(&fp->lock);
+	xpthread_rwlock_wrlock(&fp->lock);
+	i = np_fid_slot(fp, fid->fid);
+	if (fp->htable[i] == fid) {
+		np_fid_unslot(fp, i);
+		fp->count--;
+	}
+	xpthread_rwlock_unlock(&fp->lock);
 
 	if ((fid->conn->srv->flags & SRV_FLAGS_DEBUG_FIDPOOL))
 		np_logmsg (fid->conn->srv, "fid_destroy: fid %d", fid->fid);
@@ -250,18 +299,22 @@ np_fid_destroy(Npfid *fid)
 	return;
 }
 
+/* Reference counts are adjusted atomically.  The final decref is
+ * ordered after every other holder's last use of the fid (release),
+ * and np_fid_destroy () after it (acquire).
+ */
 void
 np_fid_incref(Npfid *fid)
 {
+	int n;
+
 	if (!fid)
 		return;
 
-	xpthread_mutex_lock(&fid->lock);
-	fid->refcount++;
+	n = __atomic_add_fetch (&fid->refcount, 1, __ATOMIC_RELAXED);
 	if ((fid->conn->srv->flags & SRV_FLAGS_DEBUG_FIDPOOL))
 		np_logmsg (fid->conn->srv, "fid_incref: fid %d ref=%d",
-			   fid->fid, fid->refcount);
-	xpthread_mutex_unlock(&fid->lock);
+			   fid->fid, n);
 }
 
 void
@@ -272,13 +325,13 @@ np_fid_decref(Npfid *fid)
 	if (!fid)
 		return;
 
-	xpthread_mutex_lock(&fid->lock);
-	n = --fid->refcount;
+	n = __atomic_sub_fetch (&fid->refcount, 1, __ATOMIC_RELEASE);
 	if ((fid->conn->srv->flags & SRV_FLAGS_DEBUG_FIDPOOL))
 		np_logmsg (fid->conn->srv, "fid_decref: fid %d ref=%d",
-			   fid->fid, fid->refcount);
-	xpthread_mutex_unlock(&fid->lock);
+			   fid->fid, n);
 
-	if (!n)
+	if (!n) {
+		__atomic_thread_fence (__ATOMIC_ACQUIRE);
 		np_fid_destroy(fid);
+	}
 }
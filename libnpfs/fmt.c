@@ -567,14 +567,18 @@ np_snprintfcall(char *s, int len, Npfcall *fc)
 	case P9_RREAD:
 		spf (s, len, "P9_RREAD tag %u count %u", fc->tag,
 			fc->u.rread.count);
-		np_printdata(s, len, fc->u.rread.data, fc->u.rread.count);
+		if (fc->u.rread.data)
+			np_printdata(s, len, fc->u.rread.data,
+				     fc->u.rread.count);
 		break;
 	case P9_TWRITE:
 		spf (s, len, "P9_TWRITE tag %u", fc->tag);
 		spf (s, len, " fid %d", fc->u.twrite.fid);
 		spf (s, len, " offset %"PRIu64, fc->u.twrite.offset);
 		spf (s, len, " count %u", fc->u.twrite.count);
-		np_printdata(s, len, fc->u.twrite.data, fc->u.twrite.count);
+		if (!fc->zcpipe)
+			np_printdata(s, len, fc->u.twrite.data,
+				     fc->u.twrite.count);
 		break;
 	case P9_RWRITE:
 		spf (s, len, "P9_RWRITE tag %u count %u", fc->tag, fc->u.rwrite.count);
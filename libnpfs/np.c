@@ -30,10 +30,22 @@
 #include <stdarg.h>
 #include <errno.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sys/uio.h>
 #include "9p.h"
 #include "npfs.h"
 #include "npfsimpl.h"
 
+/* Npfcalls up to the largest of these payload sizes are allocated from
+ * per-thread caches (see cache.c), larger ones with malloc.  Msize sized
+ * ones aren't cached:  each thread's magazines would hold on to several.
+ */
+static const u32 fcall_class_size[] = { 256, 4096 };
+#define FCALL_NCLASSES \
+	(sizeof (fcall_class_size) / sizeof (fcall_class_size[0]))
+static Npcache *fcall_cache[FCALL_NCLASSES];
+static pthread_once_t fcall_once = PTHREAD_ONCE_INIT;
+
 /* wire sizes */
 #define QIDSIZE (sizeof(u8) + sizeof(u32) + sizeof(u64))
 
@@ -250,15 +262,93 @@ np_set_tag(Npfcall *fc, u16 tag)
 	fc->pkt[6] = tag >> 8;
 }
 
+static void
+np_fcall_init_caches(void)
+{
+	char name[32];
+	int i;
+
+	for (i = 0; i < FCALL_NCLASSES; i++) {
+		snprintf (name, sizeof (name), "fcall%u", fcall_class_size[i]);
+		fcall_cache[i] = np_cache_create (name,
+				sizeof(Npfcall) + fcall_class_size[i],
+				NULL, NULL);
+	}
+}
+
+static Npfcall *
+np_fcall_alloc(u32 size)
+{
+	Npfcall *fc;
+	int i;
+
+	pthread_once(&fcall_once, np_fcall_init_caches);
+	for (i = 0; i < FCALL_NCLASSES; i++) {
+		if (size <= fcall_class_size[i])
+			break;
+	}
+	if (i < FCALL_NCLASSES && fcall_cache[i])
+		fc = np_cache_alloc (fcall_cache[i]);
+	else {
+		fc = malloc(sizeof(*fc) + size);
+		i = -1;
+	}
+	if (fc) {
+		fc->pkt = (u8 *) fc + sizeof(*fc);
+		fc->bufclass = i;
+		fc->zcpipe = NULL;
+		fc->zclen = 0;
+		fc->xdata = NULL;
+		fc->xlen = 0;
+		fc->xfree = NULL;
+		fc->next = NULL;
+	}
+	return fc;
+}
+
+/* Free an Npfcall from np_alloc_fcall () or np_create_* ().
+ * Always use this rather than free ():  it releases any splice pipe and
+ * external payload, and returns the Npfcall to its cache.
+ */
+void
+np_free_fcall(Npfcall *fc)
+{
+	if (fc->zcpipe)
+		np_splice_release(fc);
+	if (fc->xfree)
+		fc->xfree(fc->xarg);
+	if (fc->bufclass >= 0)
+		np_cache_free (fcall_cache[fc->bufclass], fc);
+	else
+		free (fc);
+}
+
+/* Fill iov with the parts of fc that are in memory:  pkt, up to any
+ * external payload, and that payload.  A payload in a pipe follows them.
+ * Returns the number of segments, at most NP_FCALL_IOVMAX.
+ */
+int
+np_fcall_iov(Npfcall *fc, struct iovec *iov)
+{
+	int n = 0;
+
+	iov[n].iov_base = fc->pkt;
+	iov[n++].iov_len = fc->size - fc->xlen - fc->zclen;
+	if (fc->xlen > 0) {
+		iov[n].iov_base = fc->xdata;
+		iov[n++].iov_len = fc->xlen;
+	}
+	return n;
+}
+
 static Npfcall *
 np_create_common(struct cbuf *bufp, u32 size, u8 id)
 {
 	Npfcall *fc;
 
 	size += sizeof(fc->size) + sizeof(fc->type) + sizeof (fc->tag);
-	if (!(fc = malloc(sizeof(Npfcall) + size)))
+	if (!(fc = np_fcall_alloc(size)))
 		return NULL;
-	fc->pkt = (u8 *) fc + sizeof(*fc);
 	buf_init(bufp, (char *) fc->pkt, size);
 	buf_put_int32(bufp, size, &fc->size);
 	buf_put_int8(bufp, id, &fc->type);
@@ -271,7 +361,7 @@ static Npfcall *
 np_post_check(Npfcall *fc, struct cbuf *bufp)
 {
 	if (buf_check_overflow(bufp)) {
-		free (fc);
+		np_free_fcall (fc);
 		return NULL;
 	}
 
@@ -500,6 +590,52 @@ np_create_rread(u32 count, u8* data)
 	return fc;
 }
 
+/* Create an Rread whose count bytes of data follow it in a pipe,
+ * for np_create_rread_splice (), or (p == NULL) elsewhere in memory.
+ * Only the header is in pkt.
+ */
+Npfcall *
+np_create_rread_hdr(u32 count, Nppipe *p)
+{
+	struct cbuf buffer;
+	struct cbuf *bufp = &buffer;
+	Npfcall *fc;
+
+	if (!(fc = np_create_common(bufp, sizeof(u32), P9_RREAD)))
+		return NULL;
+	buf_put_int32(bufp, count, &fc->u.rread.count);
+	fc->u.rread.data = NULL;
+	if (!(fc = np_post_check(fc, bufp)))
+		return NULL;
+	buf_init(bufp, (char *) fc->pkt, sizeof(u32));
+	buf_put_int32(bufp, fc->size + count, &fc->size);
+	if ((fc->zcpipe = p))
+		fc->zclen = count;
+
+	return fc;
+}
+
+/* Create an Rread whose count bytes of data stay in the caller's buffer
+ * rather than being copied into the Npfcall.  release (arg), if set, is
+ * called once the Rread has been sent and freed;  it is not called if
+ * this fails.
+ */
+Npfcall *
+np_create_rread_ext(u32 count, u8 *data, void (*release)(void *), void *arg)
+{
+	Npfcall *fc;
+
+	if (!(fc = np_create_rread_hdr(count, NULL)))
+		return NULL;
+	fc->u.rread.data = data;
+	fc->xdata = data;
+	fc->xlen = count;
+	fc->xfree = release;
+	fc->xarg = arg;
+
+	return fc;
+}
+
 void
 np_set_rread_count(Npfcall *fc, u32 count)
 {
@@ -513,6 +649,8 @@ np_set_rread_count(Npfcall *fc, u32 count)
 	buf_put_int32(bufp, size, &fc->size);
 	buf_init(bufp, (char *) fc->pkt + 7, size - 7);
 	buf_put_int32(bufp, count, &fc->u.rread.count);
+	if (fc->xdata)
+		fc->xlen = count;
 }
 
 Npfcall *
@@ -1321,10 +1459,8 @@ np_alloc_fcall(int msize)
 {
         Npfcall *fc;
 
-        if ((fc = malloc(sizeof(*fc) + msize))) {
-                fc->pkt = (u8*) fc + sizeof(*fc);
+        if ((fc = np_fcall_alloc(msize)))
 		fc->size = msize;
-	}
 
         return fc;
 }
@@ -31,20 +31,38 @@ typedef struct Npbuf Npbuf;
 typedef struct Nptrans Nptrans;
 typedef struct Npconn Npconn;
 typedef struct Npreq Npreq;
+typedef struct Npconnq Npconnq;
 typedef struct Npstats Npstats;
+typedef struct Npstatslot Npstatslot;
+typedef struct Nplatency Nplatency;
+typedef struct Nplatslot Nplatslot;
+typedef struct Npacct Npacct;
+typedef struct Npslowreq Npslowreq;
 typedef struct Npwthread Npwthread;
 typedef struct Nptpool Nptpool;
+typedef struct Npring Npring;
+typedef struct Nprunq Nprunq;
+typedef struct Npreactor Npreactor;
+typedef struct Nppipe Nppipe;
 typedef struct Npauth Npauth;
 typedef struct Npsrv Npsrv;
 typedef struct Npuser Npuser;
 
-#define FID_HTABLE_SIZE 64
+#define FID_HTABLE_SIZE 64	/* initial size, grows as needed */
+#define TAG_HTABLE_SIZE 256
 
 struct Npfcall {
 	u32		size;
 	u8		type;
 	u16		tag;
 	u8*		pkt;
+	int		bufclass; /* np_alloc_fcall cache, or -1 */
+	Nppipe*		zcpipe;	/* payload is in this pipe, or NULL */
+	u32		zclen;	/* bytes of payload still in zcpipe */
+	u8*		xdata;	/* payload outside pkt, or NULL */
+	u32		xlen;
+	void		(*xfree)(void *); /* called with xarg when fc is freed */
+	void*		xarg;
 	union {
 	   struct p9_rlerror rlerror;
 	   struct p9_tstatfs tstatfs;
@@ -105,23 +123,19 @@ struct Npfcall {
 	   struct p9_tremove tremove;
 	   struct p9_rremove rremove;
 	} u;
-	Npfcall*	next;
+	Npfcall*	next;	/* Npconn send queue */
 };
 
 
 struct Npfid {
-	pthread_mutex_t	lock;
 	Npconn*		conn;
 	u32		fid;
-	int		refcount;
+	int		refcount;	/* atomic */
 	u8		type;
 	Npuser*		user;
 	Nptpool*	tpool;	/* tpool preference, if any (else NULL) */
 	char		*aname;
 	void*		aux;
-
-	Npfid*		next;	/* list of fids within a bucket */
-	Npfid*		prev;
 };
 
 struct Npbuf {
@@ -137,19 +151,51 @@ struct Nptrans {
 	int		(*recv)(Npfcall **, u32, void *);
 	int		(*send)(Npfcall *, void *);
 	void		(*destroy)(void *);
+
+	/* optional, for SRV_FLAGS_REACTOR */
+	int		fd;	/* poll this for input */
+	int		(*recv_nb)(Npfcall **, u32, void *);
+
+	/* optional, for SRV_FLAGS_ZEROCOPY */
+	int		splice;	/* send/recv handle fcalls with zcpipe */
+	int		zcrecv;	/* np_conn_create () enables the latter */
+
+	/* optional, send several fcalls at once */
+	int		(*sendv)(Npfcall **, int, void *);
 };
 
 struct Npfidpool {
-	pthread_mutex_t	lock;
-	int		size;
-	Npfid**		htable;
+	pthread_rwlock_t lock;	/* lookups share, changes exclude */
+	int		size;	/* power of 2 */
+	int		count;
+	Npfid**		htable;	/* open addressed, linear probing */
+};
+
+/* Traffic by connection and by user.  Counters are updated atomically.
+ */
+#define NPSTATS_LAT_NOPS 27	/* see np_latop_index () */
+struct Npacct {
+	int		outstanding;	/* requests received, not yet freed */
+	u64		rbytes;
+	u64		wbytes;
+	u64		stime;		/* ns spent in op callbacks */
+	u64		nreqs[NPSTATS_LAT_NOPS]; /* by np_latop_index () */
 };
 
 struct Npconn {
 	pthread_mutex_t	lock;
-	pthread_mutex_t	wlock;
+	pthread_mutex_t	wlock;		/* protects sendq, sending */
 	pthread_cond_t  refcond;
-	int		refcount;
+	int		refcount;	/* atomic */
+	int		refwaiters;	/* threads on refcond (atomic) */
+	pthread_cond_t	sendcond;	/* signalled when sending drops */
+	Npfcall*	sendq_first;	/* responses waiting to be sent */
+	Npfcall*	sendq_last;
+	int		sending;	/* a thread is draining sendq */
+	pthread_mutex_t	tlock;		/* protects tagtab */
+	Npreq*		tagtab[TAG_HTABLE_SIZE]; /* outstanding reqs by tag */
+	Npacct		acct;
+	int		qdepth;		/* requests in tpool queues (atomic) */
 
 	char		client_id[128];
 	u32		authuser;
@@ -160,13 +206,17 @@ struct Npconn {
 	Npfidpool*	fidpool;
 	void*		aux;
 	pthread_t	rthread;
+	Npreactor*	reactor;	/* NULL if read by rthread */
+	Npconn*		rnext;		/* reactor's list of busy conns */
+	int		rbusy;
+	Npconn*		snext;		/* srv's list of conns to send on */
 
 	Npconn*		next;	/* list of connections within a server */
 };
 
 struct Npreq {
 	pthread_mutex_t	lock;
-	int		refcount;
+	int		refcount;	/* atomic */
 	Npconn*		conn;
 	u16		tag;
 	int		flushed;
@@ -174,10 +224,48 @@ struct Npreq {
 	Npfcall*	rcall;
 	Npfid*		fid;
 	time_t		birth;	
+	u64		qtime;	/* when queued, in ms (for tpool growth) */
+	u64		rtime;	/* when received, started, and done, in ns */
+	u64		stime;	/*   (CLOCK_MONOTONIC) for latency stats */
+	u64		dtime;
+	int		latop;	/* np_latop_index (tcall->type) */
+	Npacct*		uacct;	/* fid's user's, held and counted as outstanding */
 
 	Npreq*		next;	/* list of all outstanding requests */
 	Npreq*		prev;	/* used for requests that are worked on */
 	Npwthread*	wthread;/* for requests that are worked on */
+	int		lane;	/* NP_LANE_META or NP_LANE_DATA */
+	Npconnq*	connq;	/* per-conn queue while queued (fifo, shared) */
+	Npreq*		cnext;
+	Npreq*		cprev;
+	Nptpool*	tpool;	/* tpool the request went to, until replied */
+	int		deferred;/* 1 after np_req_defer (), 2 once replied */
+	int		nowait;	/* replying thread mustn't block sending */
+	int		queued;	/* on tpool->reqs_first list (under tp->lock) */
+	Npreq*		tnext;	/* conn->tagtab chain */
+	Npreq*		tprev;
+};
+
+/* Requests are classified as metadata or bulk data so that some workers
+ * can be reserved for metadata, keeping it responsive under heavy I/O.
+ */
+enum {
+	NP_LANE_META = 0,
+	NP_LANE_DATA,
+	NP_NLANES,
+};
+
+/* A connection's requests queued to one tpool lane.  Connqs with requests
+ * are kept on a circular list and serviced in deficit round-robin order.
+ */
+struct Npconnq {
+	Npconn*		conn;
+	int		lane;
+	Npreq*		reqs_first;
+	Npreq*		reqs_last;
+	int		deficit;	/* bytes this conn may still send */
+	Npconnq*	next;
+	Npconnq*	prev;
 };
 
 #define NPSTATS_RWCOUNT_BINS 12
@@ -185,36 +273,130 @@ struct Npstats {
 	char		*name;	
 	int		numfids;
 	int		numreqs;
+	int		numwthreads;
+	int		minwthreads;
+	int		maxwthreads;
+	u64		nreqs[P9_RWSTAT+1];
+	u64		rbytes;
+	u64		wbytes;
+	u64		rcount[NPSTATS_RWCOUNT_BINS];
+	u64		wcount[NPSTATS_RWCOUNT_BINS];
+};
+
+/* Request counters are bumped without tp->lock in one of NPSTATS_NSLOTS
+ * cache aligned slots picked by cpu, and summed into Npstats on read.
+ */
+#define NPSTATS_NSLOTS 16
+struct Npstatslot {
 	u64		nreqs[P9_RWSTAT+1];
 	u64		rbytes;
 	u64		wbytes;
 	u64		rcount[NPSTATS_RWCOUNT_BINS];
 	u64		wcount[NPSTATS_RWCOUNT_BINS];
+} __attribute__((aligned(64)));
+
+/* Per-op latency:  time queued in the tpool (receive to op start),
+ * in the op (start to completion), and replying (completion until the
+ * reply was written or queued behind another thread's write).
+ * Bin i counts latencies below 2^i usec, the last bin the rest.
+ */
+#define NPSTATS_LAT_BINS 24
+struct Nplatency {
+	u64		count;
+	u64		qtime;	/* sums, in ns */
+	u64		stime;
+	u64		rtime;
+	u64		qbins[NPSTATS_LAT_BINS];
+	u64		sbins[NPSTATS_LAT_BINS];
+	u64		rbins[NPSTATS_LAT_BINS];
+};
+struct Nplatslot {
+	Nplatency	op[NPSTATS_LAT_NOPS];
+} __attribute__((aligned(64)));
+
+/* The tpools.bin ctl file carries the tpools and latency files in
+ * little-endian binary (see np_encode_tpools_bin ()).
+ */
+#define NPSTATS_BIN_MAGIC	0x5453504e	/* "NPST" */
+#define NPSTATS_BIN_VERSION	1
+
+/* Requests slower than srv->slowreq_ms are recorded in a ring of
+ * NP_SLOWREQS entries (see np_req_record_slow ()).
+ */
+#define NP_SLOWREQS 256
+struct Npslowreq {
+	u64		seq;	/* ring position + 1, or 0 while written */
+	int		busy;	/* a writer owns the entry (atomic) */
+	time_t		when;	/* op completed */
+	int		latop;
+	u32		fid;
+	int		ecode;
+	u64		qtime;	/* ns */
+	u64		stime;
+	char		client[32];
+	char		uname[32];
+	char		aname[64];
+	char		path[128];
 };
 
 struct Npwthread {
-	Nptpool*	tpool;
+	Nptpool*	tpool;	/* NULL for shared workers */
+	Npsrv*		srv;
 	int		shutdown;
 	pthread_t	thread;
 	u32		fsuid;
 	u32		fsgid;
 	int		privcap;
+	Npreq*		req;	/* request being worked on */
+	int		metaonly; /* serves only NP_LANE_META (fifo, shared) */
 	Npwthread	*next;
+
+	/* steal mode */
+	int		id;	/* index in tpool->wtab */
+	pthread_mutex_t	lock;	/* protects queue, req, idle, wakeup */
+	pthread_cond_t	cond;
+	Npreq*		reqs_first;
+	Npreq*		reqs_last;
+	int		nreqs;
+	int		idle;
+	int		wakeup;
 };
 
 struct Nptpool {
 	char*		name;
 	Npsrv*		srv;
-	int		refcount;
+	int		refcount;	/* protected by srv->lock */
 	int		nwthread;
 	Npwthread*	wthreads;
+	pthread_mutex_t	lock;		/* protects queues */
 	Npreq*		reqs_first;
 	Npreq*		reqs_last;
 	Npreq*		workreqs;
 	Npreq*		donereqs;
-	Npstats		stats;
+	Npreq*		pendreqs;	/* deferred with np_req_defer () */
+	Npstats		stats;		/* filled in from statslots on read */
+	Npstatslot*	statslots;	/* [NPSTATS_NSLOTS], lockless */
+	Nplatslot*	latslots;	/* [NPSTATS_NSLOTS], lockless */
+	int		nreplying;	/* reqs replying w/o fid ref (atomic) */
 	pthread_cond_t	reqcond;
-	Nptpool		*next;
+	Npring*		ring;		/* run queue (ring mode) */
+	int		novfl;		/* ring overflow reqs on reqs_first */
+	int		nsleepers;	/* workers parked on reqcond */
+	int		readers;	/* walkers of ring, wthread->req */
+	pthread_cond_t	readcond;	/*   signalled when they drop to 0 */
+	Npwthread**	wtab;		/* workers by id (steal mode) */
+	int		nidle;		/* idle workers */
+	int		weight;		/* requests per turn (shared mode) */
+	int		nwthread_reserve; /* own workers (shared mode) */
+	int		onready;	/* on srv->ready list (shared mode) */
+	Nptpool*	rnext;		/* srv->ready list, protected by */
+	Nptpool*	rprev;		/*   srv->rqlock */
+	Npconnq*	connqs[NP_NLANES]; /* non-empty connqs (fifo, shared) */
+	Npconnq*	connq_free;	/* empty connqs kept for reuse */
+	int		nwthread_meta;	/* metaonly workers */
+	int		nidle_meta;	/* idle metaonly workers */
+	pthread_cond_t	metacond;	/*   wait here */
+	Nptpool		*next;		/* protected by srv->lock */
 };
 
 struct Npauth {
@@ -239,14 +421,21 @@ enum {
 	SRV_FLAGS_FLUSHSIG	=0x00100000,
 	SRV_FLAGS_DAC_BYPASS  	=0x00200000,
 	SRV_FLAGS_SETGROUPS	=0x00400000,
+	SRV_FLAGS_TPOOL_RING	=0x00800000,
+	SRV_FLAGS_TPOOL_STEAL	=0x01000000,
+	SRV_FLAGS_TPOOL_SHARED	=0x02000000,
+	SRV_FLAGS_REACTOR	=0x04000000,
+	SRV_FLAGS_ZEROCOPY	=0x08000000,
 };
 
 typedef char * (*SynGetF)(char *name, void *arg);
+typedef void * (*SynGetBinF)(char *name, void *arg, int *lenp);
 
 struct Npfile {
         char                    *name;
         Npqid                    qid;
         SynGetF                  getf;
+        SynGetBinF               getbinf; /* instead of getf */
         void                    *getf_arg;
 	int			flags;
 	uid_t			uid;
@@ -269,14 +458,18 @@ struct Npsrv {
 	int		(*auth_required)(Npstr *, u32, Npstr *);
 	Npauth*		auth;
 	int		flags;
+	const Nprunq*	runq;		/* from the SRV_FLAGS_TPOOL_* flags */
 
 	void		(*fiddestroy)(Npfid *);
+	char*		(*fidpath)(Npfid *);	/* for slowreqs, may be NULL */
+	int		(*tpool_weight)(char *aname);
 
 	Npfcall*	(*version)(Npconn *conn, u32 msize, Npstr *version);
 	Npfcall*	(*attach)(Npfid *fid, Npfid *afid, Npstr *aname);
 	int		(*clone)(Npfid *fid, Npfid *newfid);
 	int		(*walk)(Npfid *fid, Npstr *wname, Npqid *wqid);
 	Npfcall*	(*read)(Npfid *fid, u64 offset, u32 count, Npreq *req);
+	/* with SRV_FLAGS_ZEROCOPY, write gets data with np_splice_write () */
 	Npfcall*	(*write)(Npfid *fid, u64 offset, u32 count, u8 *data, 
 				Npreq *req);
 	Npfcall*	(*clunk)(Npfid *fid);
@@ -295,7 +488,7 @@ struct Npsrv {
 	Npfcall*	(*xattrwalk)(Npfid *, Npfid *, Npstr *);
 	Npfcall*	(*xattrcreate)(Npfid *, Npstr *, u64, u32);
 	Npfcall*	(*readdir)(Npfid *, u64, u32, Npreq *);
-	Npfcall*	(*fsync)(Npfid *);
+	Npfcall*	(*fsync)(Npfid *, Npreq *);
 	Npfcall*	(*llock)(Npfid *, u8, u32, u64, u64, u32, Npstr *);
 	Npfcall*	(*getlock)(Npfid *, u8 type, u64, u64, u32, Npstr *);
 	Npfcall*	(*link)(Npfid *, Npfid *, Npstr *);
@@ -310,12 +503,51 @@ struct Npsrv {
 	int		connhistory;
 	Npconn*		conns;
 	Nptpool*	tpool;
-	int		nwthread;
+	int		nwthread;	/* initial (minimum) workers per tpool */
+	int		nwthread_max;	/* fifo tpools may grow to this many */
+	int		nwthread_meta;	/* per tpool, reserved for metadata */
+	int		wthread_growms;	/* ...if a request waits this long */
+	int		wthread_idlesecs; /* and shrink after this long idle */
+	int		sendwait_us;	/* a response may wait this long for
+					   others on its conn (default 0) */
+	int		slowreq_ms;	/* record requests slower than this
+					   (0 = don't) */
+	Npslowreq*	slowreqs;	/* [NP_SLOWREQS] */
+	u64		slowreq_seq;	/* requests recorded (atomic) */
+
+	/* shared worker pool (SRV_FLAGS_TPOOL_SHARED) */
+	pthread_mutex_t	rqlock;		/* protects ready list, wthreads */
+	pthread_cond_t	rqcond;
+	Nptpool*	ready;		/* tpools with queued requests */
+	int		rcredit;	/* requests left in ready's turn */
+	Npwthread*	wthreads;
+	int		nidle;
+	int		nwthread_reserve; /* dedicated workers per tpool */
+
+	/* epoll threads reading all conns (SRV_FLAGS_REACTOR) */
+	Npreactor**	reactors;	/* protected by srv->lock */
+	int		nreactor;
+	int		reactor_next;
+
+	/* threads sending replies for those that mustn't block (conn.c) */
+	pthread_mutex_t	sendlock;	/* protects the rest */
+	pthread_cond_t	sendcond;
+	Npconn*		sendconns_first; /* conns with replies to send */
+	Npconn*		sendconns_last;
+	pthread_t*	senders;
+	int		nsender;
+	int		sendshutdown;
+
+	/* thread growing fifo tpools whose workers are all busy */
+	pthread_cond_t	growcond;	/* under srv->lock */
+	pthread_t	growthread;
+	int		growstarted;
+	int		growarmed;	/* some tpool may need to grow (atomic) */
+	int		growshutdown;
 };
 
 struct Npuser {
-	pthread_mutex_t	lock;
-	int		refcount;
+	int		refcount;	/* atomic */
 	char*		uname;
 	uid_t		uid;
 	gid_t		gid;
@@ -323,6 +555,7 @@ struct Npuser {
 	gid_t		*sg;
 	Npuser*		next;
 	time_t		t;
+	Npacct*		acct;	/* kept by the usercache across expiry */
 };
 
 /* srv.c */
@@ -332,6 +565,10 @@ void np_srv_remove_conn(Npsrv *, Npconn *);
 int np_srv_add_conn(Npsrv *, Npconn *);
 void np_srv_wait_conncount(Npsrv *srv, int count);
 void np_req_respond(Npreq *req, Npfcall *rc);
+int np_req_defer(Npreq *req);
+Npreq *np_req_current(void);
+void np_req_complete(Npreq *req, Npfcall *rc, int ecode);
+void np_req_complete_nowait(Npreq *req, Npfcall *rc, int ecode);
 void np_logerr(Npsrv *srv, const char *fmt, ...)
 	__attribute__ ((format (printf, 2, 3)));
 void np_logmsg(Npsrv *srv, const char *fmt, ...)
@@ -345,6 +582,8 @@ Npconn *np_conn_create(Npsrv *, Nptrans *, char *);
 void np_conn_incref(Npconn *);
 void np_conn_decref(Npconn *);
 void np_conn_respond(Npreq *req);
+void np_conn_add_req(Npconn *conn, Npreq *req);
+void np_conn_remove_req(Npconn *conn, Npreq *req);
 char *np_conn_get_client_id(Npconn *);
 int np_conn_get_authuser(Npconn *, u32 *);
 void np_conn_set_authuser(Npconn *, u32);
@@ -353,6 +592,7 @@ void np_conn_set_authuser(Npconn *, u32);
 Npfidpool *np_fidpool_create(void);
 void np_fidpool_destroy(Npfidpool *);
 int np_fidpool_count(Npfidpool *pool);
+int np_fidpool_size(Npfidpool *pool);
 Npfid *np_fid_find(Npconn *, u32);
 Npfid *np_fid_create(Npconn *, u32, void *);
 void np_fid_destroy(Npfid *);
@@ -365,7 +605,9 @@ Nptrans *np_trans_create(void *aux, int (*recv)(Npfcall **, u32, void *),
 				    void (*destroy)(void *));
 void np_trans_destroy(Nptrans *);
 int np_trans_send(Nptrans *, Npfcall *);
+int np_trans_sendv(Nptrans *, Npfcall **, int);
 int np_trans_recv(Nptrans *, Npfcall **, u32);
+int np_trans_recv_nb(Nptrans *, Npfcall **, u32);
 
 /* npstring.c */
 void np_strzero(Npstr *str);
@@ -379,10 +621,25 @@ int aspf (char **sp, int *lp, const char *fmt, ...)
 	__attribute__ ((format (printf, 3,4)));
 int np_encode_tpools_str (char **s, int *len, Npstats *stats);
 int np_decode_tpools_str (char *s, Npstats *stats);
+int np_latop_index (u8 type);
+char *np_latop_name (int op);
+int np_encode_latency_str (char **s, int *len, char *name, int op,
+			   Nplatency *lat);
+int np_decode_latency_str (char *s, char **name, int *op, Nplatency *lat);
+int np_encode_acct_str (char **s, int *len, Npacct *acct);
+int np_decode_acct_str (char *s, Npacct *acct);
+int np_encode_tpools_bin (u8 **buf, int *len, Npstats *stats,
+			  Nplatency *lat);
+int np_decode_tpools_bin (u8 *buf, int len, Npstats **statsp,
+			  Nplatency **latp);
 
 /* np.c */
 int np_peek_size(u8 *buf, int len);
 Npfcall *np_alloc_fcall(int msize);
+void np_free_fcall(Npfcall *fc);
+#define NP_FCALL_IOVMAX	2
+struct iovec;
+int np_fcall_iov(Npfcall *fc, struct iovec *iov);
 int np_deserialize(Npfcall*);
 int np_serialize_p9dirent(Npqid *qid, u64 offset, u8 type, char *name, u8 *buf,
                           int buflen);
@@ -410,6 +667,10 @@ Npfcall *np_create_tremove(u32 fid);
 Npfcall *np_create_rremove(void);
 Npfcall *np_create_tread(u32 fid, u64 offset, u32 count);
 Npfcall * np_alloc_rread(u32);
+Npfcall *np_create_rread_splice(Npreq *req, int fd, u64 offset, u32 count);
+Npfcall *np_create_rread_ext(u32 count, u8 *data, void (*release)(void *),
+			     void *arg);
+int np_splice_write(Npreq *req, int fd, u64 offset);
 void np_set_rread_count(Npfcall *, u32);
 Npfcall *np_create_rlerror(u32 ecode);
 Npfcall *np_create_tstatfs(u32 fid);
@@ -515,5 +776,7 @@ int np_ctl_initialize (Npsrv *srv);
 void np_ctl_finalize (Npsrv *srv);
 Npfile *np_ctl_addfile (Npfile *parent, char *name, SynGetF getf, void *arg,
 			int flags);
+Npfile *np_ctl_addfile_bin (Npfile *parent, char *name, SynGetBinF getf,
+			    void *arg, int flags);
 Npfile *np_ctl_adddir (Npfile *parent, char *name);
 void np_ctl_delfile (Npfile *file);
@@ -54,8 +54,108 @@ Npfcall *np_unlinkat(Npreq *req, Npfcall *tc);
 
 /* srv.c */
 void np_srv_add_req(Npsrv *srv, Npreq *req);
-void np_srv_remove_req(Nptpool *tp, Npreq *req);
+void np_req_dequeued(Npreq *req);
+void np_srv_flush_reqs(Npconn *conn, int tag);
 Npreq *np_req_alloc(Npconn *conn, Npfcall *tc);
 Npreq *np_req_ref(Npreq*);
 void np_req_unref(Npreq*);
+Npreactor *np_srv_get_reactor(Npsrv *srv);
+void np_tpool_account(Nptpool *tp, u8 type, Npfcall *rc);
+void np_acct_snapshot(Npacct *acct, Npacct *snap);
+Npfcall *np_process_request(Npreq *req, Nptpool *tp);
+int np_tpool_minwthread(Nptpool *tp);
+int np_tpool_maxwthread(Nptpool *tp);
+int np_wthread_create(Nptpool *tp);
+void np_wthread_free(Npwthread *wt);
+void np_srv_add_workreq(Nptpool *tp, Npreq *req);
+void np_srv_remove_workreq(Nptpool *tp, Npreq *req);
+
+/* Run queues:  how a tpool queues requests and hands them to its workers.
+ * The server's is picked by its SRV_FLAGS_TPOOL_* flag, fifo if none.
+ */
+typedef int (*ReqWalkF)(Npreq *req, Npwthread *wt, void *arg);
+struct Nprunq {
+	int	(*srv_init)(Npsrv *srv);	/* optional */
+	void	(*srv_fini)(Npsrv *srv);	/* optional, even if srv_init failed */
+	int	(*init)(Nptpool *tp);		/* before workers start */
+	void	(*fini)(Nptpool *tp);		/* after they exit */
+	int	(*minwthread)(Nptpool *tp);	/* optional, else srv->nwthread */
+	void	(*add_req)(Nptpool *tp, Npreq *req);
+	void	(*wthread_proc)(Npwthread *wt);
+	/* Dequeue req if possible and return 1, else set *wtp to the
+	 * worker running it, if any (see np_req_flush ()).
+	 */
+	int	(*flush)(Nptpool *tp, Npreq *req, Npwthread **wtp);
+	/* Call fn on each queued (wt == NULL) and running request, except
+	 * those on tp->workreqs.  Stop and return -1 if fn does.
+	 */
+	int	(*walk)(Nptpool *tp, ReqWalkF fn, void *arg);
+	int	elastic;	/* tpools may grow to srv->nwthread_max */
+	int	workreqs;	/* running requests are on tp->workreqs */
+};
+
+/* runq_fifo.c */
+extern const Nprunq np_runq_fifo;
+int np_tpool_queue_req(Nptpool *tp, Npreq *req);
+Npreq *np_tpool_next_req(Nptpool *tp, Npwthread *wt);
+void np_srv_remove_req(Nptpool *tp, Npreq *req);
+void np_wthread_fifo_proc(Npwthread *wt);
+int np_tpool_fifo_init(Nptpool *tp);
+void np_tpool_fifo_fini(Nptpool *tp);
+int np_tpool_fifo_flush(Nptpool *tp, Npreq *req, Npwthread **wtp);
+int np_tpool_fifo_walk(Nptpool *tp, ReqWalkF fn, void *arg);
+
+/* runq_ring.c */
+extern const Nprunq np_runq_ring;
+
+/* runq_shared.c */
+extern const Nprunq np_runq_shared;
+
+/* runq_steal.c */
+extern const Nprunq np_runq_steal;
+
+/* user.c */
+Npacct *np_user_acct_get(Npuser *u);
+void np_user_acct_put(Npacct *acct);
+
+/* conn.c */
+int np_conn_dispatch(Npconn *conn, Npfcall *fc);
+void np_conn_finish_async(Npconn *conn);
+void np_conn_senders_destroy(Npsrv *srv);
+
+
+/* ring.c */
+Npring *np_ring_create(int size);
+void np_ring_destroy(Npring *r);
+int np_ring_put(Npring *r, void *item);
+void *np_ring_get(Npring *r, void **publish);
+int np_ring_count(Npring *r);
+int np_ring_walk(Npring *r, int (*fn)(void *item, void *arg), void *arg);
+
+/* cache.c */
+typedef struct Npcache Npcache;
+Npcache *np_cache_create(char *name, int size, void (*ctor)(void *),
+			 void (*dtor)(void *));
+void *np_cache_alloc(Npcache *c);
+void np_cache_free(Npcache *c, void *obj);
+int np_cache_report(char **sp, int *lp);
+
+/* reactor.c */
+Npreactor *np_reactor_create(Npsrv *srv);
+void np_reactor_destroy(Npreactor *r);
+int np_reactor_add(Npreactor *r, Npconn *conn);
+
+/* splice.c */
+struct Nppipe {
+	int		rfd;
+	int		wfd;
+	int		size;	/* capacity in bytes */
+	int		pooled;	/* from np_pipe_get (), not a thread's */
+	Nppipe		*next;
+};
+Nppipe *np_pipe_get(u32 count);
+void np_splice_release(Npfcall *fc);
+int np_splice_pull(Npfcall *fc, u8 *buf);
 
+/* np.c */
+Npfcall *np_create_rread_hdr(u32 count, Nppipe *p);
@@ -168,7 +168,8 @@ np_decode_tpools_str (char *s, Npstats *stats)
 		"%"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64" " \
 		"%"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64" " \
 		"%"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64" " \
-		"%"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64,
+		"%"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64" " \
+		"%d %d %d",
 			&stats->name, &stats->numreqs, &stats->numfids,
 			&stats->rbytes, &stats->wbytes,
 			&stats->nreqs[P9_TSTATFS],
@@ -220,8 +221,15 @@ np_decode_tpools_str (char *s, Npstats *stats)
 			&stats->wcount[8],
 			&stats->wcount[9],
 			&stats->wcount[10],
-			&stats->wcount[11]);
-	if (n != 55) {
+			&stats->wcount[11],
+			&stats->numwthreads,
+			&stats->minwthreads,
+			&stats->maxwthreads);
+	if (n == 55) {	/* older server without worker counts */
+		stats->numwthreads = 0;
+		stats->minwthreads = 0;
+		stats->maxwthreads = 0;
+	} else if (n != 58) {
 		if (stats->name) {
 			free (stats->name);
 			stats->name = NULL;
@@ -244,7 +252,7 @@ np_encode_tpools_str (char **s, int *len, Npstats *stats)
 		"%"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64" " \
 		"%"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64" " \
 		"%"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64" " \
-		"\n",
+		"%d %d %d \n",
 			stats->name, stats->numreqs, stats->numfids,
 			stats->rbytes, stats->wbytes,
 			stats->nreqs[P9_TSTATFS],
@@ -296,5 +304,413 @@ np_encode_tpools_str (char **s, int *len, Npstats *stats)
 			stats->wcount[8],
 			stats->wcount[9],
 			stats->wcount[10],
-			stats->wcount[11]);
+			stats->wcount[11],
+			stats->numwthreads,
+			stats->minwthreads,
+			stats->maxwthreads);
+}
+
+static const struct {
+	u8	type;
+	char	*name;
+} latops[NPSTATS_LAT_NOPS] = {
+	{ P9_TSTATFS,		"statfs" },
+	{ P9_TLOPEN,		"lopen" },
+	{ P9_TLCREATE,		"lcreate" },
+	{ P9_TSYMLINK,		"symlink" },
+	{ P9_TMKNOD,		"mknod" },
+	{ P9_TRENAME,		"rename" },
+	{ P9_TREADLINK,		"readlink" },
+	{ P9_TGETATTR,		"getattr" },
+	{ P9_TSETATTR,		"setattr" },
+	{ P9_TXATTRWALK,	"xattrwalk" },
+	{ P9_TXATTRCREATE,	"xattrcreate" },
+	{ P9_TREADDIR,		"readdir" },
+	{ P9_TFSYNC,		"fsync" },
+	{ P9_TLOCK,		"lock" },
+	{ P9_TGETLOCK,		"getlock" },
+	{ P9_TLINK,		"link" },
+	{ P9_TMKDIR,		"mkdir" },
+	{ P9_TRENAMEAT,		"renameat" },
+	{ P9_TUNLINKAT,		"unlinkat" },
+	{ P9_TVERSION,		"version" },
+	{ P9_TAUTH,		"auth" },
+	{ P9_TATTACH,		"attach" },
+	{ P9_TWALK,		"walk" },
+	{ P9_TREAD,		"read" },
+	{ P9_TWRITE,		"write" },
+	{ P9_TCLUNK,		"clunk" },
+	{ P9_TREMOVE,		"remove" },
+};
+
+/* Map a T-message type to its slot in Nplatslot, or -1.
+ */
+int
+np_latop_index (u8 type)
+{
+	int i;
+
+	for (i = 0; i < NPSTATS_LAT_NOPS; i++) {
+		if (latops[i].type == type)
+			return i;
+	}
+	return -1;
+}
+
+char *
+np_latop_name (int op)
+{
+	if (op < 0 || op >= NPSTATS_LAT_NOPS)
+		return NULL;
+	return latops[op].name;
+}
+
+static int
+_u64list_str (char *s, int len, u64 *v, int n)
+{
+	int i, off = 0;
+
+	for (i = 0; i < n && off < len; i++)
+		off += snprintf (s + off, len - off, " %"PRIu64, v[i]);
+	return off;
+}
+
+/* One line per tpool and op:  name op count qtime stime rtime, then
+ * the qbins, sbins, and rbins histograms.
+ */
+int
+np_encode_latency_str (char **s, int *len, char *name, int op,
+		       Nplatency *lat)
+{
+	char buf[(4 + 3 * NPSTATS_LAT_BINS) * 21 + 1];
+	u64 v[4] = { lat->count, lat->qtime, lat->stime, lat->rtime };
+	int n;
+
+	n = _u64list_str (buf, sizeof (buf), v, 4);
+	n += _u64list_str (buf + n, sizeof (buf) - n, lat->qbins,
+			   NPSTATS_LAT_BINS);
+	n += _u64list_str (buf + n, sizeof (buf) - n, lat->sbins,
+			   NPSTATS_LAT_BINS);
+	n += _u64list_str (buf + n, sizeof (buf) - n, lat->rbins,
+			   NPSTATS_LAT_BINS);
+	return aspf (s, len, "%s %s%s\n", name, np_latop_name (op), buf);
+}
+
+static int
+_u64list_scan (char **sp, u64 *v, int n)
+{
+	char *s = *sp, *end;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		v[i] = strtoull (s, &end, 10);
+		if (end == s)
+			return -1;
+		s = end;
+	}
+	*sp = s;
+	return 0;
+}
+
+int
+np_decode_latency_str (char *s, char **name, int *op, Nplatency *lat)
+{
+	char *opname = NULL;
+	u64 v[4];
+	int n;
+
+	*name = NULL;
+	if (sscanf (s, "%ms %ms %n", name, &opname, &n) != 2)
+		goto error;
+	s += n;
+	for (*op = 0; *op < NPSTATS_LAT_NOPS; (*op)++) {
+		if (!strcmp (opname, latops[*op].name))
+			break;
+	}
+	if (*op == NPSTATS_LAT_NOPS)
+		goto error;
+	if (_u64list_scan (&s, v, 4) < 0
+	 || _u64list_scan (&s, lat->qbins, NPSTATS_LAT_BINS) < 0
+	 || _u64list_scan (&s, lat->sbins, NPSTATS_LAT_BINS) < 0
+	 || _u64list_scan (&s, lat->rbins, NPSTATS_LAT_BINS) < 0)
+		goto error;
+	lat->count = v[0];
+	lat->qtime = v[1];
+	lat->stime = v[2];
+	lat->rtime = v[3];
+	free (opname);
+	return 0;
+error:
+	if (opname)
+		free (opname);
+	if (*name) {
+		free (*name);
+		*name = NULL;
+	}
+	return -1;
+}
+
+/* Append "outstanding rbytes wbytes nreqs... stime_us" to a line of the
+ * connections or users ctl file, with nreqs in np_latop_index () order.
+ */
+int
+np_encode_acct_str (char **s, int *len, Npacct *acct)
+{
+	char buf[(3 + NPSTATS_LAT_NOPS) * 21 + 1];
+	u64 v[2] = { acct->rbytes, acct->wbytes };
+	u64 us = acct->stime / 1000;
+	int n;
+
+	n = _u64list_str (buf, sizeof (buf), v, 2);
+	n += _u64list_str (buf + n, sizeof (buf) - n, acct->nreqs,
+			   NPSTATS_LAT_NOPS);
+	n += _u64list_str (buf + n, sizeof (buf) - n, &us, 1);
+	return aspf (s, len, " %d%s\n", acct->outstanding, buf);
+}
+
+int
+np_decode_acct_str (char *s, Npacct *acct)
+{
+	char *end;
+	u64 v[2], us;
+
+	acct->outstanding = strtol (s, &end, 10);
+	if (end == s)
+		return -1;
+	s = end;
+	if (_u64list_scan (&s, v, 2) < 0
+	 || _u64list_scan (&s, acct->nreqs, NPSTATS_LAT_NOPS) < 0
+	 || _u64list_scan (&s, &us, 1) < 0)
+		return -1;
+	acct->rbytes = v[0];
+	acct->wbytes = v[1];
+	acct->stime = us * 1000;
+	return 0;
+}
+
+/* tpools.bin holds a header followed by one record per tpool, all
+ * little-endian and 8 byte aligned:
+ *
+ * header: magic[4] version[2] hdrlen[2] ntpools[4] nops[2] nrwbins[1]
+ *	nlatbins[1], then the T-message type of each op[1], padded
+ * record: reclen[4] namelen[2] pad[2] numreqs[4] numfids[4]
+ *	numwthreads[4] minwthreads[4] maxwthreads[4] pad[4],
+ *	name, padded, rbytes[8] wbytes[8] rcount[8 * nrwbins]
+ *	wcount[8 * nrwbins], then for each op, nreqs[8] count[8] qtime[8]
+ *	stime[8] rtime[8] qbins[8 * nlatbins] sbins[8 * nlatbins]
+ *	rbins[8 * nlatbins]
+ *
+ * Readers find everything through hdrlen, reclen, and the counts in the
+ * header, so ops, bins, and fields appended to the header or records
+ * don't need a new version.
+ */
+#define BIN_HDRLEN	16
+#define BIN_RECLEN	32
+#define BIN_NOPS	(NPSTATS_LAT_NOPS + 1)	/* latops and flush */
+#define BIN_PAD(n)	(((n) + 7) & ~7)
+
+static u8
+_bin_optype (int i)
+{
+	return i < NPSTATS_LAT_NOPS ? latops[i].type : P9_TFLUSH;
+}
+
+static u8 *
+_put_le (u8 *p, u64 v, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		p[i] = v >> (8 * i);
+	return p + n;
+}
+
+static u8 *
+_put_u64s (u8 *p, u64 *v, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		p = _put_le (p, v[i], 8);
+	return p;
+}
+
+static u64
+_get_le (u8 *p, int n)
+{
+	u64 v = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+		v |= (u64)p[i] << (8 * i);
+	return v;
+}
+
+static u8 *
+_get_u64s (u8 *p, u64 *v, int n, int max)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (i < max)
+			v[i] = _get_le (p, 8);
+		p += 8;
+	}
+	return p;
+}
+
+/* Append a record for one tpool to *buf, which holds *len bytes, with
+ * lat indexed like np_latop_index ().  The header is written with the
+ * first record.
+ */
+int
+np_encode_tpools_bin (u8 **buf, int *len, Npstats *stats, Nplatency *lat)
+{
+	int hdrlen = BIN_PAD (BIN_HDRLEN + BIN_NOPS);
+	int namelen = strlen (stats->name);
+	int oplen = 8 * (5 + 3 * NPSTATS_LAT_BINS);
+	int reclen = BIN_RECLEN + BIN_PAD (namelen)
+		     + 8 * (2 + 2 * NPSTATS_RWCOUNT_BINS) + BIN_NOPS * oplen;
+	int off = *len > 0 ? *len : hdrlen;
+	Nplatency *l, zero;
+	u8 *p, *s;
+	int i, op;
+
+	if (!(s = realloc (*buf, off + reclen)))
+		return -1;
+	*buf = s;
+	if (*len == 0) {
+		memset (s, 0, hdrlen);
+		p = _put_le (s, NPSTATS_BIN_MAGIC, 4);
+		p = _put_le (p, NPSTATS_BIN_VERSION, 2);
+		p = _put_le (p, hdrlen, 2);
+		p = _put_le (p, 0, 4);
+		p = _put_le (p, BIN_NOPS, 2);
+		p = _put_le (p, NPSTATS_RWCOUNT_BINS, 1);
+		p = _put_le (p, NPSTATS_LAT_BINS, 1);
+		for (i = 0; i < BIN_NOPS; i++)
+			p = _put_le (p, _bin_optype (i), 1);
+	}
+	_put_le (s + 8, _get_le (s + 8, 4) + 1, 4);
+
+	p = s + off;
+	memset (p, 0, reclen);
+	p = _put_le (p, reclen, 4);
+	p = _put_le (p, namelen, 2);
+	p = _put_le (p, 0, 2);
+	p = _put_le (p, stats->numreqs, 4);
+	p = _put_le (p, stats->numfids, 4);
+	p = _put_le (p, stats->numwthreads, 4);
+	p = _put_le (p, stats->minwthreads, 4);
+	p = _put_le (p, stats->maxwthreads, 4);
+	p = _put_le (p, 0, 4);
+	memcpy (p, stats->name, namelen);
+	p += BIN_PAD (namelen);
+	p = _put_le (p, stats->rbytes, 8);
+	p = _put_le (p, stats->wbytes, 8);
+	p = _put_u64s (p, stats->rcount, NPSTATS_RWCOUNT_BINS);
+	p = _put_u64s (p, stats->wcount, NPSTATS_RWCOUNT_BINS);
+	memset (&zero, 0, sizeof (zero));
+	for (i = 0; i < BIN_NOPS; i++) {
+		op = _bin_optype (i);
+		l = i < NPSTATS_LAT_NOPS ? &lat[i] : &zero;
+		p = _put_le (p, op <= P9_RWSTAT ? stats->nreqs[op] : 0, 8);
+		p = _put_le (p, l->count, 8);
+		p = _put_le (p, l->qtime, 8);
+		p = _put_le (p, l->stime, 8);
+		p = _put_le (p, l->rtime, 8);
+		p = _put_u64s (p, l->qbins, NPSTATS_LAT_BINS);
+		p = _put_u64s (p, l->sbins, NPSTATS_LAT_BINS);
+		p = _put_u64s (p, l->rbins, NPSTATS_LAT_BINS);
+	}
+	*len = off + reclen;
+	return 0;
+}
+
+/* Decode tpools.bin into arrays of one Npstats, and NPSTATS_LAT_NOPS
+ * Nplatency, per tpool, which the caller must free, along with each
+ * stats name.  Returns the number of tpools, or -1 if buf is malformed.
+ */
+int
+np_decode_tpools_bin (u8 *buf, int len, Npstats **statsp, Nplatency **latp)
+{
+	Npstats *stats = NULL, *st;
+	Nplatency *lat = NULL, *l, skip;
+	int hdrlen, ntpools = 0, nops, nrwbins, nlatbins;
+	int i, j, k, reclen, namelen, oplen;
+	u8 *p, *rec, *optype;
+	u64 nreqs;
+
+	if (len < BIN_HDRLEN || _get_le (buf, 4) != NPSTATS_BIN_MAGIC
+			     || _get_le (buf + 4, 2) != NPSTATS_BIN_VERSION)
+		goto error;
+	hdrlen = _get_le (buf + 6, 2);
+	ntpools = _get_le (buf + 8, 4);
+	nops = _get_le (buf + 12, 2);
+	nrwbins = buf[14];
+	nlatbins = buf[15];
+	optype = buf + BIN_HDRLEN;
+	oplen = 8 * (5 + 3 * nlatbins);
+	if (hdrlen < BIN_HDRLEN + nops || hdrlen > len
+				       || ntpools > (len - hdrlen) / BIN_RECLEN)
+		goto error;
+	if (!(stats = calloc (ntpools + 1, sizeof (*stats))))
+		goto error;
+	if (!(lat = calloc ((ntpools + 1) * NPSTATS_LAT_NOPS, sizeof (*lat))))
+		goto error;
+	rec = buf + hdrlen;
+	for (i = 0; i < ntpools; i++) {
+		st = &stats[i];
+		if (rec + BIN_RECLEN > buf + len)
+			goto error;
+		reclen = _get_le (rec, 4);
+		namelen = _get_le (rec + 4, 2);
+		if (reclen < BIN_RECLEN + BIN_PAD (namelen)
+			+ 8 * (2 + 2 * nrwbins) + nops * oplen
+			|| rec + reclen > buf + len)
+			goto error;
+		st->numreqs = _get_le (rec + 8, 4);
+		st->numfids = _get_le (rec + 12, 4);
+		st->numwthreads = _get_le (rec + 16, 4);
+		st->minwthreads = _get_le (rec + 20, 4);
+		st->maxwthreads = _get_le (rec + 24, 4);
+		p = rec + BIN_RECLEN;
+		if (!(st->name = strndup ((char *)p, namelen)))
+			goto error;
+		p += BIN_PAD (namelen);
+		st->rbytes = _get_le (p, 8);
+		st->wbytes = _get_le (p + 8, 8);
+		p = _get_u64s (p + 16, st->rcount, nrwbins,
+			       NPSTATS_RWCOUNT_BINS);
+		p = _get_u64s (p, st->wcount, nrwbins, NPSTATS_RWCOUNT_BINS);
+		for (j = 0; j < nops; j++) {
+			k = np_latop_index (optype[j]);
+			l = k >= 0 ? &lat[i * NPSTATS_LAT_NOPS + k] : &skip;
+			p = _get_u64s (p, &nreqs, 1, 1);
+			if (optype[j] <= P9_RWSTAT)
+				st->nreqs[optype[j]] = nreqs;
+			p = _get_u64s (p, &l->count, 1, 1);
+			p = _get_u64s (p, &l->qtime, 1, 1);
+			p = _get_u64s (p, &l->stime, 1, 1);
+			p = _get_u64s (p, &l->rtime, 1, 1);
+			p = _get_u64s (p, l->qbins, nlatbins,NPSTATS_LAT_BINS);
+			p = _get_u64s (p, l->sbins, nlatbins,NPSTATS_LAT_BINS);
+			p = _get_u64s (p, l->rbins, nlatbins,NPSTATS_LAT_BINS);
+		}
+		rec += reclen;
+	}
+	*statsp = stats;
+	*latp = lat;
+	return ntpools;
+error:
+	if (stats) {
+		for (i = 0; i < ntpools; i++) {
+			if (stats[i].name)
+				free (stats[i].name);
+		}
+		free (stats);
+	}
+	if (lat)
+		free (lat);
+	return -1;
 }
@@ -13,6 +13,7 @@
 #include <stdarg.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/uio.h>
 #include <assert.h>
 #include <infiniband/verbs.h>
 #include <rdma/rdma_cma.h>
@@ -311,8 +312,9 @@ poll:
 static int
 rdma_trans_send(Npfcall *fc, void *a)
 {
-	int i, n;
+	int i, n, cnt, len = 0;
 	Rdmatrans *rdma;
+	struct iovec iov[NP_FCALL_IOVMAX];
 	struct ibv_sge sge;
 	struct ibv_send_wr wr, *bad_wr;
 	Rdmactx *wctx;
@@ -335,13 +337,17 @@ again:
 	wctx->wc_op = IBV_WC_SEND;
 	wctx->rdma = rdma;
 	wctx->used = 1;
-	wctx->len = fc->size;
+	cnt = np_fcall_iov(fc, iov);
+	for (i = 0; i < cnt; i++) {
+		memmove(wctx->buf + len, iov[i].iov_base, iov[i].iov_len);
+		len += iov[i].iov_len;
+	}
+	wctx->len = len;
 	wctx->pos = 0;
-	memmove(wctx->buf, fc->pkt, fc->size);
 	pthread_mutex_unlock(&rdma->lock);
 
 	sge.addr = (uintptr_t) wctx->buf;
-	sge.length = fc->size;
+	sge.length = len;
 	sge.lkey = rdma->snd_mr->lkey;
 	wr.next = NULL;
 	wr.wr_id = (u64)(unsigned long)wctx;
@@ -355,7 +361,7 @@ again:
 		return -1;
 	}
 
-	return fc->size;
+	return len;
 }
 
 /**
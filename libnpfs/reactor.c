@@ -0,0 +1,227 @@
+/*****************************************************************************
+ *  Copyright (C) 2011 Lawrence Livermore National Security, LLC.
+ *  Written by Jim Garlick <garlick@llnl.gov> LLNL-CODE-423279
+ *  All Rights Reserved.
+ *
+ *  This file is part of the Distributed I/O Daemon (diod).
+ *  For details, see <http://code.google.com/p/diod/>.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+
+/* reactor.c - epoll-driven connection reader */
+
+/* With SRV_FLAGS_REACTOR, each connection is read by one of a few
+ * reactor threads rather than by its own thread.  A reactor waits for
+ * its connections' fds to become readable, assembles requests with the
+ * transport's non-blocking recv, and hands them to the tpools.
+ * A connection gets at most REACTOR_BATCH requests per turn;  one with
+ * more already buffered is revisited before the reactor sleeps again.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "9p.h"
+#include "npfs.h"
+#include "xpthread.h"
+#include "npfsimpl.h"
+
+#define REACTOR_EVENTS	64
+#define REACTOR_BATCH	16
+
+struct Npreactor {
+	Npsrv		*srv;
+	int		epfd;
+	int		wakefd;		/* eventfd to interrupt epoll_wait */
+	int		shutdown;
+	pthread_t	thread;
+	Npconn		*busy;		/* revisit without waiting */
+};
+
+static void *np_reactor_proc(void *a);
+
+Npreactor *
+np_reactor_create (Npsrv *srv)
+{
+	Npreactor *r;
+	struct epoll_event ev;
+	int err;
+
+	if (!(r = malloc (sizeof (*r)))) {
+		np_uerror (ENOMEM);
+		return NULL;
+	}
+	memset (r, 0, sizeof (*r));
+	r->srv = srv;
+	r->wakefd = -1;
+	if ((r->epfd = epoll_create1 (EPOLL_CLOEXEC)) < 0) {
+		np_uerror (errno);
+		goto error;
+	}
+	if ((r->wakefd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+		np_uerror (errno);
+		goto error;
+	}
+	memset (&ev, 0, sizeof (ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl (r->epfd, EPOLL_CTL_ADD, r->wakefd, &ev) < 0) {
+		np_uerror (errno);
+		goto error;
+	}
+	if ((err = pthread_create (&r->thread, NULL, np_reactor_proc, r))) {
+		np_uerror (err);
+		goto error;
+	}
+	return r;
+error:
+	if (r->wakefd >= 0)
+		close (r->wakefd);
+	if (r->epfd >= 0)
+		close (r->epfd);
+	free (r);
+	return NULL;
+}
+
+/* Connections still registered are left as they are, as they would be
+ * with read threads.
+ */
+void
+np_reactor_destroy (Npreactor *r)
+{
+	u64 one = 1;
+
+	__atomic_store_n (&r->shutdown, 1, __ATOMIC_SEQ_CST);
+	if (write (r->wakefd, &one, sizeof (one)) < 0)
+		np_logerr (r->srv, "reactor: write eventfd");
+	pthread_join (r->thread, NULL);
+	close (r->wakefd);
+	close (r->epfd);
+	free (r);
+}
+
+int
+np_reactor_add (Npreactor *r, Npconn *conn)
+{
+	struct epoll_event ev;
+
+	memset (&ev, 0, sizeof (ev));
+	ev.events = EPOLLIN | EPOLLRDHUP;
+	ev.data.ptr = conn;
+	conn->reactor = r;
+	if (epoll_ctl (r->epfd, EPOLL_CTL_ADD, conn->trans->fd, &ev) < 0) {
+		conn->reactor = NULL;
+		np_uerror (errno);
+		return -1;
+	}
+	return 0;
+}
+
+/* Read up to REACTOR_BATCH requests from conn.  Returns 1 if more may be
+ * buffered, 0 if the fd is drained, or -1 if the connection was dropped
+ * (and conn may no longer be referenced).
+ */
+static int
+np_reactor_read (Npreactor *r, Npconn *conn)
+{
+	Npsrv *srv = r->srv;
+	Npfcall *fc;
+	int i, n;
+
+	for (i = 0; i < REACTOR_BATCH; i++) {
+		n = np_trans_recv_nb (conn->trans, &fc, conn->msize);
+		if (n == 0)
+			return 0;
+		if (n < 0) {
+			np_logerr (srv, "recv error - "
+				   "dropping connection to '%s'",
+				   conn->client_id);
+			goto drop;
+		}
+		if (!fc)
+			goto drop;
+		if (np_conn_dispatch (conn, fc) < 0)
+			goto drop;
+	}
+	return 1;
+drop:
+	(void)epoll_ctl (r->epfd, EPOLL_CTL_DEL, conn->trans->fd, NULL);
+	conn->reactor = NULL;
+	np_conn_finish_async (conn);
+	return -1;
+}
+
+static void
+np_reactor_push (Npreactor *r, Npconn *conn)
+{
+	conn->rbusy = 1;
+	conn->rnext = r->busy;
+	r->busy = conn;
+}
+
+static void *
+np_reactor_proc (void *a)
+{
+	Npreactor *r = (Npreactor *)a;
+	struct epoll_event ev[REACTOR_EVENTS];
+	Npconn *conn, *next;
+	int i, n;
+	u64 val;
+
+	while (!__atomic_load_n (&r->shutdown, __ATOMIC_SEQ_CST)) {
+		n = epoll_wait (r->epfd, ev, REACTOR_EVENTS, r->busy ? 0 : -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			np_logerr (r->srv, "reactor: epoll_wait");
+			break;
+		}
+		/* Add newly readable connections to those left over from
+		 * the last turn, visiting each once.
+		 */
+		for (i = 0; i < n; i++) {
+			if (!(conn = ev[i].data.ptr)) {
+				if (read (r->wakefd, &val, sizeof (val)) < 0
+							&& errno != EAGAIN)
+					np_logerr (r->srv, "reactor: read eventfd");
+				continue;
+			}
+			if (!conn->rbusy)
+				np_reactor_push (r, conn);
+		}
+		conn = r->busy;
+		r->busy = NULL;
+		for (; conn != NULL; conn = next) {
+			next = conn->rnext;
+			conn->rbusy = 0;
+			if (np_reactor_read (r, conn) > 0)
+				np_reactor_push (r, conn);
+		}
+	}
+	return NULL;
+}
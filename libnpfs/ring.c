@@ -0,0 +1,208 @@
+/*****************************************************************************
+ *  Copyright (C) 2011 Lawrence Livermore National Security, LLC.
+ *  Written by Jim Garlick <garlick@llnl.gov> LLNL-CODE-423279
+ *  All Rights Reserved.
+ *
+ *  This file is part of the Distributed I/O Daemon (diod).
+ *  For details, see <http://code.google.com/p/diod/>.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/* ring.c - bounded lock-free multi-producer/multi-consumer queue */
+
+/* Each cell carries a sequence number that tells producers and consumers
+ * whose turn it is:  seq == pos means the cell is free for the producer
+ * that claims position pos; seq == pos + 1 means it holds the item put
+ * at pos.  Positions are claimed with compare-and-swap on head/tail.
+ * (After D. Vyukov's bounded MPMC queue.)
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <errno.h>
+#include <assert.h>
+#include "9p.h"
+#include "npfs.h"
+#include "npfsimpl.h"
+
+#define RING_CACHELINE	64
+
+typedef struct {
+	unsigned long	seq;
+	void		*item;
+} Npcell;
+
+struct Npring {
+	unsigned long	mask;
+	Npcell		*cells;
+	char		pad0[RING_CACHELINE];
+	unsigned long	head;		/* next position to put */
+	char		pad1[RING_CACHELINE];
+	unsigned long	tail;		/* next position to get */
+	char		pad2[RING_CACHELINE];
+};
+
+Npring *
+np_ring_create (int size)
+{
+	Npring *r;
+	int i;
+
+	assert (size > 0 && (size & (size - 1)) == 0);
+	if (!(r = malloc (sizeof (*r)))) {
+		np_uerror (ENOMEM);
+		return NULL;
+	}
+	memset (r, 0, sizeof (*r));
+	if (!(r->cells = malloc (size * sizeof (Npcell)))) {
+		free (r);
+		np_uerror (ENOMEM);
+		return NULL;
+	}
+	for (i = 0; i < size; i++) {
+		r->cells[i].seq = i;
+		r->cells[i].item = NULL;
+	}
+	r->mask = size - 1;
+	return r;
+}
+
+void
+np_ring_destroy (Npring *r)
+{
+	free (r->cells);
+	free (r);
+}
+
+/* Returns -1 if the ring is full.
+ */
+int
+np_ring_put (Npring *r, void *item)
+{
+	unsigned long pos, seq;
+	Npcell *c;
+	long dif;
+
+	pos = __atomic_load_n (&r->head, __ATOMIC_RELAXED);
+	for (;;) {
+		c = &r->cells[pos & r->mask];
+		seq = __atomic_load_n (&c->seq, __ATOMIC_ACQUIRE);
+		dif = (long)seq - (long)pos;
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n (&r->head, &pos,
+					pos + 1, 1, __ATOMIC_RELAXED,
+					__ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0)
+			return -1;
+		else
+			pos = __atomic_load_n (&r->head, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n (&c->item, item, __ATOMIC_RELAXED);
+	__atomic_store_n (&c->seq, pos + 1, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+/* Returns NULL if the ring is empty.  If 'publish' is non-NULL, the item
+ * is stored there before its cell is released, so that a concurrent
+ * np_ring_walk () that misses the item in the ring is guaranteed to find
+ * it at *publish.
+ */
+void *
+np_ring_get (Npring *r, void **publish)
+{
+	unsigned long pos, seq;
+	Npcell *c;
+	void *item;
+	long dif;
+
+	pos = __atomic_load_n (&r->tail, __ATOMIC_RELAXED);
+	for (;;) {
+		c = &r->cells[pos & r->mask];
+		seq = __atomic_load_n (&c->seq, __ATOMIC_ACQUIRE);
+		dif = (long)seq - (long)(pos + 1);
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n (&r->tail, &pos,
+					pos + 1, 1, __ATOMIC_RELAXED,
+					__ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0)
+			return NULL;
+		else
+			pos = __atomic_load_n (&r->tail, __ATOMIC_RELAXED);
+	}
+	item = __atomic_load_n (&c->item, __ATOMIC_RELAXED);
+	if (publish)
+		__atomic_store_n (publish, item, __ATOMIC_SEQ_CST);
+	__atomic_store_n (&c->seq, pos + r->mask + 1, __ATOMIC_SEQ_CST);
+	return item;
+}
+
+/* Approximate number of items in the ring.
+ */
+int
+np_ring_count (Npring *r)
+{
+	unsigned long tail = __atomic_load_n (&r->tail, __ATOMIC_SEQ_CST);
+	unsigned long head = __atomic_load_n (&r->head, __ATOMIC_SEQ_CST);
+	long n = (long)head - (long)tail;
+
+	if (n < 0)
+		n = 0;
+	if (n > (long)r->mask + 1)
+		n = r->mask + 1;
+	return n;
+}
+
+/* Call fn on each item present in the ring, without removing it.
+ * The ring may change underneath us;  an item is only passed to fn if its
+ * cell was seen holding it both before and after the item was read.
+ * It is up to the caller to keep items from being freed while in fn.
+ * Stop and return -1 if fn returns -1.
+ */
+int
+np_ring_walk (Npring *r, int (*fn)(void *item, void *arg), void *arg)
+{
+	unsigned long pos, tail, head, seq;
+	Npcell *c;
+	void *item;
+
+	tail = __atomic_load_n (&r->tail, __ATOMIC_SEQ_CST);
+	head = __atomic_load_n (&r->head, __ATOMIC_SEQ_CST);
+	if ((long)(head - tail) > (long)(r->mask + 1))
+		tail = head - (r->mask + 1);
+	for (pos = tail; (long)(head - pos) > 0; pos++) {
+		c = &r->cells[pos & r->mask];
+		seq = __atomic_load_n (&c->seq, __ATOMIC_SEQ_CST);
+		if (seq != pos + 1)
+			continue;
+		item = __atomic_load_n (&c->item, __ATOMIC_RELAXED);
+		__atomic_thread_fence (__ATOMIC_ACQUIRE);
+		seq = __atomic_load_n (&c->seq, __ATOMIC_SEQ_CST);
+		if (seq != pos + 1)
+			continue;
+		if (fn (item, arg) < 0)
+			return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,613 @@
+/*****************************************************************************
+ *  Copyright (C) 2011 Lawrence Livermore National Security, LLC.
+ *  Written by Jim Garlick <garlick@llnl.gov> LLNL-CODE-423279
+ *  All Rights Reserved.
+ *
+ *  This file is part of the Distributed I/O Daemon (diod).
+ *  For details, see <http://code.google.com/p/diod/>.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/* runq_fifo.c - tpool run queue on a locked list (the default) */
+
+/* Requests are queued on tp->reqs_first in arrival order, and also per
+ * connection in one of two lanes, metadata and data, so that workers can
+ * share each lane fairly among connections (see np_tpool_next_req ()).
+ * Workers take requests under tp->lock, and the tpool grows and shrinks
+ * with the load between srv->nwthread and srv->nwthread_max.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <errno.h>
+#include <assert.h>
+#include <time.h>
+#include "9p.h"
+#include "npfs.h"
+#include "xpthread.h"
+#include "npfsimpl.h"
+
+/* Deficit round-robin between connections (see np_tpool_next_req ()):
+ * each turn a connection may dequeue up to TPOOL_DRR_QUANTUM bytes of
+ * reads and writes.  Other operations cost TPOOL_DRR_OPCOST.
+ */
+#define TPOOL_DRR_QUANTUM	65536
+#define TPOOL_DRR_OPCOST	1024
+
+static u64
+_time_ms (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Find the connq for conn in the request's lane, or start a new one at
+ * the end of that lane's round-robin list.  A new connq that is alone on
+ * the list gets its quantum now;  otherwise it gets it when
+ * np_tpool_lane_next () reaches it.
+ */
+static Npconnq *
+np_tpool_get_connq(Nptpool *tp, Npconn *conn, int lane)
+{
+	Npconnq *cq, **head = &tp->connqs[lane];
+
+	/* assert: tp->lock held */
+	if ((cq = *head)) {
+		do {
+			if (cq->conn == conn)
+				return cq;
+			cq = cq->next;
+		} while (cq != *head);
+	}
+	if ((cq = tp->connq_free))
+		tp->connq_free = cq->next;
+	else if (!(cq = malloc (sizeof (*cq))))
+		return NULL;
+	cq->conn = conn;
+	cq->lane = lane;
+	cq->reqs_first = cq->reqs_last = NULL;
+	if (*head) {
+		cq->deficit = 0;
+		cq->next = *head;
+		cq->prev = (*head)->prev;
+		cq->prev->next = cq;
+		cq->next->prev = cq;
+	} else {
+		cq->deficit = TPOOL_DRR_QUANTUM;
+		cq->next = cq->prev = cq;
+		*head = cq;
+	}
+	return cq;
+}
+
+static void
+np_tpool_put_connq(Nptpool *tp, Npconnq *cq)
+{
+	Npconnq **head = &tp->connqs[cq->lane];
+
+	/* assert: tp->lock held */
+	if (cq->next == cq)
+		*head = NULL;
+	else {
+		cq->prev->next = cq->next;
+		cq->next->prev = cq->prev;
+		if (*head == cq) {
+			*head = cq->next;
+			(*head)->deficit += TPOOL_DRR_QUANTUM;
+		}
+	}
+	cq->next = tp->connq_free;
+	tp->connq_free = cq;
+}
+
+static void
+np_srv_append_req(Nptpool *tp, Npreq *req)
+{
+	Npconnq *cq;
+
+	/* assert: tp->lock held */
+	req->queued = 1;
+	req->prev = tp->reqs_last;
+	if (tp->reqs_last)
+		tp->reqs_last->next = req;
+	tp->reqs_last = req;
+	if (!tp->reqs_first)
+		tp->reqs_first = req;
+
+	/* N.B. If we can't get a connq, req is still dispatched in
+	 * arrival order once the connqs drain.
+	 */
+	if (!(cq = np_tpool_get_connq(tp, req->conn, req->lane)))
+		return;
+	req->cprev = cq->reqs_last;
+	req->cnext = NULL;
+	if (cq->reqs_last)
+		cq->reqs_last->cnext = req;
+	cq->reqs_last = req;
+	if (!cq->reqs_first)
+		cq->reqs_first = req;
+	req->connq = cq;
+}
+
+static int
+np_req_cost(Npreq *req)
+{
+	Npfcall *tc = req->tcall;
+	int cost = 0;
+
+	switch (tc->type) {
+		case P9_TREAD:
+			cost = tc->u.tread.count;
+			break;
+		case P9_TWRITE:
+			cost = tc->u.twrite.count;
+			break;
+	}
+	if (cost < TPOOL_DRR_OPCOST)
+		cost = TPOOL_DRR_OPCOST;
+	if (cost > TPOOL_DRR_QUANTUM)
+		cost = TPOOL_DRR_QUANTUM;
+	return cost;
+}
+
+/* Choose the next request in a lane so that connections get equal
+ * shares of it:  the connq at the head of the round-robin list is served
+ * while its deficit covers the cost of its next request, then the next
+ * connq is credited with a quantum and takes its turn.
+ */
+static Npreq *
+np_tpool_lane_next(Nptpool *tp, int lane)
+{
+	Npconnq *cq;
+	Npreq *req;
+	int cost;
+
+	/* assert: tp->lock held */
+	if (!tp->connqs[lane])
+		return NULL;
+	for (;;) {
+		cq = tp->connqs[lane];
+		req = cq->reqs_first;
+		cost = np_req_cost(req);
+		if (cq->deficit >= cost) {
+			cq->deficit -= cost;
+			return req;
+		}
+		tp->connqs[lane] = cq->next;
+		tp->connqs[lane]->deficit += TPOOL_DRR_QUANTUM;
+	}
+}
+
+/* Choose the next request for wt to dequeue.  Metaonly workers take only
+ * metadata;  others take from whichever lane has waited longer.
+ * The caller removes the request with np_srv_remove_req ().
+ */
+Npreq *
+np_tpool_next_req(Nptpool *tp, Npwthread *wt)
+{
+	Npconnq *m = tp->connqs[NP_LANE_META];
+	Npconnq *d = tp->connqs[NP_LANE_DATA];
+	int lane;
+
+	/* assert: tp->lock held */
+	if (wt->metaonly)
+		return np_tpool_lane_next(tp, NP_LANE_META);
+	if (!m && !d)
+		return tp->reqs_first;
+	if (!d || (m && m->reqs_first->qtime <= d->reqs_first->qtime))
+		lane = NP_LANE_META;
+	else
+		lane = NP_LANE_DATA;
+	return np_tpool_lane_next(tp, lane);
+}
+
+/* Wake a worker of tp that is idle and can take req.
+ * Return 1 if one was found.
+ */
+static int
+np_tpool_wake(Nptpool *tp, Npreq *req)
+{
+	/* assert: tp->lock held */
+	if (req->lane == NP_LANE_META && tp->nidle_meta > 0) {
+		xpthread_cond_signal(&tp->metacond);
+		return 1;
+	}
+	if (tp->nidle > 0) {
+		xpthread_cond_signal(&tp->reqcond);
+		return 1;
+	}
+	return 0;
+}
+
+/* Queue req on tp and wake a worker for it.
+ * Return 1 if one was found.
+ */
+int
+np_tpool_queue_req(Nptpool *tp, Npreq *req)
+{
+	/* assert: tp->lock held */
+	req->qtime = _time_ms ();
+	np_srv_append_req(tp, req);
+	return np_tpool_wake(tp, req);
+}
+
+/* Elastic fifo tpools:  if no worker is idle and the oldest queued request
+ * has been waiting longer than srv->wthread_growms, add a worker, up to
+ * srv->nwthread_max.  This is checked when a request is queued or dequeued,
+ * and by np_srv_grow_proc (), since if every worker is blocked neither
+ * may happen again.  That only polls while it is armed, by a request
+ * queued with no worker idle.  Workers above srv->nwthread exit after
+ * srv->wthread_idlesecs idle.
+ */
+static void
+np_tpool_grow(Nptpool *tp)
+{
+	Npsrv *srv = tp->srv;
+
+	/* assert: tp->lock held */
+	if (tp->nidle > 0 || tp->nwthread >= np_tpool_maxwthread(tp))
+		return;
+	if (!tp->reqs_first)
+		return;
+	if (_time_ms () - tp->reqs_first->qtime < srv->wthread_growms)
+		return;
+	if (np_wthread_create(tp) < 0) {
+		np_logerr (srv, "%s: could not add worker thread", tp->name);
+		return;
+	}
+	tp->nwthread++;
+}
+
+/* Return 1 if tp has queued requests, no idle worker, and room to grow.
+ */
+static int
+np_tpool_may_grow(Nptpool *tp)
+{
+	/* assert: tp->lock held */
+	return tp->reqs_first && tp->nidle == 0
+			      && tp->nwthread < np_tpool_maxwthread(tp);
+}
+
+/* Sleep until armed, then check the tpools every srv->wthread_growms / 2
+ * until none may need to grow.
+ */
+static void *
+np_srv_grow_proc(void *a)
+{
+	Npsrv *srv = (Npsrv *)a;
+	struct timespec ts;
+	Nptpool *tp;
+	long ms;
+	int armed;
+
+	xpthread_mutex_lock(&srv->lock);
+	while (!srv->growshutdown) {
+		if (!__atomic_load_n (&srv->growarmed, __ATOMIC_SEQ_CST)) {
+			xpthread_cond_wait(&srv->growcond, &srv->lock);
+			continue;
+		}
+		ms = srv->wthread_growms > 1 ? srv->wthread_growms / 2 : 1;
+		clock_gettime (CLOCK_REALTIME, &ts);
+		ts.tv_sec += ms / 1000;
+		ts.tv_nsec += (ms % 1000) * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		(void)pthread_cond_timedwait(&srv->growcond, &srv->lock, &ts);
+
+		/* N.B. Disarm before looking, so a request queued meanwhile
+		 * either is seen here or arms us again.
+		 */
+		__atomic_store_n (&srv->growarmed, 0, __ATOMIC_SEQ_CST);
+		armed = 0;
+		for (tp = srv->tpool; tp != NULL; tp = tp->next) {
+			xpthread_mutex_lock(&tp->lock);
+			np_tpool_grow(tp);
+			if (np_tpool_may_grow(tp))
+				armed = 1;
+			xpthread_mutex_unlock(&tp->lock);
+		}
+		if (armed)
+			__atomic_store_n (&srv->growarmed, 1, __ATOMIC_SEQ_CST);
+	}
+	xpthread_mutex_unlock(&srv->lock);
+	return NULL;
+}
+
+/* Arm np_srv_grow_proc (), starting it the first time, after a request
+ * is queued on a tpool that may grow.  Call without tp->lock, as it takes
+ * srv->lock, but only when the grow thread is not already armed.
+ */
+static void
+np_srv_grow_arm(Npsrv *srv)
+{
+	int err;
+
+	if (__atomic_load_n (&srv->growarmed, __ATOMIC_SEQ_CST))
+		return;
+	xpthread_mutex_lock(&srv->lock);
+	if (!srv->growstarted) {
+		if ((err = pthread_create (&srv->growthread, NULL,
+					   np_srv_grow_proc, srv))) {
+			np_uerror (err);
+			np_logerr (srv, "could not start tpool grow thread");
+			goto done;
+		}
+		srv->growstarted = 1;
+	}
+	if (!srv->growarmed) {
+		__atomic_store_n (&srv->growarmed, 1, __ATOMIC_SEQ_CST);
+		xpthread_cond_signal(&srv->growcond);
+	}
+done:
+	xpthread_mutex_unlock(&srv->lock);
+}
+
+static void
+np_srv_grow_stop(Npsrv *srv)
+{
+	xpthread_mutex_lock(&srv->lock);
+	srv->growshutdown = 1;
+	xpthread_cond_broadcast(&srv->growcond);
+	xpthread_mutex_unlock(&srv->lock);
+	if (srv->growstarted)
+		pthread_join (srv->growthread, NULL);
+}
+
+static void
+np_srv_fifo_add_req(Nptpool *tp, Npreq *req)
+{
+	int grow;
+
+	xpthread_mutex_lock(&tp->lock);
+	np_tpool_queue_req(tp, req);
+	np_tpool_grow(tp);
+	grow = np_tpool_may_grow(tp);
+	xpthread_mutex_unlock(&tp->lock);
+	if (grow)
+		np_srv_grow_arm(tp->srv);
+}
+
+void
+np_srv_remove_req(Nptpool *tp, Npreq *req)
+{
+	Npconnq *cq;
+
+	/* assert: tp->lock held */
+	req->queued = 0;
+	np_req_dequeued(req);
+	if (req->prev)
+		req->prev->next = req->next;
+	if (req->next)
+		req->next->prev = req->prev;
+	if (req == tp->reqs_first)
+		tp->reqs_first = req->next;
+	if (req == tp->reqs_last)
+		tp->reqs_last = req->prev;
+	if ((cq = req->connq)) {
+		if (req->cprev)
+			req->cprev->cnext = req->cnext;
+		if (req->cnext)
+			req->cnext->cprev = req->cprev;
+		if (req == cq->reqs_first)
+			cq->reqs_first = req->cnext;
+		if (req == cq->reqs_last)
+			cq->reqs_last = req->cprev;
+		if (!cq->reqs_first)
+			np_tpool_put_connq(tp, cq);
+		req->connq = NULL;
+		req->cnext = req->cprev = NULL;
+	}
+}
+
+int
+np_tpool_fifo_flush(Nptpool *tp, Npreq *req, Npwthread **wtp)
+{
+	Npwthread *wt;
+	int dead = 0;
+
+	xpthread_mutex_lock(&tp->lock);
+	if (req->queued) {
+		np_srv_remove_req(tp, req);
+		dead = 1;
+	} else if ((wt = req->wthread) && wt->req == req)
+		*wtp = wt;
+	xpthread_mutex_unlock(&tp->lock);
+	return dead;
+}
+
+static void
+np_srv_add_donereq(Nptpool *tp, Npreq *req)
+{
+	/* assert: tp->lock held */
+	if (tp->donereqs)
+		tp->donereqs->prev = req;
+	req->next = tp->donereqs;
+	tp->donereqs = req;
+	req->prev = NULL;
+}
+
+static void
+np_srv_remove_donereq(Nptpool *tp, Npreq *req)
+{
+	/* assert: tp->lock held */
+	if (req->prev)
+		req->prev->next = req->next;
+	else
+		tp->donereqs = req->next;
+	if (req->next)
+		req->next->prev = req->prev;
+}
+
+/* Wait for work.  Return -1 if this worker has been idle for
+ * srv->wthread_idlesecs and was removed to shrink the tpool;  it is
+ * detached so the caller should just drop tp->lock, free wt, and exit.
+ */
+static int
+np_wthread_idle(Npwthread *wt)
+{
+	Nptpool *tp = wt->tpool;
+	Npsrv *srv = tp->srv;
+	Npwthread **wp;
+	struct timespec ts;
+	int err = 0;
+
+	/* assert: tp->lock held */
+	if (wt->metaonly) {
+		tp->nidle_meta++;
+		xpthread_cond_wait(&tp->metacond, &tp->lock);
+		tp->nidle_meta--;
+		return 0;
+	}
+	tp->nidle++;
+	if (tp->nwthread > np_tpool_minwthread(tp)) {
+		clock_gettime (CLOCK_REALTIME, &ts);
+		ts.tv_sec += srv->wthread_idlesecs;
+		err = pthread_cond_timedwait(&tp->reqcond, &tp->lock, &ts);
+	} else
+		xpthread_cond_wait(&tp->reqcond, &tp->lock);
+	tp->nidle--;
+	if (err != ETIMEDOUT || wt->shutdown || tp->reqs_first
+				 || tp->nwthread <= np_tpool_minwthread(tp))
+		return 0;
+	for (wp = &tp->wthreads; *wp != NULL; wp = &(*wp)->next) {
+		if (*wp == wt) {
+			*wp = wt->next;
+			break;
+		}
+	}
+	tp->nwthread--;
+	pthread_detach (wt->thread);
+	return -1;
+}
+
+void
+np_wthread_fifo_proc(Npwthread *wt)
+{
+	Nptpool *tp = wt->tpool;
+	Npreq *req = NULL;
+	Npfcall *rc;
+
+	xpthread_mutex_lock(&tp->lock);
+	while (!wt->shutdown) {
+		req = np_tpool_next_req(tp, wt);
+		if (!req) {
+			if (np_wthread_idle(wt) < 0) {
+				xpthread_mutex_unlock (&tp->lock);
+				np_wthread_free (wt);
+				return;
+			}
+			continue;
+		}
+		np_srv_remove_req(tp, req);
+		np_tpool_grow(tp);
+		np_srv_add_workreq(tp, req);
+		req->wthread = wt;
+		wt->req = req;
+		xpthread_mutex_unlock(&tp->lock);
+
+		rc = np_process_request(req, tp);
+
+		if (!req->deferred) {
+			xpthread_mutex_lock(&tp->lock);
+			np_srv_remove_workreq(tp, req);
+			np_srv_add_donereq(tp, req);
+			xpthread_mutex_unlock(&tp->lock);
+
+			np_req_respond(req, rc);
+
+			xpthread_mutex_lock(&tp->lock);
+			np_srv_remove_donereq(tp, req);
+			xpthread_mutex_unlock(&tp->lock);
+		}
+
+		/* N.B. unref outside of tp->lock since the last fid decref
+		 * may call np_tpool_decref () which takes srv->lock.
+		 */
+		np_req_unref(req);
+
+		xpthread_mutex_lock(&tp->lock);
+	}
+	xpthread_mutex_unlock (&tp->lock);
+}
+
+/* Fifo mode:  call fn on each queued request.  Running ones are on
+ * tp->workreqs.
+ */
+int
+np_tpool_fifo_walk(Nptpool *tp, ReqWalkF fn, void *arg)
+{
+	Npreq *req;
+	int rc = 0;
+
+	xpthread_mutex_lock(&tp->lock);
+	for (req = tp->reqs_first; req != NULL; req = req->next) {
+		if ((rc = fn (req, NULL, arg)) < 0)
+			break;
+	}
+	xpthread_mutex_unlock(&tp->lock);
+	return rc < 0 ? -1 : 0;
+}
+
+int
+np_tpool_fifo_init(Nptpool *tp)
+{
+	Npsrv *srv = tp->srv;
+	int n = np_tpool_minwthread(tp);
+
+	tp->nwthread_meta = srv->nwthread_meta;
+	if (tp->nwthread_meta > n - 1)
+		tp->nwthread_meta = n - 1;
+	return 0;
+}
+
+void
+np_tpool_fifo_fini(Nptpool *tp)
+{
+	Npconnq *cq;
+	int i;
+
+	for (i = 0; i < NP_NLANES; i++) {
+		while ((cq = tp->connqs[i]))
+			np_tpool_put_connq(tp, cq);
+	}
+	while ((cq = tp->connq_free)) {
+		tp->connq_free = cq->next;
+		free (cq);
+	}
+}
+
+const Nprunq np_runq_fifo = {
+	.srv_fini	= np_srv_grow_stop,
+	.init		= np_tpool_fifo_init,
+	.fini		= np_tpool_fifo_fini,
+	.add_req	= np_srv_fifo_add_req,
+	.wthread_proc	= np_wthread_fifo_proc,
+	.flush		= np_tpool_fifo_flush,
+	.walk		= np_tpool_fifo_walk,
+	.elastic	= 1,
+	.workreqs	= 1,
+};
@@ -0,0 +1,294 @@
+/*****************************************************************************
+ *  Copyright (C) 2011 Lawrence Livermore National Security, LLC.
+ *  Written by Jim Garlick <garlick@llnl.gov> LLNL-CODE-423279
+ *  All Rights Reserved.
+ *
+ *  This file is part of the Distributed I/O Daemon (diod).
+ *  For details, see <http://code.google.com/p/diod/>.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/* runq_ring.c - tpool run queue on a lock-free ring (SRV_FLAGS_TPOOL_RING) */
+
+/* Producers put requests on tp->ring and workers poll it, so in the
+ * common case neither takes tp->lock.  If the ring is full, requests
+ * spill onto the locked tp->reqs_first list, and keep going there until
+ * it drains so they are still dispatched in roughly FIFO order.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <errno.h>
+#include <assert.h>
+#include <sched.h>
+#include <time.h>
+#include "9p.h"
+#include "npfs.h"
+#include "xpthread.h"
+#include "npfsimpl.h"
+
+/* Run queue size, and bounds on how long (ns) an idle worker polls
+ * the ring before parking.
+ */
+#define TPOOL_RING_SIZE		1024
+#define WTHREAD_SPIN_MIN	2000
+#define WTHREAD_SPIN_MAX	128000
+
+static u64
+_time_ns (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+np_tpool_ring_init(Nptpool *tp)
+{
+	pthread_cond_init(&tp->readcond, NULL);
+	if (!(tp->ring = np_ring_create (TPOOL_RING_SIZE)))
+		return -1;
+	return 0;
+}
+
+static void
+np_tpool_ring_fini(Nptpool *tp)
+{
+	if (tp->ring)
+		np_ring_destroy (tp->ring);
+	tp->ring = NULL;
+	pthread_cond_destroy(&tp->readcond);
+}
+
+static void
+np_tpool_append_ovfl(Nptpool *tp, Npreq *req)
+{
+	/* assert: tp->lock held */
+	req->next = NULL;
+	req->prev = tp->reqs_last;
+	if (tp->reqs_last)
+		tp->reqs_last->next = req;
+	tp->reqs_last = req;
+	if (!tp->reqs_first)
+		tp->reqs_first = req;
+	__atomic_add_fetch (&tp->novfl, 1, __ATOMIC_SEQ_CST);
+}
+
+static void
+np_srv_ring_add_req(Nptpool *tp, Npreq *req)
+{
+	if (__atomic_load_n (&tp->novfl, __ATOMIC_SEQ_CST) > 0
+				|| np_ring_put (tp->ring, req) < 0) {
+		xpthread_mutex_lock(&tp->lock);
+		np_tpool_append_ovfl(tp, req);
+		xpthread_cond_signal(&tp->reqcond);
+		xpthread_mutex_unlock(&tp->lock);
+		return;
+	}
+	if (__atomic_load_n (&tp->nsleepers, __ATOMIC_SEQ_CST) > 0) {
+		xpthread_mutex_lock(&tp->lock);
+		xpthread_cond_signal(&tp->reqcond);
+		xpthread_mutex_unlock(&tp->lock);
+	}
+}
+
+static Npreq *
+np_wthread_get_ovfl(Npwthread *wt, Nptpool *tp)
+{
+	Npreq *req = tp->reqs_first;
+
+	/* assert: tp->lock held */
+	if (req) {
+		tp->reqs_first = req->next;
+		if (tp->reqs_first)
+			tp->reqs_first->prev = NULL;
+		else
+			tp->reqs_last = NULL;
+		req->next = req->prev = NULL;
+		__atomic_sub_fetch (&tp->novfl, 1, __ATOMIC_SEQ_CST);
+		__atomic_store_n (&wt->req, req, __ATOMIC_SEQ_CST);
+	}
+	return req;
+}
+
+/* Dequeue the next request and publish it in wt->req.
+ */
+static Npreq *
+np_wthread_get_req(Npwthread *wt, Nptpool *tp)
+{
+	Npreq *req;
+
+	if ((req = np_ring_get (tp->ring, (void **)&wt->req)))
+		return req;
+	if (__atomic_load_n (&tp->novfl, __ATOMIC_SEQ_CST) > 0) {
+		xpthread_mutex_lock(&tp->lock);
+		req = np_wthread_get_ovfl(wt, tp);
+		xpthread_mutex_unlock(&tp->lock);
+	}
+	return req;
+}
+
+/* Wait for walkers that may have seen wt->req (see np_tpool_ring_walk ()).
+ */
+static void
+np_wthread_wait_readers(Nptpool *tp)
+{
+	if (__atomic_load_n (&tp->readers, __ATOMIC_SEQ_CST) == 0)
+		return;
+	xpthread_mutex_lock(&tp->lock);
+	while (__atomic_load_n (&tp->readers, __ATOMIC_SEQ_CST) > 0)
+		xpthread_cond_wait(&tp->readcond, &tp->lock);
+	xpthread_mutex_unlock(&tp->lock);
+}
+
+/* Poll the ring for a while before parking on reqcond, adapting the
+ * time spent polling to how often it pays off.
+ * A parking worker bumps tp->nsleepers before its final check of the ring,
+ * and producers check tp->nsleepers after putting, so wakeups aren't lost.
+ */
+static void
+np_wthread_ring_proc(Npwthread *wt)
+{
+	Nptpool *tp = wt->tpool;
+	u64 spin = WTHREAD_SPIN_MIN, deadline;
+	Npreq *req = NULL;
+	Npfcall *rc;
+
+	while (!__atomic_load_n (&wt->shutdown, __ATOMIC_SEQ_CST)) {
+		deadline = _time_ns () + spin;
+		do {
+			if ((req = np_wthread_get_req(wt, tp)))
+				break;
+			sched_yield ();
+		} while (_time_ns () < deadline);
+		if (req) {
+			if (spin < WTHREAD_SPIN_MAX)
+				spin <<= 1;
+		} else {
+			if (spin > WTHREAD_SPIN_MIN)
+				spin >>= 1;
+			xpthread_mutex_lock(&tp->lock);
+			__atomic_add_fetch (&tp->nsleepers, 1, __ATOMIC_SEQ_CST);
+			req = np_ring_get (tp->ring, (void **)&wt->req);
+			if (!req)
+				req = np_wthread_get_ovfl(wt, tp);
+			if (!req && !wt->shutdown)
+				xpthread_cond_wait(&tp->reqcond, &tp->lock);
+			__atomic_sub_fetch (&tp->nsleepers, 1, __ATOMIC_SEQ_CST);
+			xpthread_mutex_unlock(&tp->lock);
+			if (!req)
+				continue;
+		}
+		np_req_dequeued(req);
+		req->wthread = wt;
+		rc = NULL;
+		if (!__atomic_load_n (&req->flushed, __ATOMIC_SEQ_CST))
+			rc = np_process_request(req, tp);
+
+		/* N.B. Walkers of wt->req hold tp->readers while they look
+		 * at it, so wait for them before the req can be freed.
+		 */
+		__atomic_store_n (&wt->req, NULL, __ATOMIC_SEQ_CST);
+		np_wthread_wait_readers(tp);
+
+		if (!req->deferred)
+			np_req_respond(req, rc);
+		np_req_unref(req);
+		req = NULL;
+	}
+}
+
+/* Queued requests stay put and are skipped by the worker that dequeues
+ * them, as they can't be taken out of the middle of the ring.
+ */
+static int
+np_tpool_ring_flush(Nptpool *tp, Npreq *req, Npwthread **wtp)
+{
+	Npwthread *wt = req->wthread;
+
+	if (wt && __atomic_load_n (&wt->req, __ATOMIC_SEQ_CST) == req)
+		*wtp = wt;
+	return 0;
+}
+
+typedef struct {
+	ReqWalkF	fn;
+	void		*arg;
+} WalkArg;
+
+static int
+_walk_ring_one (void *item, void *arg)
+{
+	WalkArg *wa = arg;
+
+	return wa->fn ((Npreq *)item, NULL, wa->arg);
+}
+
+/* This is done without stopping the workers, so a request that moves
+ * while we look may be seen twice, but workers wait on tp->readcond for
+ * tp->readers to drain before releasing a request, so none is freed out
+ * from under fn.
+ */
+static int
+np_tpool_ring_walk (Nptpool *tp, ReqWalkF fn, void *arg)
+{
+	WalkArg wa = { .fn = fn, .arg = arg };
+	Npwthread *wt;
+	Npreq *req;
+	int rc = -1;
+
+	__atomic_add_fetch (&tp->readers, 1, __ATOMIC_SEQ_CST);
+	if (np_ring_walk (tp->ring, _walk_ring_one, &wa) < 0)
+		goto done;
+	xpthread_mutex_lock(&tp->lock);
+	for (req = tp->reqs_first; req != NULL; req = req->next) {
+		if (fn (req, NULL, arg) < 0) {
+			xpthread_mutex_unlock(&tp->lock);
+			goto done;
+		}
+	}
+	xpthread_mutex_unlock(&tp->lock);
+	for (wt = tp->wthreads; wt != NULL; wt = wt->next) {
+		req = __atomic_load_n (&wt->req, __ATOMIC_SEQ_CST);
+		if (req && fn (req, wt, arg) < 0)
+			goto done;
+	}
+	rc = 0;
+done:
+	if (__atomic_sub_fetch (&tp->readers, 1, __ATOMIC_SEQ_CST) == 0) {
+		xpthread_mutex_lock(&tp->lock);
+		xpthread_cond_broadcast(&tp->readcond);
+		xpthread_mutex_unlock(&tp->lock);
+	}
+	return rc;
+}
+
+const Nprunq np_runq_ring = {
+	.init		= np_tpool_ring_init,
+	.fini		= np_tpool_ring_fini,
+	.add_req	= np_srv_ring_add_req,
+	.wthread_proc	= np_wthread_ring_proc,
+	.flush		= np_tpool_ring_flush,
+	.walk		= np_tpool_ring_walk,
+};
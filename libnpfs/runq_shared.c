@@ -0,0 +1,281 @@
+/*****************************************************************************
+ *  Copyright (C) 2011 Lawrence Livermore National Security, LLC.
+ *  Written by Jim Garlick <garlick@llnl.gov> LLNL-CODE-423279
+ *  All Rights Reserved.
+ *
+ *  This file is part of the Distributed I/O Daemon (diod).
+ *  For details, see <http://code.google.com/p/diod/>.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/* runq_shared.c - tpool run queues served by shared workers
+ * (SRV_FLAGS_TPOOL_SHARED)
+ */
+
+/* Each tpool queues requests as in fifo mode, but instead of a full set
+ * of its own workers it has a small reserve, and a pool of srv->nwthread
+ * workers shared by all tpools takes requests from whichever have them.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include "9p.h"
+#include "npfs.h"
+#include "xpthread.h"
+#include "npfsimpl.h"
+
+/* Shared mode:  tpools with queued requests are kept on the srv->ready
+ * list, which shared workers service in weighted round-robin order:
+ * a worker takes up to tp->weight requests from a tpool before moving on.
+ * Each tpool also has tp->nwthread_reserve dedicated workers, so an
+ * aname whose requests all block can't starve the others.
+ */
+static void
+np_srv_link_ready(Npsrv *srv, Nptpool *tp)
+{
+	/* assert: srv->rqlock held */
+	if (srv->ready) {
+		tp->rnext = srv->ready;
+		tp->rprev = srv->ready->rprev;
+		tp->rprev->rnext = tp;
+		tp->rnext->rprev = tp;
+	} else {
+		tp->rnext = tp->rprev = tp;
+		srv->ready = tp;
+		srv->rcredit = tp->weight;
+	}
+	tp->onready = 1;
+}
+
+static void
+np_srv_unlink_ready(Npsrv *srv, Nptpool *tp)
+{
+	/* assert: srv->rqlock held */
+	if (tp->rnext == tp)
+		srv->ready = NULL;
+	else {
+		tp->rprev->rnext = tp->rnext;
+		tp->rnext->rprev = tp->rprev;
+		if (srv->ready == tp) {
+			srv->ready = tp->rnext;
+			srv->rcredit = srv->ready->weight;
+		}
+	}
+	tp->rnext = tp->rprev = NULL;
+	tp->onready = 0;
+}
+
+static Nptpool *
+np_srv_next_ready(Npsrv *srv)
+{
+	Nptpool *tp;
+
+	/* assert: srv->rqlock held */
+	if (!(tp = srv->ready))
+		return NULL;
+	if (srv->rcredit <= 0) {
+		tp = srv->ready = tp->rnext;
+		srv->rcredit = tp->weight;
+	}
+	srv->rcredit--;
+	return tp;
+}
+
+static void
+np_srv_shared_add_req(Nptpool *tp, Npreq *req)
+{
+	Npsrv *srv = tp->srv;
+	int idle;
+
+	xpthread_mutex_lock(&tp->lock);
+	idle = np_tpool_queue_req(tp, req);
+	xpthread_mutex_unlock(&tp->lock);
+
+	xpthread_mutex_lock(&srv->rqlock);
+	if (!tp->onready)
+		np_srv_link_ready(srv, tp);
+	if (!idle)
+		xpthread_cond_signal(&srv->rqcond);
+	xpthread_mutex_unlock(&srv->rqlock);
+}
+
+static void *
+np_srv_wthread_proc(void *a)
+{
+	Npwthread *wt = (Npwthread *)a;
+	Npsrv *srv = wt->srv;
+	Nptpool *tp;
+	Npreq *req;
+	Npfcall *rc;
+
+	xpthread_mutex_lock(&srv->rqlock);
+	while (!wt->shutdown) {
+		if (!(tp = np_srv_next_ready(srv))) {
+			srv->nidle++;
+			xpthread_cond_wait(&srv->rqcond, &srv->rqlock);
+			srv->nidle--;
+			continue;
+		}
+		xpthread_mutex_lock(&tp->lock);
+		if ((req = np_tpool_next_req(tp, wt))) {
+			np_srv_remove_req(tp, req);
+			np_srv_add_workreq(tp, req);
+			req->wthread = wt;
+			wt->req = req;
+		}
+		if (!tp->reqs_first)
+			np_srv_unlink_ready(srv, tp);
+		xpthread_mutex_unlock(&tp->lock);
+		if (!req)
+			continue;
+		xpthread_mutex_unlock(&srv->rqlock);
+
+		rc = np_process_request(req, tp);
+
+		/* N.B. Unlike a tpool's own workers, we don't hold tp
+		 * open, so don't touch it after the reply releases the fid.
+		 */
+		if (!req->deferred) {
+			xpthread_mutex_lock(&tp->lock);
+			np_srv_remove_workreq(tp, req);
+			xpthread_mutex_unlock(&tp->lock);
+			np_req_respond(req, rc);
+		}
+		np_req_unref(req);
+
+		xpthread_mutex_lock(&srv->rqlock);
+	}
+	xpthread_mutex_unlock(&srv->rqlock);
+
+	return NULL;
+}
+
+static int
+np_srv_wthread_create(Npsrv *srv)
+{
+	int err;
+	Npwthread *wt;
+
+	if (!(wt = malloc(sizeof(*wt)))) {
+		np_uerror (ENOMEM);
+		return -1;
+	}
+	memset (wt, 0, sizeof (*wt));
+	wt->srv = srv;
+	wt->fsuid = geteuid ();
+	wt->fsgid = getegid ();
+	wt->privcap = (wt->fsuid == 0 ? 1 : 0);
+	pthread_mutex_init(&wt->lock, NULL);
+	pthread_cond_init(&wt->cond, NULL);
+	if ((err = pthread_create(&wt->thread, NULL, np_srv_wthread_proc, wt))) {
+		np_uerror (err);
+		np_wthread_free (wt);
+		return -1;
+	}
+	wt->next = srv->wthreads;
+	srv->wthreads = wt;
+	return 0;
+}
+
+static void
+np_srv_wthreads_destroy(Npsrv *srv)
+{
+	Npwthread *wt, *next;
+	int err;
+
+	xpthread_mutex_lock(&srv->rqlock);
+	for (wt = srv->wthreads; wt != NULL; wt = wt->next)
+		wt->shutdown = 1;
+	xpthread_cond_broadcast(&srv->rqcond);
+	xpthread_mutex_unlock(&srv->rqlock);
+	for (wt = srv->wthreads; wt != NULL; wt = next) {
+		next = wt->next;
+		if ((err = pthread_join (wt->thread, NULL))) {
+			np_uerror (err);
+			np_logerr(srv, "join shared worker thread");
+		}
+		np_wthread_free (wt);
+	}
+	srv->wthreads = NULL;
+}
+
+static int
+np_srv_shared_init(Npsrv *srv)
+{
+	int i;
+
+	for (i = 0; i < srv->nwthread; i++) {
+		if (np_srv_wthread_create (srv) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int
+np_tpool_shared_init(Nptpool *tp)
+{
+	Npsrv *srv = tp->srv;
+
+	tp->weight = srv->tpool_weight ? srv->tpool_weight (tp->name) : 1;
+	if (tp->weight < 1)
+		tp->weight = 1;
+	tp->nwthread_reserve = srv->nwthread_reserve;
+	return np_tpool_fifo_init(tp);
+}
+
+static void
+np_tpool_shared_fini(Nptpool *tp)
+{
+	Npsrv *srv = tp->srv;
+
+	xpthread_mutex_lock(&srv->rqlock);
+	if (tp->onready)
+		np_srv_unlink_ready(srv, tp);
+	xpthread_mutex_unlock(&srv->rqlock);
+	np_tpool_fifo_fini(tp);
+}
+
+/* Each tpool's own workers are its reserve (see np_srv_link_ready ()),
+ * fixed when the tpool is created.
+ */
+static int
+np_tpool_shared_minwthread(Nptpool *tp)
+{
+	return tp->nwthread_reserve;
+}
+
+const Nprunq np_runq_shared = {
+	.srv_init	= np_srv_shared_init,
+	.srv_fini	= np_srv_wthreads_destroy,
+	.init		= np_tpool_shared_init,
+	.fini		= np_tpool_shared_fini,
+	.minwthread	= np_tpool_shared_minwthread,
+	.add_req	= np_srv_shared_add_req,
+	.wthread_proc	= np_wthread_fifo_proc,
+	.flush		= np_tpool_fifo_flush,
+	.walk		= np_tpool_fifo_walk,
+	.workreqs	= 1,
+};
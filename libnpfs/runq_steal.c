@@ -0,0 +1,285 @@
+/*****************************************************************************
+ *  Copyright (C) 2011 Lawrence Livermore National Security, LLC.
+ *  Written by Jim Garlick <garlick@llnl.gov> LLNL-CODE-423279
+ *  All Rights Reserved.
+ *
+ *  This file is part of the Distributed I/O Daemon (diod).
+ *  For details, see <http://code.google.com/p/diod/>.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/* runq_steal.c - per-worker tpool run queues with stealing */
+
+/* Requests are queued to a worker picked by hashing the fid, so work on
+ * a fid tends to stay on one thread (and its cache).  If that worker is
+ * busy and another is idle, the idle one is woken to steal it.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <errno.h>
+#include <assert.h>
+#include "9p.h"
+#include "npfs.h"
+#include "xpthread.h"
+#include "npfsimpl.h"
+
+static int
+np_tpool_steal_init(Nptpool *tp)
+{
+	if (!(tp->wtab = calloc (tp->srv->nwthread, sizeof (Npwthread *)))) {
+		np_uerror (ENOMEM);
+		return -1;
+	}
+	return 0;
+}
+
+static void
+np_tpool_steal_fini(Nptpool *tp)
+{
+	if (tp->wtab)
+		free (tp->wtab);
+	tp->wtab = NULL;
+}
+
+static Npwthread *
+np_tpool_pick_wthread(Nptpool *tp, Npreq *req)
+{
+	uintptr_t h = req->fid ? (uintptr_t)req->fid : (uintptr_t)req->conn;
+
+	return tp->wtab[((h >> 4) * 2654435761U) % tp->nwthread];
+}
+
+static void
+np_wthread_append_req(Npwthread *wt, Npreq *req)
+{
+	/* assert: wt->lock held */
+	req->next = NULL;
+	req->prev = wt->reqs_last;
+	if (wt->reqs_last)
+		wt->reqs_last->next = req;
+	wt->reqs_last = req;
+	if (!wt->reqs_first)
+		wt->reqs_first = req;
+	__atomic_store_n (&wt->nreqs, wt->nreqs + 1, __ATOMIC_SEQ_CST);
+}
+
+static Npreq *
+np_wthread_pop_req(Npwthread *wt)
+{
+	Npreq *req = wt->reqs_first;
+
+	/* assert: wt->lock held */
+	if (req) {
+		wt->reqs_first = req->next;
+		if (wt->reqs_first)
+			wt->reqs_first->prev = NULL;
+		else
+			wt->reqs_last = NULL;
+		req->next = NULL;
+		__atomic_store_n (&wt->nreqs, wt->nreqs - 1, __ATOMIC_SEQ_CST);
+	}
+	return req;
+}
+
+static void
+np_tpool_wake_idle(Nptpool *tp)
+{
+	Npwthread *wt;
+	int i, woke = 0;
+
+	for (i = 0; i < tp->nwthread && !woke; i++) {
+		wt = tp->wtab[i];
+		xpthread_mutex_lock(&wt->lock);
+		if (wt->idle && !wt->wakeup) {
+			wt->wakeup = 1;
+			xpthread_cond_signal(&wt->cond);
+			woke = 1;
+		}
+		xpthread_mutex_unlock(&wt->lock);
+	}
+}
+
+static void
+np_srv_steal_add_req(Nptpool *tp, Npreq *req)
+{
+	Npwthread *wt = np_tpool_pick_wthread(tp, req);
+	int busy;
+
+	xpthread_mutex_lock(&wt->lock);
+	np_wthread_append_req(wt, req);
+	busy = !wt->idle;
+	if (!busy)
+		xpthread_cond_signal(&wt->cond);
+	xpthread_mutex_unlock(&wt->lock);
+	if (busy && __atomic_load_n (&tp->nidle, __ATOMIC_SEQ_CST) > 0)
+		np_tpool_wake_idle(tp);
+}
+
+
+/* Take the oldest request from a sibling's queue.
+ * Both queue locks are held (lowest id first) while the request moves
+ * to wt->req so np_tpool_steal_walk () can't miss it.
+ */
+static Npreq *
+np_wthread_steal(Npwthread *wt)
+{
+	Nptpool *tp = wt->tpool;
+	int i, n = tp->srv->nwthread;
+	Npwthread *victim, *a, *b;
+	Npreq *req = NULL;
+
+	for (i = 1; i < n && !req; i++) {
+		victim = __atomic_load_n (&tp->wtab[(wt->id + i) % n],
+					  __ATOMIC_ACQUIRE);
+		if (!victim || __atomic_load_n (&victim->nreqs,
+						__ATOMIC_SEQ_CST) == 0)
+			continue;
+		a = wt->id < victim->id ? wt : victim;
+		b = wt->id < victim->id ? victim : wt;
+		xpthread_mutex_lock(&a->lock);
+		xpthread_mutex_lock(&b->lock);
+		if ((req = np_wthread_pop_req(victim)))
+			wt->req = req;
+		xpthread_mutex_unlock(&b->lock);
+		xpthread_mutex_unlock(&a->lock);
+	}
+	return req;
+}
+
+/* Sleep until something is queued to us, or a producer
+ * wakes us to steal.  tp->nidle is raised before the last look at our
+ * siblings' queues, and producers check it after queueing, so a request
+ * queued to a busy sibling can't be stranded while we sleep.
+ */
+static Npreq *
+np_wthread_park(Npwthread *wt)
+{
+	Nptpool *tp = wt->tpool;
+	Npreq *req;
+
+	xpthread_mutex_lock(&wt->lock);
+	wt->idle = 1;
+	xpthread_mutex_unlock(&wt->lock);
+	__atomic_add_fetch (&tp->nidle, 1, __ATOMIC_SEQ_CST);
+
+	req = np_wthread_steal(wt);
+
+	xpthread_mutex_lock(&wt->lock);
+	while (!req && !wt->reqs_first && !wt->wakeup && !wt->shutdown)
+		xpthread_cond_wait(&wt->cond, &wt->lock);
+	wt->idle = 0;
+	wt->wakeup = 0;
+	xpthread_mutex_unlock(&wt->lock);
+	__atomic_sub_fetch (&tp->nidle, 1, __ATOMIC_SEQ_CST);
+
+	return req;
+}
+
+static void
+np_wthread_steal_proc(Npwthread *wt)
+{
+	Nptpool *tp = wt->tpool;
+	Npreq *req;
+	Npfcall *rc;
+
+	for (;;) {
+		xpthread_mutex_lock(&wt->lock);
+		if (wt->shutdown) {
+			xpthread_mutex_unlock(&wt->lock);
+			break;
+		}
+		if ((req = np_wthread_pop_req(wt)))
+			wt->req = req;
+		xpthread_mutex_unlock(&wt->lock);
+		if (!req && !(req = np_wthread_steal(wt))
+			 && !(req = np_wthread_park(wt)))
+			continue;
+
+		np_req_dequeued(req);
+		req->wthread = wt;
+		rc = NULL;
+		if (!__atomic_load_n (&req->flushed, __ATOMIC_SEQ_CST))
+			rc = np_process_request(req, tp);
+
+		xpthread_mutex_lock(&wt->lock);
+		wt->req = NULL;
+		xpthread_mutex_unlock(&wt->lock);
+
+		if (!req->deferred)
+			np_req_respond(req, rc);
+		np_req_unref(req);
+	}
+}
+
+/* Queued requests are skipped by the worker that dequeues them.
+ */
+static int
+np_tpool_steal_flush(Nptpool *tp, Npreq *req, Npwthread **wtp)
+{
+	Npwthread *wt;
+
+	if ((wt = req->wthread)) {
+		xpthread_mutex_lock(&wt->lock);
+		if (wt->req == req)
+			*wtp = wt;
+		xpthread_mutex_unlock(&wt->lock);
+	}
+	return 0;
+}
+
+/* Visit the workers' queues and running requests one worker at a time,
+ * under its lock.
+ */
+static int
+np_tpool_steal_walk(Nptpool *tp, ReqWalkF fn, void *arg)
+{
+	Npwthread *wt;
+	Npreq *req;
+	int i;
+
+	for (i = 0; i < tp->nwthread; i++) {
+		wt = tp->wtab[i];
+		xpthread_mutex_lock(&wt->lock);
+		for (req = wt->reqs_first; req != NULL; req = req->next) {
+			if (fn (req, NULL, arg) < 0)
+				goto error_unlock;
+		}
+		if (wt->req && fn (wt->req, wt, arg) < 0)
+			goto error_unlock;
+		xpthread_mutex_unlock(&wt->lock);
+	}
+	return 0;
+error_unlock:
+	xpthread_mutex_unlock(&wt->lock);
+	return -1;
+}
+
+const Nprunq np_runq_steal = {
+	.init		= np_tpool_steal_init,
+	.fini		= np_tpool_steal_fini,
+	.add_req	= np_srv_steal_add_req,
+	.wthread_proc	= np_wthread_steal_proc,
+	.flush		= np_tpool_steal_flush,
+	.walk		= np_tpool_steal_walk,
+};
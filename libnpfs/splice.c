@@ -0,0 +1,348 @@
+/*****************************************************************************
+ *  Copyright (C) 2011 Lawrence Livermore National Security, LLC.
+ *  Written by Jim Garlick <garlick@llnl.gov> LLNL-CODE-423279
+ *  All Rights Reserved.
+ *
+ *  This file is part of the Distributed I/O Daemon (diod).
+ *  For details, see <http://code.google.com/p/diod/>.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License (as published by the
+ *  Free Software Foundation) version 2, dated June 1991.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA or see
+ *  <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+
+/* splice.c - zero-copy Rread and Twrite */
+
+/* With SRV_FLAGS_ZEROCOPY, file data can bypass user space in both
+ * directions, held in a pipe while it passes through diod.
+ *
+ * Rread:  an op callback may build an Rread whose payload is spliced from
+ * the file into a pipe, instead of being read into the Npfcall.  A
+ * transport that can splice (Nptrans->splice) then writes the header and
+ * splices the pipe to its fd.  Each thread has one pipe for this.  It
+ * must be emptied, by sending the Rread or draining it, before the thread
+ * fills it again:  np_req_respond () and np_free_fcall () see to that,
+ * so the Rread must be created and replied to by the same thread.
+ *
+ * Twrite:  the transport may splice the payload of a large Twrite from
+ * its fd into a pipe from a shared pool, leaving tc->u.twrite.data
+ * unfilled.  At most SPLICE_PIPES_MAX such pipes are in use at once;
+ * beyond that, np_pipe_get () fails and the transport reads in place.
+ * srv->write takes the pipe with np_splice_write (), which splices it on
+ * into the file;  np_write () pulls it into the Npfcall for the other
+ * consumers.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <errno.h>
+#include <assert.h>
+#include "9p.h"
+#include "npfs.h"
+#include "xpthread.h"
+#include "npfsimpl.h"
+
+/* Idle Twrite pipes kept for reuse, and the limit on Twrite pipes in use,
+ * each of which holds an fd pair and up to msize bytes of kernel memory.
+ */
+#define SPLICE_POOL_MAX		64
+#define SPLICE_PIPES_MAX	64
+
+static pthread_key_t pipe_key;
+static pthread_once_t pipe_once = PTHREAD_ONCE_INIT;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static Nppipe *pool = NULL;
+static int npool = 0;
+static int ninuse = 0;
+
+static void
+_pipe_destroy (void *arg)
+{
+	Nppipe *p = arg;
+
+	close (p->rfd);
+	close (p->wfd);
+	free (p);
+}
+
+static Nppipe *
+_pipe_create (int pooled)
+{
+	Nppipe *p;
+	int fds[2];
+
+	if (!(p = malloc (sizeof (*p))))
+		return NULL;
+	if (pipe2 (fds, O_CLOEXEC) < 0) {
+		free (p);
+		return NULL;
+	}
+	p->rfd = fds[0];
+	p->wfd = fds[1];
+	p->size = fcntl (p->rfd, F_GETPIPE_SZ);
+	p->pooled = pooled;
+	p->next = NULL;
+	/* The transport must not block writing to a full Twrite pipe.
+	 */
+	if (pooled && fcntl (p->wfd, F_SETFL, O_NONBLOCK) < 0) {
+		_pipe_destroy (p);
+		return NULL;
+	}
+	return p;
+}
+
+/* Make room for count bytes if possible.  An unaligned payload may take
+ * one more page than its size.
+ */
+static void
+_pipe_grow (Nppipe *p, u32 count)
+{
+	int want = count + 2 * getpagesize ();
+
+	if (p->size < want) {
+		if (fcntl (p->wfd, F_SETPIPE_SZ, want) >= 0)
+			p->size = fcntl (p->rfd, F_GETPIPE_SZ);
+	}
+}
+
+static void
+np_init_pipe_key (void)
+{
+	pthread_key_create (&pipe_key, _pipe_destroy);
+}
+
+/* Get this thread's Rread pipe.
+ */
+static Nppipe *
+_thread_pipe (u32 count)
+{
+	Nppipe *p;
+
+	pthread_once (&pipe_once, np_init_pipe_key);
+	if (!(p = pthread_getspecific (pipe_key))) {
+		if (!(p = _pipe_create (0)))
+			return NULL;
+		if (pthread_setspecific (pipe_key, p) != 0) {
+			_pipe_destroy (p);
+			return NULL;
+		}
+	}
+	_pipe_grow (p, count);
+	return p;
+}
+
+/* Get an empty pipe from the pool for count bytes of Twrite data.
+ * Returns NULL if too many are in use.
+ */
+Nppipe *
+np_pipe_get (u32 count)
+{
+	Nppipe *p = NULL;
+
+	xpthread_mutex_lock (&pool_lock);
+	if (ninuse >= SPLICE_PIPES_MAX) {
+		xpthread_mutex_unlock (&pool_lock);
+		return NULL;
+	}
+	ninuse++;
+	if ((p = pool)) {
+		pool = p->next;
+		npool--;
+	}
+	xpthread_mutex_unlock (&pool_lock);
+	if (!p && !(p = _pipe_create (1))) {
+		xpthread_mutex_lock (&pool_lock);
+		ninuse--;
+		xpthread_mutex_unlock (&pool_lock);
+		return NULL;
+	}
+	_pipe_grow (p, count);
+	return p;
+}
+
+/* Return a pipe from np_pipe_get (), to the pool if reuse is set.
+ */
+static void
+_pipe_put (Nppipe *p, int reuse)
+{
+	xpthread_mutex_lock (&pool_lock);
+	ninuse--;
+	if (reuse && npool < SPLICE_POOL_MAX) {
+		p->next = pool;
+		pool = p;
+		npool++;
+		p = NULL;
+	}
+	xpthread_mutex_unlock (&pool_lock);
+	if (p)
+		_pipe_destroy (p);
+}
+
+/* Discard count bytes from a pipe.  Returns the number left behind.
+ */
+static u32
+_pipe_drain (Nppipe *p, u32 count)
+{
+	char buf[4096];
+	ssize_t n;
+
+	while (count > 0) {
+		n = read (p->rfd, buf, count < sizeof (buf) ? count
+							     : sizeof (buf));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		count -= n;
+	}
+	return count;
+}
+
+/* Detach fc from its pipe, discarding any payload left in it.
+ */
+void
+np_splice_release (Npfcall *fc)
+{
+	Nppipe *p = fc->zcpipe;
+	int clean = 1;
+
+	if (fc->zclen > 0 && _pipe_drain (p, fc->zclen) > 0)
+		clean = 0;		/* don't pool a pipe with junk in it */
+	if (p->pooled)
+		_pipe_put (p, clean);
+	fc->zcpipe = NULL;
+	fc->zclen = 0;
+}
+
+/* Read the payload still in fc's pipe into buf, normally where it would
+ * have been in the message without splice, and detach fc from the pipe.
+ */
+int
+np_splice_pull (Npfcall *fc, u8 *buf)
+{
+	ssize_t n;
+
+	while (fc->zclen > 0) {
+		n = read (fc->zcpipe->rfd, buf, fc->zclen);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			np_uerror (n < 0 ? errno : EIO);
+			np_splice_release (fc);
+			return -1;
+		}
+		buf += n;
+		fc->zclen -= n;
+	}
+	np_splice_release (fc);
+	return 0;
+}
+
+/* Create an Rread for up to count bytes of fd at offset, with the payload
+ * spliced into this thread's pipe.  Returns NULL with np_rerror () == 0 if
+ * zero-copy isn't possible here, so the caller can fall back to reading
+ * into an np_alloc_rread () Npfcall.  The count may be short if the pipe
+ * is too small.
+ */
+Npfcall *
+np_create_rread_splice (Npreq *req, int fd, u64 offset, u32 count)
+{
+	Npconn *conn = req->conn;
+	Nppipe *p;
+	Npfcall *fc;
+	loff_t off = offset;
+	ssize_t n;
+	u32 len = 0;
+
+	if (!(conn->srv->flags & SRV_FLAGS_ZEROCOPY) || !conn->trans->splice)
+		return NULL;
+	if (!(p = _thread_pipe (count)))
+		return NULL;
+	while (len < count) {
+		n = splice (fd, &off, p->wfd, NULL, count - len,
+			   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (n == 0)
+			break;
+		if (n < 0) {
+			if (errno == EAGAIN && len > 0)
+				break;		/* pipe is full */
+			if (len == 0 && (errno == EINVAL || errno == ENOSYS))
+				return NULL;	/* fd doesn't splice */
+			np_uerror (errno);
+			goto error;
+		}
+		len += n;
+	}
+	if (!(fc = np_create_rread_hdr (len, p))) {
+		np_uerror (ENOMEM);
+		goto error;
+	}
+	return fc;
+error:
+	_pipe_drain (p, len);
+	return NULL;
+}
+
+/* Write the data of the Twrite being handled to fd at offset, splicing it
+ * from its pipe if the transport left it in one.  Returns the number of
+ * bytes written, or -1 on error.  Returns -1 with np_rerror () == 0 if the
+ * data was not spliced, and is now in tc->u.twrite.data as usual.
+ */
+int
+np_splice_write (Npreq *req, int fd, u64 offset)
+{
+	Npfcall *tc = req->tcall;
+	loff_t off = offset;
+	ssize_t n = 0;
+	int len = 0;
+
+	if (!tc->zcpipe)
+		return -1;
+	while (tc->zclen > 0) {
+		n = splice (tc->zcpipe->rfd, NULL, fd, &off, tc->zclen,
+			    SPLICE_F_MOVE);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		tc->zclen -= n;
+		len += n;
+	}
+	if (len == 0 && tc->zclen > 0) {
+		if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+			/* fd doesn't splice:  pull the data into the Twrite and
+			 * return -1 with no error, so the caller writes it.
+			 * If the pull fails, it leaves np_rerror () set.
+			 */
+			np_uerror (0);
+			np_splice_pull (tc, tc->u.twrite.data);
+			return -1;
+		}
+		np_uerror (n < 0 ? errno : EIO);
+		np_splice_release (tc);
+		return -1;
+	}
+	np_splice_release (tc);		/* a short write drops the rest */
+	return len;
+}
@@ -31,34 +31,81 @@
 #include <pthread.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <time.h>
 #include <assert.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <inttypes.h>
+#include <signal.h>
+#include <sched.h>
 
 #include "9p.h"
 #include "npfs.h"
 #include "xpthread.h"
 #include "npfsimpl.h"
 
-struct Reqpool {
-	pthread_mutex_t	lock;
-	int		reqnum;
-	Npreq*		reqlist;
-} reqpool = { PTHREAD_MUTEX_INITIALIZER, 0, NULL };
+static Npcache *req_cache = NULL;
+static pthread_once_t req_cache_once = PTHREAD_ONCE_INIT;
+
+/* Defaults for elastic fifo tpools (see np_tpool_grow ()).
+ */
+#define WTHREAD_GROWMS		100
+#define WTHREAD_IDLESECS	60
+
+/* Default threshold for the slowreqs ctl file (see np_req_check_slow ()).
+ */
+#define SLOWREQ_MS		1000
+
+/* Default number of workers dedicated to each tpool in shared mode.
+ */
+#define WTHREAD_RESERVE		1
+
+/* Default number of epoll threads reading connections (SRV_FLAGS_REACTOR).
+ */
+#define REACTOR_THREADS		2
 
 static Nptpool *np_tpool_create(Npsrv *srv, char *name);
 static void np_tpool_cleanup (Npsrv *srv);
 static void *np_wthread_proc(void *a);
-static void np_srv_remove_workreq(Nptpool *tp, Npreq *req);
-static void np_srv_add_workreq(Nptpool *tp, Npreq *req);
-static void np_srv_remove_donereq(Nptpool *tp, Npreq *req);
-static void np_srv_add_donereq(Nptpool *tp, Npreq *req);
 static void np_tpool_incref_nolock (Nptpool *tp);
 
+static pthread_key_t curreq_key;
+static pthread_once_t curreq_once = PTHREAD_ONCE_INIT;
+
 static char *_ctl_get_conns (char *name, void *a);
 static char *_ctl_get_tpools (char *name, void *a);
+static char *_ctl_get_latency (char *name, void *a);
+static void *_ctl_get_tpools_bin (char *name, void *a, int *lenp);
 static char *_ctl_get_requests (char *name, void *a);
+static char *_ctl_get_slowreqs (char *name, void *a);
+static char *_ctl_get_caches (char *name, void *a);
+
+/* At most one of the run queue flags may be set.
+ */
+static const Nprunq *
+np_runq_select(int flags)
+{
+	const Nprunq *rq = &np_runq_fifo;
+	int n = 0;
+
+	if ((flags & SRV_FLAGS_TPOOL_RING)) {
+		rq = &np_runq_ring;
+		n++;
+	}
+	if ((flags & SRV_FLAGS_TPOOL_STEAL)) {
+		rq = &np_runq_steal;
+		n++;
+	}
+	if ((flags & SRV_FLAGS_TPOOL_SHARED)) {
+		rq = &np_runq_shared;
+		n++;
+	}
+	if (n > 1) {
+		np_uerror (EINVAL);
+		return NULL;
+	}
+	return rq;
+}
 
 Npsrv*
 np_srv_create(int nwthread, int flags)
@@ -73,9 +120,16 @@ np_srv_create(int nwthread, int flags)
 	memset (srv, 0, sizeof (*srv));
 	pthread_mutex_init(&srv->lock, NULL);
 	pthread_cond_init(&srv->conncountcond, NULL);
+	pthread_mutex_init(&srv->rqlock, NULL);
+	pthread_cond_init(&srv->rqcond, NULL);
+	pthread_mutex_init(&srv->sendlock, NULL);
+	pthread_cond_init(&srv->sendcond, NULL);
+	pthread_cond_init(&srv->growcond, NULL);
 
 	srv->msize = 8216;
 	srv->flags = flags;
+	if (!(srv->runq = np_runq_select (flags)))
+		goto error;
 
 	if (np_ctl_initialize (srv) < 0)
 		goto error;
@@ -83,14 +137,33 @@ np_srv_create(int nwthread, int flags)
 		goto error;
 	if (!np_ctl_addfile (srv->ctlroot, "tpools", _ctl_get_tpools, srv, 0))
 		goto error;
+	if (!np_ctl_addfile (srv->ctlroot, "latency", _ctl_get_latency, srv, 0))
+		goto error;
+	if (!np_ctl_addfile_bin (srv->ctlroot, "tpools.bin",
+				 _ctl_get_tpools_bin, srv, 0))
+		goto error;
 	if (!np_ctl_addfile (srv->ctlroot, "requests", _ctl_get_requests,srv,0))
 		goto error;
+	if (!np_ctl_addfile (srv->ctlroot, "slowreqs", _ctl_get_slowreqs,srv,0))
+		goto error;
+	if (!np_ctl_addfile (srv->ctlroot, "caches", _ctl_get_caches, srv, 0))
+		goto error;
 	if (np_usercache_create (srv) < 0)
 		goto error;
 	srv->nwthread = nwthread;
-	if (!(srv->tpool = np_tpool_create (srv, "default")))
+	srv->nwthread_max = nwthread;
+	srv->wthread_growms = WTHREAD_GROWMS;
+	srv->wthread_idlesecs = WTHREAD_IDLESECS;
+	srv->slowreq_ms = SLOWREQ_MS;
+	if (!(srv->slowreqs = calloc (NP_SLOWREQS, sizeof (Npslowreq)))) {
+		np_uerror (ENOMEM);
+		goto error;
+	}
+	srv->nwthread_reserve = WTHREAD_RESERVE;
+	srv->nwthread_meta = 0;
+	srv->nreactor = REACTOR_THREADS;
+	if (srv->runq->srv_init && srv->runq->srv_init (srv) < 0)
 		goto error;
-	np_tpool_incref_nolock (srv->tpool);
 	return srv;
 error:
 	if (srv)
@@ -101,17 +174,79 @@ error:
 void
 np_srv_destroy(Npsrv *srv)
 {
+	int i;
+
+	if (srv->reactors) {
+		for (i = 0; i < srv->nreactor; i++) {
+			if (srv->reactors[i])
+				np_reactor_destroy (srv->reactors[i]);
+		}
+		free (srv->reactors);
+	}
+	if (srv->runq && srv->runq->srv_fini)
+		srv->runq->srv_fini (srv);
+	np_conn_senders_destroy (srv);
 	np_tpool_decref (srv->tpool);
 	np_tpool_cleanup (srv);
-	np_usercache_destroy (srv);
+	if (srv->usercache)
+		np_usercache_destroy (srv);
 	np_ctl_finalize (srv);
+	pthread_cond_destroy (&srv->rqcond);
+	pthread_mutex_destroy (&srv->rqlock);
+	pthread_cond_destroy (&srv->sendcond);
+	pthread_mutex_destroy (&srv->sendlock);
+	pthread_cond_destroy (&srv->growcond);
+	if (srv->slowreqs)
+		free (srv->slowreqs);
 	free (srv);
 }
 
+/* Reactors are started with the first connection, so that srv->nreactor
+ * may be set after np_srv_create ().  Connections are assigned to them
+ * in turn.
+ */
+Npreactor *
+np_srv_get_reactor(Npsrv *srv)
+{
+	Npreactor *r = NULL;
+	int i;
+
+	xpthread_mutex_lock(&srv->lock);
+	if (srv->nreactor < 1)
+		goto done;
+	if (!srv->reactors) {
+		if (!(srv->reactors = malloc (srv->nreactor * sizeof (r)))) {
+			np_uerror (ENOMEM);
+			goto done;
+		}
+		for (i = 0; i < srv->nreactor; i++)
+			srv->reactors[i] = NULL;
+	}
+	i = srv->reactor_next++ % srv->nreactor;
+	if (!srv->reactors[i])
+		srv->reactors[i] = np_reactor_create (srv);
+	r = srv->reactors[i];
+done:
+	xpthread_mutex_unlock(&srv->lock);
+	return r;
+}
+
+/* Like the reactors, the default tpool is started with the first
+ * connection, so that srv->nwthread_meta and srv->nwthread_reserve may be
+ * set after np_srv_create ().  Return 0 if it can't be.
+ */
 int
 np_srv_add_conn(Npsrv *srv, Npconn *conn)
 {
 	xpthread_mutex_lock(&srv->lock);
+	if (!srv->tpool) {
+		if (!(srv->tpool = np_tpool_create (srv, "default"))) {
+			xpthread_mutex_unlock(&srv->lock);
+			np_logerr (srv, "np_tpool_create default");
+			return 0;
+		}
+		np_tpool_incref_nolock (srv->tpool);
+	}
 	conn->srv = srv;
 	conn->next = srv->conns;
 	srv->conns = conn;
@@ -162,43 +297,130 @@ np_srv_wait_conncount(Npsrv *srv, int count)
 	xpthread_mutex_unlock(&srv->lock);
 }
 
+static u64
+_time_ns (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Number of workers a tpool starts with (and never drops below).
+ */
+int
+np_tpool_minwthread(Nptpool *tp)
+{
+	Npsrv *srv = tp->srv;
+
+	if (srv->runq->minwthread)
+		return srv->runq->minwthread(tp);
+	return srv->nwthread;
+}
+
+int
+np_tpool_maxwthread(Nptpool *tp)
+{
+	Npsrv *srv = tp->srv;
+
+	if (!srv->runq->elastic)
+		return np_tpool_minwthread(tp);
+	return srv->nwthread_max;
+}
+
 void
 np_srv_add_req(Npsrv *srv, Npreq *req)
 {
 	Nptpool *tp = NULL;
 
-	/* assert: srv->lock held */
+	/* N.B. fid->tpool is assigned once in np_tpool_select () and the
+	 * tpool is held by the fid's reference, so no srv->lock needed here.
+	 */
 	if (req->fid)
 		tp = req->fid->tpool;
 	if (!tp)
 		tp = srv->tpool;
-	req->prev = tp->reqs_last;
-	if (tp->reqs_last)
-		tp->reqs_last->next = req;
-	tp->reqs_last = req;
-	if (!tp->reqs_first)
-		tp->reqs_first = req;
-	xpthread_cond_signal(&tp->reqcond);
+	req->tpool = tp;
+	__atomic_add_fetch (&req->conn->qdepth, 1, __ATOMIC_RELAXED);
+	srv->runq->add_req(tp, req);
 }
 
+/* Called by the run queue when req leaves it, whether taken by a worker
+ * or flushed.
+ */
 void
-np_srv_remove_req(Nptpool *tp, Npreq *req)
+np_req_dequeued(Npreq *req)
 {
-	/* assert: srv->lock held */
-	if (req->prev)
-		req->prev->next = req->next;
-	if (req->next)
-		req->next->prev = req->prev;
-	if (req == tp->reqs_first)
-		tp->reqs_first = req->next;
-	if (req == tp->reqs_last)
-		tp->reqs_last = req->prev;
+	__atomic_sub_fetch (&req->conn->qdepth, 1, __ATOMIC_RELAXED);
 }
 
-static void
+/* Flush one request found in conn->tagtab (conn->tlock held).
+ * np_req_respond () clears req->tpool under conn->tlock before it
+ * releases the request's fid, so until then the fid keeps the tpool
+ * (and its workers) around.
+ * Returns 1 if req was dequeued and the caller should drop the queue's
+ * reference to it.
+ */
+static int
+np_req_flush(Npreq *req)
+{
+	Npsrv *srv = req->conn->srv;
+	Nptpool *tp;
+	Npwthread *wt = NULL;
+	int dead;
+
+	if (req->tcall->type == P9_TFLUSH)
+		return 0;
+	__atomic_store_n (&req->flushed, 1, __ATOMIC_SEQ_CST);
+	if (!(tp = req->tpool))
+		return 0;
+	dead = srv->runq->flush(tp, req, &wt);
+	if (wt && (srv->flags & SRV_FLAGS_FLUSHSIG))
+		pthread_kill (wt->thread, SIGUSR2);
+	return dead;
+}
+
+/* Flush conn's request with the given tag, or all of them if tag < 0.
+ * Queued requests are discarded.  Requests being worked on are marked
+ * flushed so no reply is sent, and interrupted if SRV_FLAGS_FLUSHSIG.
+ * In ring and steal modes, queued requests are also just marked flushed
+ * and the worker that dequeues them skips them.
+ * Deferred requests are marked flushed so np_req_complete () sends no reply.
+ * Only conn's own requests are visited, by way of conn->tagtab.
+ */
+void
+np_srv_flush_reqs(Npconn *conn, int tag)
+{
+	Npreq *creq, *nextreq, *dead = NULL;
+	int i;
+
+	xpthread_mutex_lock(&conn->tlock);
+	for (i = 0; i < TAG_HTABLE_SIZE; i++) {
+		if (tag >= 0 && i != tag % TAG_HTABLE_SIZE)
+			continue;
+		for (creq = conn->tagtab[i]; creq != NULL; creq = creq->tnext) {
+			if (tag >= 0 && creq->tag != tag)
+				continue;
+			if (np_req_flush(creq)) {
+				creq->next = dead;
+				dead = creq;
+			}
+		}
+	}
+	xpthread_mutex_unlock(&conn->tlock);
+
+	/* N.B. unref outside of locks - see np_wthread_proc ()
+	 */
+	for (creq = dead; creq != NULL; creq = nextreq) {
+		nextreq = creq->next;
+		np_req_unref(creq);
+	}
+}
+
+void
 np_srv_add_workreq(Nptpool *tp, Npreq *req)
 {
-	/* assert: srv->lock held */
+	/* assert: tp->lock held */
 	if (tp->workreqs)
 		tp->workreqs->prev = req;
 	req->next = tp->workreqs;
@@ -206,10 +428,12 @@ np_srv_add_workreq(Nptpool *tp, Npreq *req)
 	req->prev = NULL;
 }
 
-static void
+void
 np_srv_remove_workreq(Nptpool *tp, Npreq *req)
 {
-	/* assert: srv->lock held */
+	/* assert: tp->lock held */
+	if (req->wthread)
+		req->wthread->req = NULL;
 	if (req->prev)
 		req->prev->next = req->next;
 	else
@@ -218,36 +442,13 @@ np_srv_remove_workreq(Nptpool *tp, Npreq *req)
 		req->next->prev = req->prev;
 }
 
-static void
-np_srv_add_donereq(Nptpool *tp, Npreq *req)
-{
-	/* assert: srv->lock held */
-	if (tp->donereqs)
-		tp->donereqs->prev = req;
-	req->next = tp->donereqs;
-	tp->donereqs = req;
-	req->prev = NULL;
-}
-
-static void
-np_srv_remove_donereq(Nptpool *tp, Npreq *req)
-{
-	/* assert: srv->lock held */
-	if (req->prev)
-		req->prev->next = req->next;
-	else
-		tp->donereqs = req->next;
-	if (req->next)
-		req->next->prev = req->prev;
-}
-
-static int
+int
 np_wthread_create(Nptpool *tp)
 {
 	int err;
 	Npwthread *wt;
 
-	/* assert srv->lock held */
+	/* assert srv->lock (new tpool) or tp->lock held */
 	if (!(wt = malloc(sizeof(*wt)))) {
 		np_uerror (ENOMEM);
 		goto error;
@@ -258,12 +459,19 @@ np_wthread_create(Nptpool *tp)
 	wt->fsuid = geteuid ();
 	wt->fsgid = getegid ();
 	wt->privcap = (wt->fsuid == 0 ? 1 : 0);
+	wt->id = tp->nwthread;
+	wt->metaonly = (wt->id < tp->nwthread_meta);
+	pthread_mutex_init(&wt->lock, NULL);
+	pthread_cond_init(&wt->cond, NULL);
 	if ((err = pthread_create(&wt->thread, NULL, np_wthread_proc, wt))) {
 		np_uerror (err);
+		np_wthread_free (wt);
 		goto error;
 	}
 	wt->next = tp->wthreads;
 	tp->wthreads = wt;
+	if (tp->wtab)
+		__atomic_store_n (&tp->wtab[wt->id], wt, __ATOMIC_RELEASE);
 	return 0;
 error:
 	return -1;
@@ -277,10 +485,16 @@ np_tpool_destroy(Nptpool *tp)
 	void *retval;
 	int err, i;
 
+	xpthread_mutex_lock(&tp->lock);
 	for(wt = tp->wthreads; wt != NULL; wt = wt->next) {
-		wt->shutdown = 1;
+		xpthread_mutex_lock(&wt->lock);
+		__atomic_store_n (&wt->shutdown, 1, __ATOMIC_SEQ_CST);
+		xpthread_cond_signal(&wt->cond);
+		xpthread_mutex_unlock(&wt->lock);
 	}
 	xpthread_cond_broadcast(&tp->reqcond);
+	xpthread_cond_broadcast(&tp->metacond);
+	xpthread_mutex_unlock(&tp->lock);
 	for (i = 0, wt = tp->wthreads; wt != NULL; wt = next, i++) {
 		next = wt->next;
 		if ((err = pthread_join (wt->thread, &retval))) {
@@ -293,9 +507,16 @@ np_tpool_destroy(Nptpool *tp)
 			np_logmsg(srv, "%s: join thread %d: non-NULL return",
 					tp->name, i);
 		}
-		free (wt);
+		np_wthread_free (wt);
 	}
+	srv->runq->fini(tp);
 	pthread_cond_destroy (&tp->reqcond);
+	pthread_cond_destroy (&tp->metacond);
+	pthread_mutex_destroy (&tp->lock);
+	if (tp->statslots)
+		free (tp->statslots);
+	if (tp->latslots)
+		free (tp->latslots);
 	if (tp->name)
 		free (tp->name);
 	free (tp);
@@ -305,6 +526,7 @@ static Nptpool *
 np_tpool_create(Npsrv *srv, char *name)
 {
 	Nptpool *tp;
+	int n;
 
 	/* assert srv->lock held */
 	if (!(tp = malloc (sizeof (*tp)))) {
@@ -318,8 +540,27 @@ np_tpool_create(Npsrv *srv, char *name)
 	}
 	tp->srv = srv;
 	tp->refcount = 0;
+	if (posix_memalign ((void **)&tp->statslots, 64,
+			    NPSTATS_NSLOTS * sizeof (Npstatslot))) {
+		tp->statslots = NULL;
+		np_uerror (ENOMEM);
+		goto error;
+	}
+	memset (tp->statslots, 0, NPSTATS_NSLOTS * sizeof (Npstatslot));
+	if (posix_memalign ((void **)&tp->latslots, 64,
+			    NPSTATS_NSLOTS * sizeof (Nplatslot))) {
+		tp->latslots = NULL;
+		np_uerror (ENOMEM);
+		goto error;
+	}
+	memset (tp->latslots, 0, NPSTATS_NSLOTS * sizeof (Nplatslot));
+	pthread_mutex_init(&tp->lock, NULL);
 	pthread_cond_init(&tp->reqcond, NULL);
-	for(tp->nwthread = 0; tp->nwthread < srv->nwthread; tp->nwthread++) {
+	pthread_cond_init(&tp->metacond, NULL);
+	if (srv->runq->init(tp) < 0)
+		goto error;
+	n = np_tpool_minwthread(tp);
+	for(tp->nwthread = 0; tp->nwthread < n; tp->nwthread++) {
 		if (np_wthread_create(tp) < 0)
 			goto error;
 	}
@@ -408,7 +649,8 @@ np_tpool_cleanup (Npsrv *srv)
 	for (tp = srv->tpool; tp != NULL; tp = next) {
 		next = tp->next;
 		assert (tp->refcount >= 0);
-		if (tp->refcount == 0) {
+		if (tp->refcount == 0 && !__atomic_load_n (&tp->nreplying,
+							   __ATOMIC_ACQUIRE)) {
 			tp->next = dead;
 			dead = tp;
 			if (prev)
@@ -429,6 +671,7 @@ np_tpool_cleanup (Npsrv *srv)
  * This is done before the request is handed off to a worker, with
  * the plan of using fid data in scheduling work.
  * The fid refcount is incremented here, then decremented in np_respond ().
+ * The request is also assigned to the metadata or data lane.
  */
 static void
 np_preprocess_request(Npreq *req)
@@ -547,6 +790,16 @@ np_preprocess_request(Npreq *req)
 	}
 	if (req->fid)
 		np_fid_incref (req->fid);
+	switch (tc->type) {
+		case P9_TREAD:
+		case P9_TWRITE:
+		case P9_TFSYNC:
+			req->lane = NP_LANE_DATA;
+			break;
+		default:
+			req->lane = NP_LANE_META;
+			break;
+	}
 }
 
 static u32
@@ -572,14 +825,262 @@ _hbin (u64 val)
 	return j < NPSTATS_RWCOUNT_BINS ? j : NPSTATS_RWCOUNT_BINS - 1;
 }
 
-static Npfcall*
+void
+np_tpool_account(Nptpool *tp, u8 type, Npfcall *rc)
+{
+	Npstatslot *sl;
+	u64 rbytes = 0, wbytes = 0;
+	int cpu;
+
+	if (rc && rc->type == P9_RREAD)
+		rbytes = rc->u.rread.count;
+	if (rc && rc->type == P9_RWRITE)
+		wbytes = rc->u.rwrite.count;
+	if ((cpu = sched_getcpu ()) < 0)
+		cpu = 0;
+	sl = &tp->statslots[cpu % NPSTATS_NSLOTS];
+	if (rbytes > 0) {
+		__atomic_add_fetch (&sl->rcount[_hbin(rbytes)], 1,
+				    __ATOMIC_RELAXED);
+		__atomic_add_fetch (&sl->rbytes, rbytes, __ATOMIC_RELAXED);
+	}
+	if (wbytes > 0) {
+		__atomic_add_fetch (&sl->wcount[_hbin(wbytes)], 1,
+				    __ATOMIC_RELAXED);
+		__atomic_add_fetch (&sl->wbytes, wbytes, __ATOMIC_RELAXED);
+	}
+	__atomic_add_fetch (&sl->nreqs[type], 1, __ATOMIC_RELAXED);
+}
+
+static int
+_lbin (u64 ns)
+{
+	u64 us = ns / 1000;
+	int i = us ? 64 - __builtin_clzll (us) : 0;
+
+	return i < NPSTATS_LAT_BINS ? i : NPSTATS_LAT_BINS - 1;
+}
+
+/* Account a replied-to request's queue, op, and reply latency.
+ * Requests flushed before they reached a worker have no stime.
+ */
+static void
+np_tpool_latency(Nptpool *tp, Npreq *req)
+{
+	Nplatency *lat;
+	u64 q, s, r;
+	int op, cpu;
+
+	if (!req->stime || !req->dtime || (op = req->latop) < 0)
+		return;
+	q = req->stime - req->rtime;
+	s = req->dtime - req->stime;
+	r = _time_ns () - req->dtime;
+	if ((cpu = sched_getcpu ()) < 0)
+		cpu = 0;
+	lat = &tp->latslots[cpu % NPSTATS_NSLOTS].op[op];
+	__atomic_add_fetch (&lat->count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch (&lat->qtime, q, __ATOMIC_RELAXED);
+	__atomic_add_fetch (&lat->stime, s, __ATOMIC_RELAXED);
+	__atomic_add_fetch (&lat->rtime, r, __ATOMIC_RELAXED);
+	__atomic_add_fetch (&lat->qbins[_lbin (q)], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch (&lat->sbins[_lbin (s)], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch (&lat->rbins[_lbin (r)], 1, __ATOMIC_RELAXED);
+}
+
+void
+np_acct_snapshot(Npacct *acct, Npacct *snap)
+{
+	int i;
+
+	snap->outstanding = __atomic_load_n (&acct->outstanding,
+					     __ATOMIC_RELAXED);
+	snap->rbytes = __atomic_load_n (&acct->rbytes, __ATOMIC_RELAXED);
+	snap->wbytes = __atomic_load_n (&acct->wbytes, __ATOMIC_RELAXED);
+	snap->stime = __atomic_load_n (&acct->stime, __ATOMIC_RELAXED);
+	for (i = 0; i < NPSTATS_LAT_NOPS; i++)
+		snap->nreqs[i] = __atomic_load_n (&acct->nreqs[i],
+						  __ATOMIC_RELAXED);
+}
+
+/* Charge a completed request to its connection and, if it came in on
+ * a fid, that fid's user.
+ */
+static void
+np_req_account(Npreq *req, Npfcall *rc)
+{
+	Npacct *acct[2] = { &req->conn->acct, req->uacct };
+	u64 rbytes = 0, wbytes = 0;
+	u64 stime = req->dtime - req->stime;
+	int i;
+
+	if (rc && rc->type == P9_RREAD)
+		rbytes = rc->u.rread.count;
+	if (rc && rc->type == P9_RWRITE)
+		wbytes = rc->u.rwrite.count;
+	for (i = 0; i < 2; i++) {
+		if (!acct[i])
+			continue;
+		if (req->latop >= 0)
+			__atomic_add_fetch (&acct[i]->nreqs[req->latop], 1,
+					    __ATOMIC_RELAXED);
+		if (rbytes > 0)
+			__atomic_add_fetch (&acct[i]->rbytes, rbytes,
+					    __ATOMIC_RELAXED);
+		if (wbytes > 0)
+			__atomic_add_fetch (&acct[i]->wbytes, wbytes,
+					    __ATOMIC_RELAXED);
+		__atomic_add_fetch (&acct[i]->stime, stime, __ATOMIC_RELAXED);
+	}
+}
+
+/* Copy the tail of src, which is what tells paths apart.
+ */
+static void
+_strtail (char *dst, int len, char *src)
+{
+	int n = strlen (src);
+
+	if (n >= len)
+		snprintf (dst, len, "...%s", src + n - len + 4);
+	else
+		memcpy (dst, src, n + 1);
+}
+
+/* Record a completed request in srv->slowreqs.  Writers claim entries
+ * round robin, and drop the record in the unlikely event that another
+ * writer still owns the entry after the ring has wrapped.  Readers
+ * check seq before and after copying an entry (see _ctl_get_slowreqs).
+ */
+static void
+np_req_record_slow(Npreq *req, Npfcall *rc)
+{
+	Npsrv *srv = req->conn->srv;
+	Npfid *fid = req->fid;
+	Npslowreq *sr;
+	char *path = NULL;
+	u64 seq;
+
+	seq = __atomic_add_fetch (&srv->slowreq_seq, 1, __ATOMIC_RELAXED);
+	sr = &srv->slowreqs[(seq - 1) % NP_SLOWREQS];
+	if (__atomic_exchange_n (&sr->busy, 1, __ATOMIC_ACQUIRE))
+		return;
+	__atomic_store_n (&sr->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence (__ATOMIC_RELEASE);
+	sr->when = time (NULL);
+	sr->latop = req->latop;
+	sr->fid = fid ? fid->fid : P9_NOFID;
+	sr->ecode = rc && rc->type == P9_RLERROR ? rc->u.rlerror.ecode : 0;
+	sr->qtime = req->stime - req->rtime;
+	sr->stime = req->dtime - req->stime;
+	_strtail (sr->client, sizeof (sr->client),
+		  np_conn_get_client_id (req->conn));
+	_strtail (sr->uname, sizeof (sr->uname),
+		  fid && fid->user ? fid->user->uname : "-");
+	_strtail (sr->aname, sizeof (sr->aname),
+		  fid && fid->aname ? fid->aname : "-");
+	if (fid && srv->fidpath)
+		path = srv->fidpath (fid);
+	_strtail (sr->path, sizeof (sr->path), path ? path : "-");
+	__atomic_store_n (&sr->seq, seq, __ATOMIC_RELEASE);
+	__atomic_store_n (&sr->busy, 0, __ATOMIC_RELEASE);
+}
+
+static void
+np_req_check_slow(Npreq *req, Npfcall *rc)
+{
+	int ms = req->conn->srv->slowreq_ms;
+
+	if (ms > 0 && req->dtime - req->rtime >= (u64)ms * 1000000)
+		np_req_record_slow(req, rc);
+}
+
+static void
+np_tpool_sum_latency(Nptpool *tp, Nplatency *lat)
+{
+	Nplatency *sl;
+	int i, j, k;
+
+	memset (lat, 0, NPSTATS_LAT_NOPS * sizeof (Nplatency));
+	for (i = 0; i < NPSTATS_NSLOTS; i++) {
+		for (j = 0; j < NPSTATS_LAT_NOPS; j++) {
+			sl = &tp->latslots[i].op[j];
+			lat[j].count += __atomic_load_n (&sl->count,
+							 __ATOMIC_RELAXED);
+			lat[j].qtime += __atomic_load_n (&sl->qtime,
+							 __ATOMIC_RELAXED);
+			lat[j].stime += __atomic_load_n (&sl->stime,
+							 __ATOMIC_RELAXED);
+			lat[j].rtime += __atomic_load_n (&sl->rtime,
+							 __ATOMIC_RELAXED);
+			for (k = 0; k < NPSTATS_LAT_BINS; k++) {
+				lat[j].qbins[k] += __atomic_load_n (
+					&sl->qbins[k], __ATOMIC_RELAXED);
+				lat[j].sbins[k] += __atomic_load_n (
+					&sl->sbins[k], __ATOMIC_RELAXED);
+				lat[j].rbins[k] += __atomic_load_n (
+					&sl->rbins[k], __ATOMIC_RELAXED);
+			}
+		}
+	}
+}
+
+/* Sum the per-cpu counters into tp->stats.
+ */
+static void
+np_tpool_sum_stats(Nptpool *tp)
+{
+	Npstats *st = &tp->stats;
+	Npstatslot *sl;
+	int i, j;
+
+	memset (st->nreqs, 0, sizeof (st->nreqs));
+	memset (st->rcount, 0, sizeof (st->rcount));
+	memset (st->wcount, 0, sizeof (st->wcount));
+	st->rbytes = st->wbytes = 0;
+	for (i = 0; i < NPSTATS_NSLOTS; i++) {
+		sl = &tp->statslots[i];
+		for (j = 0; j <= P9_RWSTAT; j++)
+			st->nreqs[j] += __atomic_load_n (&sl->nreqs[j],
+							 __ATOMIC_RELAXED);
+		for (j = 0; j < NPSTATS_RWCOUNT_BINS; j++) {
+			st->rcount[j] += __atomic_load_n (&sl->rcount[j],
+							  __ATOMIC_RELAXED);
+			st->wcount[j] += __atomic_load_n (&sl->wcount[j],
+							  __ATOMIC_RELAXED);
+		}
+		st->rbytes += __atomic_load_n (&sl->rbytes, __ATOMIC_RELAXED);
+		st->wbytes += __atomic_load_n (&sl->wbytes, __ATOMIC_RELAXED);
+	}
+}
+
+static void
+np_init_curreq_key(void)
+{
+	pthread_key_create(&curreq_key, NULL);
+}
+
+/* The request being processed by the calling thread, for op callbacks
+ * that aren't passed it.  NULL outside of an op callback.
+ */
+Npreq *
+np_req_current(void)
+{
+	pthread_once(&curreq_once, np_init_curreq_key);
+	return pthread_getspecific(curreq_key);
+}
+
+Npfcall*
 np_process_request(Npreq *req, Nptpool *tp)
 {
 	Npfcall *rc = NULL;
 	Npfcall *tc = req->tcall;
 	int ecode, valid_op = 1;
-	u64 rbytes = 0, wbytes = 0;
 
+	req->tpool = tp;
+	req->stime = _time_ns ();
+	pthread_once(&curreq_once, np_init_curreq_key);
+	pthread_setspecific(curreq_key, req);
 	np_uerror(0);
 	switch (tc->type) {
 		case P9_TSTATFS:
@@ -656,13 +1157,9 @@ np_process_request(Npreq *req, Nptpool *tp)
 			break;
 		case P9_TREAD:
 			rc = np_read(req, tc);
-			if (rc)
-				rbytes = rc->u.rread.count;
 			break;
 		case P9_TWRITE:
 			rc = np_write(req, tc);
-			if (rc)
-				wbytes = rc->u.rwrite.count;
 			break;
 		case P9_TCLUNK:
 			rc = np_clunk(req, tc);
@@ -677,70 +1174,162 @@ np_process_request(Npreq *req, Nptpool *tp)
 			valid_op = 0;
 			break;
 	}
+	pthread_setspecific(curreq_key, NULL);
+	if (req->deferred)
+		return NULL;
+	req->dtime = _time_ns ();
 	if ((ecode = np_rerror())) {
 		if (rc)
-			free(rc);
+			np_free_fcall(rc);
 		rc = np_create_rlerror(ecode);
 	}
 	if (valid_op) {
-		xpthread_mutex_lock (&tp->srv->lock);
-		if (rbytes > 0) {
-			tp->stats.rcount[_hbin(rbytes)]++;
-			tp->stats.rbytes += rbytes;
-		}
-		if (wbytes > 0) {
-			tp->stats.wcount[_hbin(wbytes)]++;
-			tp->stats.wbytes += wbytes;
-		}
-		tp->stats.nreqs[tc->type]++;
-		xpthread_mutex_unlock (&tp->srv->lock);
+		np_tpool_account(tp, tc->type, rc);
+		np_req_account(req, rc);
+		np_req_check_slow(req, rc);
 	}
 
 	return rc;
 }
 
-static void *
-np_wthread_proc(void *a)
+/* Called from an op callback to say that it will reply later, from any
+ * thread, with np_req_respond () or np_req_complete ().  The callback
+ * then returns NULL.  Until the reply, the request holds its fid and
+ * connection, is listed with state 'P' in the requests ctl file, and
+ * can be flushed, in which case the reply is discarded.
+ * Version, auth, walk, clunk, and remove cannot be deferred, as their
+ * fids are set up or torn down when the callback returns:  return -1.
+ */
+int
+np_req_defer(Npreq *req)
 {
-	Npwthread *wt = (Npwthread *)a;
-	Nptpool *tp = wt->tpool;
-	Npreq *req = NULL;
-	Npfcall *rc;
-
-	xpthread_mutex_lock(&tp->srv->lock);
-	while (!wt->shutdown) {
-		req = tp->reqs_first;
-		if (!req) {
-			xpthread_cond_wait(&tp->reqcond, &tp->srv->lock);
-			continue;
-		}
-		np_srv_remove_req(tp, req);
-		np_srv_add_workreq(tp, req);
-		req->wthread = wt;
-		xpthread_mutex_unlock(&tp->srv->lock);
-
-		rc = np_process_request(req, tp);
+	Nptpool *tp = req->tpool;
 
-		xpthread_mutex_lock(&tp->srv->lock);
+	if (!tp || req->deferred || req != np_req_current()) {
+		np_uerror(EINVAL);
+		return -1;
+	}
+	switch (req->tcall->type) {
+		case P9_TVERSION:
+		case P9_TAUTH:
+		case P9_TWALK:
+		case P9_TCLUNK:
+		case P9_TREMOVE:
+			np_uerror(EINVAL);
+			return -1;
+	}
+	np_req_ref(req);
+	xpthread_mutex_lock(&tp->lock);
+	if (req->conn->srv->runq->workreqs)
 		np_srv_remove_workreq(tp, req);
-		np_srv_add_donereq(tp, req);
-		xpthread_mutex_unlock(&tp->srv->lock);
+	req->deferred = 1;
+	req->wthread = NULL;
+	if (tp->pendreqs)
+		tp->pendreqs->prev = req;
+	req->next = tp->pendreqs;
+	tp->pendreqs = req;
+	req->prev = NULL;
+	xpthread_mutex_unlock(&tp->lock);
+	return 0;
+}
 
-		np_req_respond(req, rc);
-			
-		xpthread_mutex_lock(&tp->srv->lock);
-		np_srv_remove_donereq(tp, req);
-		np_req_unref(req);
+/* Complete a deferred request with reply rc or, if ecode is nonzero,
+ * an error.
+ */
+void
+np_req_complete(Npreq *req, Npfcall *rc, int ecode)
+{
+	if (ecode) {
+		if (rc)
+			np_free_fcall(rc);
+		if (!(rc = np_create_rlerror(ecode)))
+			np_logmsg(req->conn->srv, "out of memory completing "
+				  "request from '%s'", req->conn->client_id);
 	}
-	xpthread_mutex_unlock (&tp->srv->lock);
+	np_req_respond(req, rc);
+}
+
+/* Like np_req_complete (), for a thread that mustn't block sending the
+ * reply, such as an I/O completion thread.  The reply is queued and, if
+ * nobody is sending on the connection, handed to a sender thread.
+ */
+void
+np_req_complete_nowait(Npreq *req, Npfcall *rc, int ecode)
+{
+	req->nowait = 1;
+	np_req_complete(req, rc, ecode);
+}
+
+/* Reply to a deferred request:  do what np_process_request () and the
+ * worker would have done after the op callback returned.
+ */
+static void
+np_req_respond_pending(Npreq *req, Npfcall *rc)
+{
+	Nptpool *tp = req->tpool;
+
+	req->dtime = _time_ns ();
+	if (rc && rc->type == P9_RLCREATE && req->fid)
+		req->fid->type = rc->u.rlcreate.qid.type;
+	np_tpool_account(tp, req->tcall->type, rc);
+	np_req_account(req, rc);
+	np_req_check_slow(req, rc);
+
+	xpthread_mutex_lock(&tp->lock);
+	if (req->prev)
+		req->prev->next = req->next;
+	else
+		tp->pendreqs = req->next;
+	if (req->next)
+		req->next->prev = req->prev;
+	req->next = req->prev = NULL;
+	req->deferred = 2;
+	xpthread_mutex_unlock(&tp->lock);
+
+	/* N.B. tp may go away once the reply releases the fid.
+	 */
+	np_req_respond(req, rc);
+	np_req_unref(req);
+}
+
+void
+np_wthread_free(Npwthread *wt)
+{
+	pthread_cond_destroy (&wt->cond);
+	pthread_mutex_destroy (&wt->lock);
+	free (wt);
+}
+
+static void *
+np_wthread_proc(void *a)
+{
+	Npwthread *wt = (Npwthread *)a;
 
+	wt->tpool->srv->runq->wthread_proc(wt);
 	return NULL;
 }
 
+/* The tpool is held by nreplying rather than the fid across the reply,
+ * since the fid must be released first, and np_tpool_cleanup () leaves
+ * it be until that drops to zero.
+ */
 void
 np_req_respond(Npreq *req, Npfcall *rc)
 {
+	Nptpool *tp;
+	int sent = 0;
+
+	if (req->deferred == 1) {
+		np_req_respond_pending(req, rc);
+		return;
+	}
 	xpthread_mutex_lock(&req->lock);
+	xpthread_mutex_lock(&req->conn->tlock);
+	tp = req->tpool;
+	req->tpool = NULL;	/* see np_req_flush () */
+	xpthread_mutex_unlock(&req->conn->tlock);
+	if (tp)
+		__atomic_add_fetch (&tp->nreplying, 1, __ATOMIC_SEQ_CST);
 	req->rcall = rc;
 	if (req->fid) {
 		np_fid_decref(req->fid);
@@ -749,31 +1338,58 @@ np_req_respond(Npreq *req, Npfcall *rc)
 	if (req->rcall && !req->flushed) {
 		np_set_tag(req->rcall, req->tag);
 		np_conn_respond(req);		
+		sent = 1;
+	}
+	/* N.B. np_conn_respond () may have taken (and freed) rc.
+	 */
+	if (req->rcall && req->rcall->zcpipe)
+		np_splice_release(req->rcall);
+	if (tp) {
+		if (sent)
+			np_tpool_latency(tp, req);
+		__atomic_sub_fetch (&tp->nreplying, 1, __ATOMIC_RELEASE);
 	}
 	xpthread_mutex_unlock(&req->lock);
 }
 
+/* Npreqs are recycled through a per-thread cache, keeping their
+ * mutex initialized while cached.
+ */
+static void
+_req_ctor(void *obj)
+{
+	Npreq *req = obj;
+
+	pthread_mutex_init(&req->lock, NULL);
+}
+
+static void
+_req_dtor(void *obj)
+{
+	Npreq *req = obj;
+
+	pthread_mutex_destroy(&req->lock);
+}
+
+static void
+np_req_init_cache(void)
+{
+	req_cache = np_cache_create("req", sizeof(Npreq), _req_ctor, _req_dtor);
+}
+
 Npreq *
 np_req_alloc(Npconn *conn, Npfcall *tc) {
 	Npreq *req;
 
-	req = NULL;
-	xpthread_mutex_lock(&reqpool.lock);
-	if (reqpool.reqlist) {
-		req = reqpool.reqlist;
-		reqpool.reqlist = req->next;
-		reqpool.reqnum--;
-	}
-	xpthread_mutex_unlock(&reqpool.lock);
-
-	if (!req) {
-		req = malloc(sizeof(*req));
-		if (!req)
-			return NULL;
-	}
+	pthread_once(&req_cache_once, np_req_init_cache);
+	if (req_cache)
+		req = np_cache_alloc(req_cache);
+	else if ((req = malloc(sizeof(*req))))
+		_req_ctor(req);
+	if (!req)
+		return NULL;
 
 	np_conn_incref(conn);
-	pthread_mutex_init(&req->lock, NULL);
 	req->refcount = 1;
 	req->conn = conn;
 	req->tag = tc->tag;
@@ -783,35 +1399,61 @@ np_req_alloc(Npconn *conn, Npfcall *tc) {
 	req->next = NULL;
 	req->prev = NULL;
 	req->wthread = NULL;
+	req->connq = NULL;
+	req->cnext = NULL;
+	req->cprev = NULL;
 	req->fid = NULL;
+	req->tpool = NULL;
+	req->deferred = 0;
+	req->nowait = 0;
+	req->queued = 0;
 	req->birth = time (NULL);
+	req->rtime = _time_ns ();
+	req->stime = req->dtime = 0;
+	req->latop = np_latop_index (tc->type);
+	req->uacct = NULL;
+	np_conn_add_req(conn, req);
 
 	np_preprocess_request (req); /* assigns req->fid */
+	if (req->fid && req->fid->user
+		     && (req->uacct = np_user_acct_get (req->fid->user))) {
+		__atomic_add_fetch (&req->uacct->outstanding, 1,
+				    __ATOMIC_RELAXED);
+	}
 
 	return req;
 }
 
+/* req->lock protects the reply, not the refcount, which is atomic.
+ */
 Npreq *
 np_req_ref(Npreq *req)
 {
-	xpthread_mutex_lock(&req->lock);
-	req->refcount++;
-	xpthread_mutex_unlock(&req->lock);
+	__atomic_add_fetch (&req->refcount, 1, __ATOMIC_RELAXED);
 	return req;
 }
 
 void
 np_req_unref(Npreq *req)
 {
-	xpthread_mutex_lock(&req->lock);
-	assert(req->refcount > 0);
-	req->refcount--;
-	if (req->refcount) {
-		xpthread_mutex_unlock(&req->lock);
+	int n;
+
+	n = __atomic_sub_fetch (&req->refcount, 1, __ATOMIC_RELEASE);
+	assert(n >= 0);
+	if (n > 0)
 		return;
+	__atomic_thread_fence (__ATOMIC_ACQUIRE);
+
+	/* N.B. leave conn->tagtab before the fid goes - see np_req_flush ()
+	 */
+	if (req->conn)
+		np_conn_remove_req(req->conn, req);
+	if (req->uacct) {
+		__atomic_sub_fetch (&req->uacct->outstanding, 1,
+				    __ATOMIC_RELAXED);
+		np_user_acct_put (req->uacct);
+		req->uacct = NULL;
 	}
-	xpthread_mutex_unlock(&req->lock);
-
 	if (req->fid) {
 		np_fid_decref(req->fid);
 		req->fid = NULL;
@@ -821,25 +1463,19 @@ np_req_unref(Npreq *req)
 		req->conn = NULL;
 	}
 	if (req->tcall) {
-		free (req->tcall);
+		np_free_fcall (req->tcall);
 		req->tcall = NULL;
 	}
 	if (req->rcall) {
-		free (req->rcall);
+		np_free_fcall (req->rcall);
 		req->rcall = NULL;
 	}
-	pthread_mutex_destroy (&req->lock);
-
-	xpthread_mutex_lock(&reqpool.lock);
-	if (reqpool.reqnum < 64) {
-		req->next = reqpool.reqlist;
-		reqpool.reqlist = req;
-		reqpool.reqnum++;
-		req = NULL;
-	}
-	xpthread_mutex_unlock(&reqpool.lock);
-	if (req)
+	if (req_cache)
+		np_cache_free(req_cache, req);
+	else {
+		_req_dtor(req);
 		free(req);
+	}
 }
 
 
@@ -872,20 +1508,28 @@ np_logerr(Npsrv *srv, const char *fmt, ...)
 	}
 }
 
+/* One line per connection:  client, fids, fid table size, queued requests,
+ * then the connection's Npacct (see np_encode_acct_str ()).
+ */
 static char *
 _ctl_get_conns (char *name, void *a)
 {
 	Npsrv *srv = (Npsrv *)a;
 	Npconn *cc;
+	Npacct acct;
 	char *s = NULL;
-	int len = 0;
+	int len = 0, qdepth;
 
 	xpthread_mutex_lock(&srv->lock);
 	for (cc = srv->conns; cc != NULL; cc = cc->next) {
+		qdepth = __atomic_load_n (&cc->qdepth, __ATOMIC_RELAXED);
 		xpthread_mutex_lock(&cc->lock);
-		if (aspf (&s, &len, "%s %d\n",
+		np_acct_snapshot(&cc->acct, &acct);
+		if (aspf (&s, &len, "%s %d %d %d",
 				np_conn_get_client_id(cc),
-				np_fidpool_count (cc->fidpool)) < 0) {
+				np_fidpool_count (cc->fidpool),
+				np_fidpool_size (cc->fidpool), qdepth) < 0
+		 || np_encode_acct_str (&s, &len, &acct) < 0) {
 			np_uerror (ENOMEM);
 			goto error_unlock;
 		}
@@ -901,25 +1545,50 @@ error_unlock:
 	return NULL;
 }
 
+static int
+_count_one_request (Npreq *req, Npwthread *wt, void *arg)
+{
+	(*(int *)arg)++;
+	return 0;
+}
+
+/* Bring tp->stats up to date.  Call with srv->lock held, and return
+ * with tp->lock held.
+ */
+static void
+_tpool_lock_stats (Nptpool *tp)
+{
+	Npreq *req;
+	int numreqs = 0;
+
+	tp->srv->runq->walk(tp, _count_one_request, &numreqs);
+	xpthread_mutex_lock(&tp->lock);
+	np_tpool_sum_stats(tp);
+	tp->stats.name = tp->name;
+	tp->stats.numfids = tp->refcount;
+	tp->stats.numreqs = numreqs;
+	tp->stats.numwthreads = tp->nwthread;
+	tp->stats.minwthreads = np_tpool_minwthread(tp);
+	tp->stats.maxwthreads = np_tpool_maxwthread(tp);
+	for (req = tp->workreqs; req != NULL; req = req->next)
+		tp->stats.numreqs++;
+	for (req = tp->pendreqs; req != NULL; req = req->next)
+		tp->stats.numreqs++;
+}
+
 static char *
 _ctl_get_tpools (char *name, void *a)
 {
 	Npsrv *srv = (Npsrv *)a;
 	Nptpool *tp;
-	Npreq *req;
 	char *s = NULL;
 	int n, len = 0;
 
 	xpthread_mutex_lock(&srv->lock);
 	for (tp = srv->tpool; tp != NULL; tp = tp->next) {
-		tp->stats.name = tp->name;
-		tp->stats.numfids = tp->refcount;
-		tp->stats.numreqs = 0;
-		for (req = tp->reqs_first; req != NULL; req = req->next)
-			tp->stats.numreqs++;
-		for (req = tp->workreqs; req != NULL; req = req->next)
-			tp->stats.numreqs++;
+		_tpool_lock_stats (tp);
 		n = np_encode_tpools_str (&s, &len, &tp->stats);
+		xpthread_mutex_unlock(&tp->lock);
 		if (n < 0) {
 			np_uerror (ENOMEM);
 			goto error_unlock;
@@ -934,6 +1603,81 @@ error_unlock:
 	return NULL;
 }
 
+static char *
+_ctl_get_latency (char *name, void *a)
+{
+	Npsrv *srv = (Npsrv *)a;
+	Nptpool *tp;
+	Nplatency *lat;
+	char *s = NULL;
+	int i, len = 0;
+
+	if (!(lat = malloc (NPSTATS_LAT_NOPS * sizeof (*lat)))) {
+		np_uerror (ENOMEM);
+		return NULL;
+	}
+	xpthread_mutex_lock(&srv->lock);
+	for (tp = srv->tpool; tp != NULL; tp = tp->next) {
+		np_tpool_sum_latency(tp, lat);
+		for (i = 0; i < NPSTATS_LAT_NOPS; i++) {
+			if (lat[i].count == 0)
+				continue;
+			if (np_encode_latency_str (&s, &len, tp->name, i,
+						   &lat[i]) < 0) {
+				np_uerror (ENOMEM);
+				goto error_unlock;
+			}
+		}
+	}
+	xpthread_mutex_unlock(&srv->lock);
+	free (lat);
+	return s;
+error_unlock:
+	xpthread_mutex_unlock(&srv->lock);
+	free (lat);
+	if (s)
+		free(s);
+	return NULL;
+}
+
+/* The tpools and latency files in one binary snapshot, for dtop.
+ */
+static void *
+_ctl_get_tpools_bin (char *name, void *a, int *lenp)
+{
+	Npsrv *srv = (Npsrv *)a;
+	Nptpool *tp;
+	Nplatency *lat;
+	u8 *buf = NULL;
+	int n, len = 0;
+
+	if (!(lat = malloc (NPSTATS_LAT_NOPS * sizeof (*lat)))) {
+		np_uerror (ENOMEM);
+		return NULL;
+	}
+	xpthread_mutex_lock(&srv->lock);
+	for (tp = srv->tpool; tp != NULL; tp = tp->next) {
+		np_tpool_sum_latency(tp, lat);
+		_tpool_lock_stats (tp);
+		n = np_encode_tpools_bin (&buf, &len, &tp->stats, lat);
+		xpthread_mutex_unlock(&tp->lock);
+		if (n < 0) {
+			np_uerror (ENOMEM);
+			goto error_unlock;
+		}
+	}
+	xpthread_mutex_unlock(&srv->lock);
+	free (lat);
+	*lenp = len;
+	return buf;
+error_unlock:
+	xpthread_mutex_unlock(&srv->lock);
+	free (lat);
+	if (buf)
+		free (buf);
+	return NULL;
+}
+
 static char *
 _get_one_request (char **sp, int *lp, char state, int age, Npreq *req)
 {
@@ -951,6 +1695,23 @@ _get_one_request (char **sp, int *lp, char state, int age, Npreq *req)
 	return *sp;
 }
 
+typedef struct {
+	char		*s;
+	int		len;
+	time_t		now;
+} ReqsArg;
+
+static int
+_get_one_walked_request (Npreq *req, Npwthread *wt, void *arg)
+{
+	ReqsArg *ra = arg;
+
+	if (!_get_one_request (&ra->s, &ra->len, wt ? 'R' : 'W',
+						ra->now - req->birth, req))
+		return -1;
+	return 0;
+}
+
 static char *
 _ctl_get_requests(char *name, void *a)
 {
@@ -960,13 +1721,20 @@ _ctl_get_requests(char *name, void *a)
 	int len = 0;
 	Npreq *req;
 	time_t now = time (NULL);
+	ReqsArg ra;
+	int n;
 
 	xpthread_mutex_lock(&srv->lock);
 	for (tp = srv->tpool; tp != NULL; tp = tp->next) {
-		for (req = tp->reqs_first; req != NULL; req = req->next)
-			if (!(_get_one_request (&s, &len, 'W',
-						now - req->birth, req)))
-				goto error_unlock;
+		ra.s = s;
+		ra.len = len;
+		ra.now = now;
+		n = srv->runq->walk(tp, _get_one_walked_request, &ra);
+		s = ra.s;
+		len = ra.len;
+		if (n < 0)
+			goto error;
+		xpthread_mutex_lock(&tp->lock);
 		for (req = tp->workreqs; req != NULL; req = req->next)
 			if (!(_get_one_request (&s, &len, 'R',
 						now - req->birth, req)))
@@ -975,12 +1743,72 @@ _ctl_get_requests(char *name, void *a)
 			if (!(_get_one_request (&s, &len, 'D',
 						now - req->birth, req)))
 				goto error_unlock;
+		for (req = tp->pendreqs; req != NULL; req = req->next)
+			if (!(_get_one_request (&s, &len, 'P',
+						now - req->birth, req)))
+				goto error_unlock;
+		xpthread_mutex_unlock(&tp->lock);
 	}
 	xpthread_mutex_unlock(&srv->lock);
 	return s;
 error_unlock:
+	xpthread_mutex_unlock(&tp->lock);
+error:
 	xpthread_mutex_unlock(&srv->lock);
 	if (s)
 		free(s);
 	return NULL;
 }
+
+/* One line per recorded slow request, oldest first:  time, client, user,
+ * aname, op, fid, queue and op time in usec, errno, and path last, as it
+ * may have spaces.
+ */
+static char *
+_ctl_get_slowreqs (char *name, void *a)
+{
+	Npsrv *srv = (Npsrv *)a;
+	Npslowreq *sr, r;
+	char *s = NULL;
+	int len = 0;
+	u64 seq, last;
+
+	last = __atomic_load_n (&srv->slowreq_seq, __ATOMIC_RELAXED);
+	seq = last > NP_SLOWREQS ? last - NP_SLOWREQS + 1 : 1;
+	for (; seq <= last; seq++) {
+		sr = &srv->slowreqs[(seq - 1) % NP_SLOWREQS];
+		if (__atomic_load_n (&sr->seq, __ATOMIC_ACQUIRE) != seq)
+			continue;
+		memcpy (&r, sr, sizeof (r));
+		__atomic_thread_fence (__ATOMIC_ACQUIRE);
+		if (__atomic_load_n (&sr->seq, __ATOMIC_RELAXED) != seq)
+			continue;
+		if (aspf (&s, &len, "%lu %s %s %s %s %d %"PRIu64" %"PRIu64
+			  " %d %s\n", (unsigned long)r.when, r.client, r.uname,
+			  r.aname, r.latop >= 0 ? np_latop_name (r.latop) : "-",
+			  r.fid == P9_NOFID ? -1 : (int)r.fid, r.qtime / 1000,
+			  r.stime / 1000, r.ecode, r.path) < 0) {
+			np_uerror (ENOMEM);
+			goto error;
+		}
+	}
+	return s;
+error:
+	if (s)
+		free (s);
+	return NULL;
+}
+
+static char *
+_ctl_get_caches (char *name, void *a)
+{
+	char *s = NULL;
+	int len = 0;
+
+	if (np_cache_report (&s, &len) < 0) {
+		if (s)
+			free (s);
+		return NULL;
+	}
+	return s;
+}
@@ -51,6 +51,11 @@ np_trans_create(void *aux,
 	trans->recv = recv;
 	trans->send = send;
 	trans->destroy = destroy;
+	trans->fd = -1;
+	trans->recv_nb = NULL;
+	trans->splice = 0;
+	trans->zcrecv = 0;
+	trans->sendv = NULL;
 
 	return trans;
 }
@@ -69,6 +74,23 @@ np_trans_send (Nptrans *trans, Npfcall *fc)
 	return trans->send(fc, trans->aux);
 }
 
+/* Send n fcalls in order, in as few system calls as the transport can.
+ */
+int
+np_trans_sendv (Nptrans *trans, Npfcall **fcs, int n)
+{
+	int i, len = 0, ret;
+
+	if (trans->sendv)
+		return trans->sendv(fcs, n, trans->aux);
+	for (i = 0; i < n; i++) {
+		if ((ret = trans->send(fcs[i], trans->aux)) < 0)
+			return -1;
+		len += ret;
+	}
+	return len;
+}
+
 int
 np_trans_recv (Nptrans *trans, Npfcall **fcp, u32 msize)
 {
@@ -77,7 +99,7 @@ np_trans_recv (Nptrans *trans, Npfcall **fcp, u32 msize)
 	if (trans->recv (&fc, msize, trans->aux) < 0)
 		return -1;
 	if (fc && !np_deserialize(fc)) {
-		free (fc);
+		np_free_fcall (fc);
 		np_uerror (EPROTO);
 		return -1;
 	}
@@ -85,3 +107,23 @@ np_trans_recv (Nptrans *trans, Npfcall **fcp, u32 msize)
 	return 0;
 }
 
+/* Like np_trans_recv (), but return 0 instead of blocking if a complete
+ * message hasn't arrived, and 1 otherwise (*fcp is NULL on EOF).
+ */
+int
+np_trans_recv_nb (Nptrans *trans, Npfcall **fcp, u32 msize)
+{
+	Npfcall *fc;
+	int n;
+
+	if ((n = trans->recv_nb (&fc, msize, trans->aux)) <= 0)
+		return n;
+	if (fc && !np_deserialize(fc)) {
+		np_free_fcall (fc);
+		np_uerror (EPROTO);
+		return -1;
+	}
+	*fcp = fc;
+	return 1;
+}
+
@@ -32,6 +32,7 @@
 #include <pthread.h>
 #include <errno.h>
 #include <unistd.h>
+#include <stddef.h>
 #include <sys/syscall.h>
 #include <sys/fsuid.h>
 #include <pwd.h>
@@ -46,17 +47,165 @@
 #include "xpthread.h"
 #include "npfsimpl.h"
 
+/* Traffic accounting for each uid seen, outliving its cache entries.
+ * Entries are hashed by uid.  One that no Npuser refers to is dropped
+ * after USERACCT_IDLE seconds, or sooner if there are USERACCT_MAX
+ * entries and room is needed for a new uid.
+ * Requests hold a reference too, as they may outlive the fid's Npuser.
+ */
+#define USERACCT_HSIZE	256
+#define USERACCT_MAX	4096
+#define USERACCT_IDLE	3600
+
+typedef struct Npuseracct {
+	uid_t	uid;
+	char	*uname;
+	Npacct	acct;
+	int	refs;		/* Npusers and requests with acct here (atomic) */
+	time_t	last;		/* when refs last dropped */
+	struct Npuseracct *next;
+} Npuseracct;
+
 typedef struct {
         pthread_mutex_t lock;
         Npuser* users;
 	int ttl;
+	Npuseracct *accts[USERACCT_HSIZE];
+	int naccts;
+	time_t swept;		/* when idle accts were last dropped */
 } Npusercache;
 
+static Npuseracct *
+_useracct_of (Npacct *acct)
+{
+	return (Npuseracct *)((char *)acct - offsetof (Npuseracct, acct));
+}
+
+static void
+_useracct_free (Npuseracct *ua)
+{
+	free (ua->uname);
+	free (ua);
+}
+
+/* Drop accts no Npuser refers to that have been idle since before
+ * cutoff.  Refs only go up from zero under uc->lock, so zero refs stays
+ * zero.
+ */
+static void
+_useracct_sweep (Npusercache *uc, time_t cutoff)
+{
+	Npuseracct *ua, **uap;
+	int i;
+
+	/* assert: uc->lock held */
+	for (i = 0; i < USERACCT_HSIZE; i++) {
+		uap = &uc->accts[i];
+		while ((ua = *uap)) {
+			if (__atomic_load_n (&ua->refs, __ATOMIC_ACQUIRE) == 0
+					&& ua->last < cutoff) {
+				*uap = ua->next;
+				_useracct_free (ua);
+				uc->naccts--;
+			} else
+				uap = &ua->next;
+		}
+	}
+}
+
+/* Make room for a new acct by dropping the longest idle ones.
+ */
+static void
+_useracct_evict (Npusercache *uc)
+{
+	Npuseracct *ua;
+	time_t oldest = 0;
+	int i, found = 0;
+
+	/* assert: uc->lock held */
+	for (i = 0; i < USERACCT_HSIZE; i++) {
+		for (ua = uc->accts[i]; ua != NULL; ua = ua->next) {
+			if (__atomic_load_n (&ua->refs, __ATOMIC_ACQUIRE) == 0
+					&& (!found || ua->last < oldest)) {
+				oldest = ua->last;
+				found = 1;
+			}
+		}
+	}
+	if (found)
+		_useracct_sweep (uc, oldest + 1);
+}
+
+static Npacct *
+_useracct_get (Npusercache *uc, Npuser *u)
+{
+	Npuseracct *ua, **head = &uc->accts[u->uid % USERACCT_HSIZE];
+
+	for (ua = *head; ua != NULL; ua = ua->next) {
+		if (ua->uid == u->uid)
+			goto done;
+	}
+	if (uc->naccts >= USERACCT_MAX) {
+		_useracct_evict (uc);
+		if (uc->naccts >= USERACCT_MAX)
+			return NULL;
+	}
+	if (!(ua = malloc (sizeof (*ua))))
+		return NULL;
+	memset (ua, 0, sizeof (*ua));
+	if (!(ua->uname = strdup (u->uname))) {
+		free (ua);
+		return NULL;
+	}
+	ua->uid = u->uid;
+	ua->next = *head;
+	*head = ua;
+	uc->naccts++;
+done:
+	__atomic_add_fetch (&ua->refs, 1, __ATOMIC_RELAXED);
+	return &ua->acct;
+}
+
+/* Called when an Npuser or request that was given an acct is done.
+ */
+static void
+_useracct_put (Npacct *acct)
+{
+	Npuseracct *ua = _useracct_of (acct);
+
+	ua->last = time (NULL);
+	__atomic_sub_fetch (&ua->refs, 1, __ATOMIC_RELEASE);
+}
+
+/* Take a reference on u's acct for a request, so it can be counted
+ * after the request's fid and with it u are gone.  Release it with
+ * np_user_acct_put ().
+ */
+Npacct *
+np_user_acct_get (Npuser *u)
+{
+	Npuseracct *ua;
+
+	if (!u->acct)
+		return NULL;
+	/* N.B. u holds a reference, so this doesn't go up from zero */
+	ua = _useracct_of (u->acct);
+	__atomic_add_fetch (&ua->refs, 1, __ATOMIC_RELAXED);
+	return u->acct;
+}
+
+void
+np_user_acct_put (Npacct *acct)
+{
+	_useracct_put (acct);
+}
+
 static void
 _usercache_add (Npsrv *srv, Npuser *u)
 {
 	Npusercache *uc = srv->usercache;
 
+	u->acct = _useracct_get (uc, u); /* requests go unaccounted if NULL */
 	u->next = uc->users;
 	uc->users = u;
 	np_user_incref (u);
@@ -86,6 +235,10 @@ _usercache_expire (Npsrv *srv)
 	Npuser *u = uc->users;
 	Npuser *prev = NULL;
 
+	if (now - uc->swept >= uc->ttl) {
+		_useracct_sweep (uc, now - USERACCT_IDLE);
+		uc->swept = now;
+	}
 	while (u) {
 		if (now - u->t >= uc->ttl) {
 			u = _usercache_del (srv, prev, u);
@@ -142,6 +295,39 @@ error:
 	return NULL;
 }
 
+/* One line per user:  name, uid, then the user's Npacct
+ * (see np_encode_acct_str ()).
+ */
+static char *
+_get_users (char *name, void *a)
+{
+	Npsrv *srv = (Npsrv *)a;
+	Npusercache *uc = srv->usercache;
+	Npuseracct *ua;
+	Npacct acct;
+	char *s = NULL;
+	int i, len = 0;
+
+	xpthread_mutex_lock (&uc->lock);
+	for (i = 0; i < USERACCT_HSIZE; i++) {
+		for (ua = uc->accts[i]; ua != NULL; ua = ua->next) {
+			np_acct_snapshot (&ua->acct, &acct);
+			if (aspf (&s, &len, "%s %d", ua->uname, ua->uid) < 0
+			 || np_encode_acct_str (&s, &len, &acct) < 0) {
+				np_uerror (ENOMEM);
+				xpthread_mutex_unlock (&uc->lock);
+				goto error;
+			}
+		}
+	}
+	xpthread_mutex_unlock (&uc->lock);
+	return s;
+error:
+	if (s)
+		free (s);
+	return NULL;
+}
+
 int
 np_usercache_create (Npsrv *srv)
 {
@@ -153,11 +339,15 @@ np_usercache_create (Npsrv *srv)
 		return -1;
 	}
 	uc->users = NULL;
+	memset (uc->accts, 0, sizeof (uc->accts));
+	uc->naccts = 0;
+	uc->swept = time (NULL);
 	pthread_mutex_init (&uc->lock, NULL);
 	uc->ttl	= 60;
 	srv->usercache = uc;
 
-	if (!np_ctl_addfile (srv->ctlroot, "usercache", _get_usercache,srv,0)) {
+	if (!np_ctl_addfile (srv->ctlroot, "usercache", _get_usercache,srv,0)
+	 || !np_ctl_addfile (srv->ctlroot, "users", _get_users, srv, 0)) {
 		free (srv->usercache);
 		return -1;
 	}
@@ -169,7 +359,9 @@ void
 np_usercache_destroy (Npsrv *srv)
 {
 	Npusercache *uc;
+	Npuseracct *ua;
 	Npuser *u;
+	int i;
 
 	assert (srv->usercache != NULL);
 	uc = srv->usercache;
@@ -177,6 +369,12 @@ np_usercache_destroy (Npsrv *srv)
 	u = uc->users;
 	while (u)
 		u = _usercache_del (srv, NULL, u);
+	for (i = 0; i < USERACCT_HSIZE; i++) {
+		while ((ua = uc->accts[i])) {
+			uc->accts[i] = ua->next;
+			_useracct_free (ua);
+		}
+	}
 	free (uc);
 	srv->usercache = NULL;
 }
@@ -184,11 +382,12 @@ np_usercache_destroy (Npsrv *srv)
 static void
 _free_user (Npuser *u)
 {
+	if (u->acct)
+		_useracct_put (u->acct);
 	if (u->uname)
 		free (u->uname);
 	if (u->sg)
 		free (u->sg);
-	pthread_mutex_destroy(&u->lock);
 	free (u);
 }
 
@@ -198,9 +397,7 @@ np_user_incref(Npuser *u)
 	if (!u)
 		return;
 
-	xpthread_mutex_lock (&u->lock);
-	u->refcount++;
-	xpthread_mutex_unlock (&u->lock);
+	__atomic_add_fetch (&u->refcount, 1, __ATOMIC_RELAXED);
 }
 
 void
@@ -211,11 +408,10 @@ np_user_decref(Npuser *u)
 	if (!u)
 		return;
 
-	xpthread_mutex_lock (&u->lock);
-	n = --u->refcount;
-	xpthread_mutex_unlock (&u->lock);
+	n = __atomic_sub_fetch (&u->refcount, 1, __ATOMIC_RELEASE);
 	if (n > 0)
 		return;
+	__atomic_thread_fence (__ATOMIC_ACQUIRE);
 	_free_user (u);
 }
 
@@ -274,10 +470,10 @@ _alloc_user (Npsrv *srv, struct passwd *pwd)
 	u->gid = pwd->pw_gid;
 	if (u->uid != 0 && _getgrouplist(srv, u) < 0)
 		goto error;
-	pthread_mutex_init (&u->lock, NULL);
 	u->refcount = 0;
 	u->t = time (NULL);
 	u->next = NULL;
+	u->acct = NULL;
 	if (srv->flags & SRV_FLAGS_DEBUG_USER)
 		np_logmsg (srv, "user lookup: %d", u->uid);
 	return u;
@@ -326,12 +522,12 @@ _alloc_nouserdb (Npsrv *srv, uid_t uid, char *name)
 		goto error;
 	}
 	u->sg[0] = u->gid;
-	pthread_mutex_init (&u->lock, NULL);
 	if (srv->flags & SRV_FLAGS_DEBUG_USER)
 		np_logmsg (srv, "user lookup: %d", u->uid);
 	u->refcount = 0;
 	u->t = time (NULL);
 	u->next = NULL;
+	u->acct = NULL;
 	return u;
 error:
 	if (u)
@@ -23,3 +23,15 @@
     int pthread_cond_signal_result = pthread_cond_signal(a); \
     assert (pthread_cond_signal_result == 0); \
 } while (0)
+#define xpthread_rwlock_rdlock(a) do { \
+    int pthread_rwlock_rdlock_result = pthread_rwlock_rdlock(a); \
+    assert (pthread_rwlock_rdlock_result == 0); \
+} while (0)
+#define xpthread_rwlock_wrlock(a) do { \
+    int pthread_rwlock_wrlock_result = pthread_rwlock_wrlock(a); \
+    assert (pthread_rwlock_wrlock_result == 0); \
+} while (0)
+#define xpthread_rwlock_unlock(a) do { \
+    int pthread_rwlock_unlock_result = pthread_rwlock_unlock(a); \
+    assert (pthread_rwlock_unlock_result == 0); \
+} while (0)
@@ -0,0 +1,168 @@
+/* tfidpool.c - exercise fid hash table delete and grow (valgrind me) */
+
+/* Fids are created and destroyed in the open addressed table in fidpool.c,
+ * checking np_fid_find () after each step.  Fids are picked to share home
+ * slots and to wrap around the end of the table, so that removal must
+ * shift later members of a probe sequence back, and enough are created
+ * to make the table grow (rehash) more than once.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "9p.h"
+#include "npfs.h"
+
+#define NFIDS       256
+#define ITERATIONS  20000
+
+static u32 fids[NFIDS];
+static Npfid *live[NFIDS];
+
+/* Same hash as fidpool.c.
+ */
+static int
+_home (u32 fid, int size)
+{
+    return (fid * 2654435761U) & (size - 1);
+}
+
+/* Fill fids[] starting at index i with n fids whose home is slot.
+ */
+static int
+_pick (int i, int n, int slot, u32 *next)
+{
+    while (n > 0) {
+        if (_home (*next, FID_HTABLE_SIZE) == slot) {
+            fids[i++] = *next;
+            n--;
+        }
+        (*next)++;
+    }
+    return i;
+}
+
+static void
+_check (Npconn *conn, int nfids)
+{
+    int i, count = 0;
+
+    for (i = 0; i < nfids; i++) {
+        assert (np_fid_find (conn, fids[i]) == live[i]);
+        if (live[i])
+            count++;
+    }
+    assert (np_fidpool_count (conn->fidpool) == count);
+}
+
+static void
+_create (Npconn *conn, int i)
+{
+    assert (live[i] == NULL);
+    live[i] = np_fid_create (conn, fids[i], NULL);
+    assert (live[i] != NULL);
+    assert (live[i]->fid == fids[i]);
+}
+
+static void
+_destroy (int i)
+{
+    assert (live[i] != NULL);
+    np_fid_destroy (live[i]);
+    live[i] = NULL;
+}
+
+int
+main (int argc, char *argv[])
+{
+    Npsrv srv;
+    Npconn conn;
+    u32 next = 1;
+    int i, n, size;
+
+    memset (&srv, 0, sizeof (srv));
+    memset (&conn, 0, sizeof (conn));
+    conn.srv = &srv;
+    if (!(conn.fidpool = np_fidpool_create ())) {
+        fprintf (stderr, "out of memory\n");
+        exit (1);
+    }
+    assert (np_fidpool_size (conn.fidpool) == FID_HTABLE_SIZE);
+
+    /* A cluster straddling the end of the table:  six fids at home in the
+     * last slot, then three in slot 0 and two in slot 1, displaced by them.
+     */
+    n = _pick (0, 6, FID_HTABLE_SIZE - 1, &next);
+    n = _pick (n, 3, 0, &next);
+    n = _pick (n, 2, 1, &next);
+    for (i = 0; i < n; i++) {
+        _create (&conn, i);
+        _check (&conn, n);
+    }
+    /* Take fids out of the front, middle, and back of the cluster.
+     */
+    _destroy (0);
+    _check (&conn, n);
+    _destroy (6);
+    _check (&conn, n);
+    _destroy (3);
+    _check (&conn, n);
+    _destroy (n - 1);
+    _check (&conn, n);
+    _create (&conn, 0);
+    _check (&conn, n);
+    for (i = 0; i < n; i++) {
+        if (live[i]) {
+            _destroy (i);
+            _check (&conn, n);
+        }
+    }
+    assert (np_fidpool_count (conn.fidpool) == 0);
+
+    /* Random creates and destroys of many more fids than fit in the
+     * initial table, half of them sharing a few home slots.
+     */
+    n = _pick (0, NFIDS / 8, FID_HTABLE_SIZE - 1, &next);
+    n = _pick (n, NFIDS / 8, 0, &next);
+    n = _pick (n, NFIDS / 8, FID_HTABLE_SIZE / 2, &next);
+    n = _pick (n, NFIDS / 8, 1, &next);
+    while (n < NFIDS)
+        fids[n++] = next++;
+    srand (1);
+    for (i = 0; i < ITERATIONS; i++) {
+        int j = rand () % NFIDS;
+
+        /* mostly create at first, mostly destroy at the end */
+        if (!live[j] && rand () % ITERATIONS >= i / 2)
+            _create (&conn, j);
+        else if (live[j])
+            _destroy (j);
+        if (i % 64 == 0)
+            _check (&conn, NFIDS);
+    }
+    _check (&conn, NFIDS);
+    size = np_fidpool_size (conn.fidpool);
+    assert (size >= FID_HTABLE_SIZE * 4);
+    for (i = 0; i < NFIDS; i++) {
+        if (live[i]) {
+            _destroy (i);
+            if (i % 8 == 0)
+                _check (&conn, NFIDS);
+        }
+    }
+    _check (&conn, NFIDS);
+    assert (np_fidpool_count (conn.fidpool) == 0);
+
+    np_fidpool_destroy (conn.fidpool);
+    exit (0);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
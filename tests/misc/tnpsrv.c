@@ -1,5 +1,9 @@
 /* tnpsrv.c - test simple client/server (valgrind me) */
 
+/* Usage: tnpsrv [fifo|ring|steal|shared]
+ * The argument picks the tpool run queue, fifo by default.
+ */
+
 #if HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -12,6 +16,7 @@
 #include <errno.h>
 #include <stdarg.h>
 #include <assert.h>
+#include <inttypes.h>
 
 #include "9p.h"
 #include "npfs.h"
@@ -24,6 +29,96 @@
 
 #define TEST_MSIZE 8192
 
+static u64
+_sum_nreqs (Npacct *acct)
+{
+    u64 res = 0;
+    int i;
+
+    for (i = 0; i < NPSTATS_LAT_NOPS; i++)
+        res += acct->nreqs[i];
+    return res;
+}
+
+/* The connections and users files hold timings and counts that vary from
+ * run to run, so they are read untraced and only request counts, which
+ * are taken before each reply is sent, are logged.  The Npacct on the
+ * first line follows nfields other fields.
+ */
+static void
+_get_acct (Npsrv *srv, Npcfid *root, char *name, int nfields)
+{
+    Npacct acct;
+    char *str, *p;
+    int i, qdepth;
+
+    srv->flags &= ~SRV_FLAGS_DEBUG_9PTRACE;
+    if (!(str = npc_aget (root, name)))
+        errn_exit (np_rerror (), "npc_aget %s", name);
+    srv->flags |= SRV_FLAGS_DEBUG_9PTRACE;
+    if ((p = strchr (str, '\n')))
+        *p = '\0';
+    /* Only the read of this file is outstanding, and it is running.
+     */
+    if (!strcmp (name, "connections")
+            && (sscanf (str, "%*s %*d %*d %d", &qdepth) != 1 || qdepth != 0))
+        msg_exit ("%s: bad queue depth: %s", name, str);
+    for (p = str, i = 0; i < nfields && p; i++) {
+        if ((p = strchr (p, ' ')))
+            p++;
+    }
+    if (!p || np_decode_acct_str (p, &acct) < 0)
+        msg_exit ("%s: parse error: %s", name, str);
+    msg ("%s: nreqs %"PRIu64" reads %"PRIu64, name, _sum_nreqs (&acct),
+         acct.nreqs[np_latop_index (P9_TREAD)]);
+    free (str);
+}
+
+/* Likewise for tpools.bin.
+ */
+static void
+_get_tpools_bin (Npsrv *srv, Npcfid *root)
+{
+    Npstats *stats;
+    Nplatency *lat;
+    u64 reads, count;
+    char *buf;
+    int i, n, len;
+
+    srv->flags &= ~SRV_FLAGS_DEBUG_9PTRACE;
+    if (!(buf = npc_aget_len (root, "tpools.bin", &len)))
+        errn_exit (np_rerror (), "npc_aget_len tpools.bin");
+    srv->flags |= SRV_FLAGS_DEBUG_9PTRACE;
+    if ((n = np_decode_tpools_bin ((u8 *)buf, len, &stats, &lat)) < 0)
+        msg_exit ("tpools.bin: parse error");
+    for (i = 0; i < n; i++) {
+        reads = stats[i].nreqs[P9_TREAD];
+        count = lat[i * NPSTATS_LAT_NOPS + np_latop_index (P9_TREAD)].count;
+        if (count == 0 || count > reads) /* latency is taken after reply */
+            msg_exit ("tpools.bin: %s: bad read latency count", stats[i].name);
+        msg ("tpools.bin: %s reads %"PRIu64, stats[i].name, reads);
+        free (stats[i].name);
+    }
+    free (stats);
+    free (lat);
+    free (buf);
+}
+
+static int
+_runq_flag (char *name)
+{
+    if (!strcmp (name, "fifo"))
+        return 0;
+    if (!strcmp (name, "ring"))
+        return SRV_FLAGS_TPOOL_RING;
+    if (!strcmp (name, "steal"))
+        return SRV_FLAGS_TPOOL_STEAL;
+    if (!strcmp (name, "shared"))
+        return SRV_FLAGS_TPOOL_SHARED;
+    msg_exit ("unknown run queue: %s", name);
+    return 0;
+}
+
 int
 main (int argc, char *argv[])
 {
@@ -36,12 +131,20 @@ main (int argc, char *argv[])
 
     diod_log_init (argv[0]);
     diod_conf_init ();
+    if (argc > 1)
+        flags |= _runq_flag (argv[1]);
+
+    /* Only one run queue may be picked.
+     */
+    if (np_srv_create (16, SRV_FLAGS_TPOOL_RING | SRV_FLAGS_TPOOL_STEAL)
+                                                || np_rerror () != EINVAL)
+        msg_exit ("np_srv_create accepted two run queues");
 
     if (socketpair (AF_LOCAL, SOCK_STREAM, 0, s) < 0)
         err_exit ("socketpair");
 
     if (!(srv = np_srv_create (16, flags)))
-        errn_exit (np_rerror (), "out of memory");
+        errn_exit (np_rerror (), "np_srv_create");
     srv->logmsg = diod_log_msg;
     diod_sock_startfd (srv, s[1], s[1], "loopback");
 
@@ -56,9 +159,9 @@ main (int argc, char *argv[])
 
     if (!(root1 = npc_attach (fs, NULL, "ctl", 1)))
         errn_exit (np_rerror (), "npc_attach");
-    if (!(str = npc_aget (root1, "connections")))
-        errn_exit (np_rerror (), "npc_aget connections");
-    free (str);
+    _get_acct (srv, root1, "connections", 4);
+    _get_acct (srv, root1, "users", 2);
+    _get_tpools_bin (srv, root1);
 
     /* Same user (1) - user cache should be valid, so we won't see a message
      * for this user lookup in the output.
@@ -0,0 +1,199 @@
+/* tring.c - exercise the lock-free ring run queue (valgrind me) */
+
+/* Items are put, got, and walked in one thread, checking order, full and
+ * empty conditions, and wraparound.  Then producers and consumers run
+ * concurrently with a walker, and every item must be got exactly once.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <assert.h>
+
+#include "9p.h"
+#include "npfs.h"
+#include "npfsimpl.h"
+
+#define RING_SIZE   8
+#define NPRODUCERS  4
+#define NCONSUMERS  4
+#define NITEMS      20000   /* per producer */
+
+#define ITEM(i)     ((void *)(uintptr_t)(i))
+#define INDEX(p)    ((int)(uintptr_t)(p))
+
+typedef struct {
+    int next;       /* item expected next, or -1 for any */
+    int stop;       /* return -1 after this many, or -1 for never */
+    int count;
+} WalkArg;
+
+static int
+_walk_check (void *item, void *arg)
+{
+    WalkArg *wa = arg;
+
+    if (wa->next >= 0)
+        assert (INDEX (item) == wa->next++);
+    wa->count++;
+    if (wa->count == wa->stop)
+        return -1;
+    return 0;
+}
+
+static void
+_walk_expect (Npring *r, int first, int n)
+{
+    WalkArg wa = { .next = first, .stop = -1, .count = 0 };
+
+    assert (np_ring_walk (r, _walk_check, &wa) == 0);
+    assert (wa.count == n);
+    assert (np_ring_count (r) == n);
+}
+
+static void
+_serial (void)
+{
+    Npring *r;
+    WalkArg wa;
+    void *pub;
+    int i;
+
+    assert ((r = np_ring_create (RING_SIZE)) != NULL);
+    assert (np_ring_get (r, NULL) == NULL);
+    _walk_expect (r, 1, 0);
+
+    for (i = 1; i <= RING_SIZE; i++)
+        assert (np_ring_put (r, ITEM (i)) == 0);
+    assert (np_ring_put (r, ITEM (RING_SIZE + 1)) < 0);
+    _walk_expect (r, 1, RING_SIZE);
+
+    /* fn returning -1 stops the walk */
+    wa.next = 1;
+    wa.stop = 3;
+    wa.count = 0;
+    assert (np_ring_walk (r, _walk_check, &wa) < 0);
+    assert (wa.count == 3);
+
+    /* gets are FIFO and publish the item */
+    for (i = 1; i <= RING_SIZE / 2; i++) {
+        pub = NULL;
+        assert (np_ring_get (r, &pub) == ITEM (i));
+        assert (pub == ITEM (i));
+    }
+    _walk_expect (r, RING_SIZE / 2 + 1, RING_SIZE / 2);
+
+    /* wrap around the end of the cells */
+    for (i = RING_SIZE + 1; i <= RING_SIZE + RING_SIZE / 2; i++)
+        assert (np_ring_put (r, ITEM (i)) == 0);
+    assert (np_ring_put (r, ITEM (i)) < 0);
+    _walk_expect (r, RING_SIZE / 2 + 1, RING_SIZE);
+    for (i = RING_SIZE / 2 + 1; i <= RING_SIZE + RING_SIZE / 2; i++)
+        assert (np_ring_get (r, NULL) == ITEM (i));
+    assert (np_ring_get (r, NULL) == NULL);
+    _walk_expect (r, 1, 0);
+
+    np_ring_destroy (r);
+}
+
+static Npring *ring;
+static int got[NPRODUCERS * NITEMS + 1];
+static int ngot = 0;
+static int done = 0;
+
+static void *
+_producer (void *arg)
+{
+    int base = (int)(uintptr_t)arg * NITEMS;
+    int i;
+
+    for (i = 1; i <= NITEMS; i++) {
+        while (np_ring_put (ring, ITEM (base + i)) < 0)
+            sched_yield ();
+    }
+    return NULL;
+}
+
+static void *
+_consumer (void *arg)
+{
+    void *item;
+
+    while (__atomic_load_n (&ngot, __ATOMIC_SEQ_CST) < NPRODUCERS * NITEMS) {
+        if (!(item = np_ring_get (ring, NULL))) {
+            sched_yield ();
+            continue;
+        }
+        assert (INDEX (item) > 0 && INDEX (item) <= NPRODUCERS * NITEMS);
+        __atomic_add_fetch (&got[INDEX (item)], 1, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch (&ngot, 1, __ATOMIC_SEQ_CST);
+    }
+    return NULL;
+}
+
+static int
+_walk_valid (void *item, void *arg)
+{
+    assert (INDEX (item) > 0 && INDEX (item) <= NPRODUCERS * NITEMS);
+    (*(int *)arg)++;
+    return 0;
+}
+
+static void *
+_walker (void *arg)
+{
+    int n;
+
+    while (!__atomic_load_n (&done, __ATOMIC_SEQ_CST)) {
+        n = 0;
+        assert (np_ring_walk (ring, _walk_valid, &n) == 0);
+        assert (n <= RING_SIZE);
+        sched_yield ();
+    }
+    return NULL;
+}
+
+static void
+_concurrent (void)
+{
+    pthread_t p[NPRODUCERS], c[NCONSUMERS], w;
+    int i;
+
+    assert ((ring = np_ring_create (RING_SIZE)) != NULL);
+    assert (pthread_create (&w, NULL, _walker, NULL) == 0);
+    for (i = 0; i < NCONSUMERS; i++)
+        assert (pthread_create (&c[i], NULL, _consumer, NULL) == 0);
+    for (i = 0; i < NPRODUCERS; i++)
+        assert (pthread_create (&p[i], NULL, _producer,
+                                (void *)(uintptr_t)i) == 0);
+    for (i = 0; i < NPRODUCERS; i++)
+        assert (pthread_join (p[i], NULL) == 0);
+    for (i = 0; i < NCONSUMERS; i++)
+        assert (pthread_join (c[i], NULL) == 0);
+    __atomic_store_n (&done, 1, __ATOMIC_SEQ_CST);
+    assert (pthread_join (w, NULL) == 0);
+
+    for (i = 1; i <= NPRODUCERS * NITEMS; i++)
+        assert (got[i] == 1);
+    assert (np_ring_get (ring, NULL) == NULL);
+    assert (np_ring_count (ring) == 0);
+    np_ring_destroy (ring);
+}
+
+int
+main (int argc, char *argv[])
+{
+    _serial ();
+    _concurrent ();
+    exit (0);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
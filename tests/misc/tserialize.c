@@ -15,6 +15,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/uio.h>
 #include <assert.h>
 
 #include "9p.h"
@@ -51,6 +52,7 @@ static void test_tflush (void);         static void test_rflush (void);
 static void test_tattach (void);        static void test_rattach (void);
 static void test_twalk (void);          static void test_rwalk (void);
 static void test_tread (void);          static void test_rread (void);
+static void test_rread_ext (void);
 static void test_twrite (void);         static void test_rwrite (void);
 static void test_tclunk (void);         static void test_rclunk (void);
 static void test_tremove (void);        static void test_rremove (void);
@@ -98,6 +100,7 @@ main (int argc, char *argv[])
     test_tattach ();    test_rattach ();
     test_twalk ();      test_rwalk ();
     test_tread ();      test_rread ();
+    test_rread_ext ();
     test_twrite ();     test_rwrite ();
     test_tclunk ();     test_rclunk ();
     test_tremove ();    test_rremove ();
@@ -112,6 +115,8 @@ _rcv_buf (Npfcall *fc, int type, const char *fun)
 {
     Npfcall *fc2;
     char s[256];
+    struct iovec iov[NP_FCALL_IOVMAX];
+    int i, n, len = 0;
 
     printf ("%s(%d): %d\n", fun, type, fc->size);
     np_set_tag (fc, 42);
@@ -121,8 +126,14 @@ _rcv_buf (Npfcall *fc, int type, const char *fun)
         msg_exit ("out of memory");
     fc2->pkt = (u8 *)fc2 + sizeof (*fc2);
 
-    /* see conn.c::np_conn_read_proc */
-    memcpy (fc2->pkt, fc->pkt, fc->size);
+    /* see fdtrans.c::np_fdtrans_write */
+    n = np_fcall_iov (fc, iov);
+    for (i = 0; i < n; i++) {
+        memcpy (fc2->pkt + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+    if (len != fc->size)
+        msg_exit ("iov length mismatch in %s", fun);
     if (!np_deserialize (fc2))
         msg_exit ("np_deserialize error in %s", fun);
 
@@ -151,7 +162,7 @@ test_rlerror (void)
 
     assert (fc->u.rlerror.ecode == fc2->u.rlerror.ecode);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -166,7 +177,7 @@ test_tstatfs (void)
 
     assert (fc->u.tstatfs.fid == fc2->u.tstatfs.fid);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -189,7 +200,7 @@ test_rstatfs(void)
     assert (fc->u.rstatfs.fsid == fc2->u.rstatfs.fsid);
     assert (fc->u.rstatfs.namelen == fc2->u.rstatfs.namelen);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -205,7 +216,7 @@ test_tlopen (void)
     assert (fc->u.tlopen.fid == fc2->u.tlopen.fid);
     assert (fc->u.tlopen.flags == fc2->u.tlopen.flags);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -224,7 +235,7 @@ test_rlopen (void)
     assert (fc->u.rlopen.qid.path == fc2->u.rlopen.qid.path);
     assert (fc->u.rlopen.iounit == fc2->u.rlopen.iounit);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -243,7 +254,7 @@ test_tlcreate (void)
     assert (fc->u.tlcreate.mode == fc2->u.tlcreate.mode);
     assert (fc->u.tlcreate.gid == fc2->u.tlcreate.gid);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -262,7 +273,7 @@ test_rlcreate (void)
     assert (fc->u.rlcreate.qid.path == fc2->u.rlcreate.qid.path);
     assert (fc->u.rlcreate.iounit == fc2->u.rlcreate.iounit);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -280,7 +291,7 @@ test_tsymlink (void)
     assert (np_str9cmp (&fc->u.tsymlink.symtgt, &fc2->u.tsymlink.symtgt) == 0);
     assert (fc->u.tsymlink.gid == fc2->u.tsymlink.gid);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -298,7 +309,7 @@ test_rsymlink (void)
     assert (fc->u.rsymlink.qid.version == fc2->u.rsymlink.qid.version);
     assert (fc->u.rsymlink.qid.path == fc2->u.rsymlink.qid.path);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -318,7 +329,7 @@ test_tmknod (void)
     assert (fc->u.tmknod.minor == fc2->u.tmknod.minor);
     assert (fc->u.tmknod.gid == fc2->u.tmknod.gid);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -336,7 +347,7 @@ test_rmknod (void)
     assert (fc->u.rmknod.qid.version == fc2->u.rmknod.qid.version);
     assert (fc->u.rmknod.qid.path == fc2->u.rmknod.qid.path);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -353,7 +364,7 @@ test_trename (void)
     assert (fc->u.trename.dfid == fc2->u.trename.dfid);
     assert (np_str9cmp (&fc->u.trename.name, &fc2->u.trename.name) == 0);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -366,7 +377,7 @@ test_rrename(void)
         msg_exit ("out of memory");
     fc2 = _rcv_buf (fc, P9_RRENAME,  __FUNCTION__);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -381,7 +392,7 @@ test_treadlink (void)
 
     assert (fc->u.treadlink.fid == fc2->u.treadlink.fid);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -396,7 +407,7 @@ test_rreadlink (void)
 
     assert (np_str9cmp (&fc->u.rreadlink.target, &fc2->u.rreadlink.target) == 0);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -412,7 +423,7 @@ test_tgetattr (void)
     assert (fc->u.tgetattr.fid == fc2->u.tgetattr.fid);
     assert (fc->u.tgetattr.request_mask == fc2->u.tgetattr.request_mask);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -450,7 +461,7 @@ test_rgetattr (void)
     assert (fc->u.rgetattr.gen == fc2->u.rgetattr.gen);
     assert (fc->u.rgetattr.data_version == fc2->u.rgetattr.data_version);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -474,7 +485,7 @@ test_tsetattr (void)
     assert (fc->u.tsetattr.mtime_sec == fc2->u.tsetattr.mtime_sec);
     assert (fc->u.tsetattr.mtime_nsec == fc2->u.tsetattr.mtime_nsec);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -487,7 +498,7 @@ test_rsetattr (void)
         msg_exit ("out of memory");
     fc2 = _rcv_buf (fc, P9_RSETATTR,  __FUNCTION__);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -504,7 +515,7 @@ test_txattrwalk (void)
     assert (fc->u.txattrwalk.attrfid == fc2->u.txattrwalk.attrfid);
     assert (np_str9cmp (&fc->u.txattrwalk.name, &fc2->u.txattrwalk.name) == 0);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -519,7 +530,7 @@ test_rxattrwalk (void)
 
     assert (fc->u.rxattrwalk.size == fc2->u.rxattrwalk.size);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -537,7 +548,7 @@ test_txattrcreate (void)
     assert (fc->u.txattrcreate.size == fc2->u.txattrcreate.size);
     assert (fc->u.txattrcreate.flag == fc2->u.txattrcreate.flag);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -550,7 +561,7 @@ test_rxattrcreate (void)
         msg_exit ("out of memory");
     fc2 = _rcv_buf (fc, P9_RXATTRCREATE,  __FUNCTION__);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -567,7 +578,7 @@ test_treaddir (void)
     assert (fc->u.treaddir.offset == fc2->u.treaddir.offset);
     assert (fc->u.treaddir.count == fc2->u.treaddir.count);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -613,7 +624,7 @@ test_rreaddir (void)
     assert (strcmp (name2[2], name[2]) == 0);
     assert (n == fc2->u.rreaddir.count);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -628,7 +639,7 @@ test_tfsync (void)
 
     assert (fc->u.tfsync.fid == fc2->u.treaddir.fid);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -641,7 +652,7 @@ test_rfsync (void)
         msg_exit ("out of memory");
     fc2 = _rcv_buf (fc, P9_RFSYNC,  __FUNCTION__);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -661,7 +672,7 @@ test_tlock (void)
     assert (fc->u.tlock.length == fc2->u.tlock.length);
     assert (np_str9cmp (&fc->u.tlock.client_id, &fc2->u.tlock.client_id) == 0);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -676,7 +687,7 @@ test_rlock (void)
 
     assert (fc->u.rlock.status == fc2->u.rlock.status);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -696,7 +707,7 @@ test_tgetlock (void)
     assert (fc->u.tgetlock.proc_id == fc2->u.tgetlock.proc_id);
     assert (np_str9cmp (&fc->u.tgetlock.client_id, &fc2->u.tgetlock.client_id) == 0);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -715,7 +726,7 @@ test_rgetlock (void)
     assert (fc->u.rgetlock.proc_id == fc2->u.rgetlock.proc_id);
     assert (np_str9cmp (&fc->u.rgetlock.client_id, &fc2->u.rgetlock.client_id) == 0);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -732,7 +743,7 @@ test_tlink (void)
     assert (fc->u.tlink.fid == fc2->u.tlink.fid);
     assert (np_str9cmp (&fc->u.tlink.name, &fc2->u.tlink.name) == 0);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -745,7 +756,7 @@ test_rlink (void)
         msg_exit ("out of memory");
     fc2 = _rcv_buf (fc, P9_RLINK,  __FUNCTION__);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -763,7 +774,7 @@ test_tmkdir (void)
     assert (fc->u.tmkdir.mode == fc2->u.tmkdir.mode);
     assert (fc->u.tmkdir.gid == fc2->u.tmkdir.gid);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -781,7 +792,7 @@ test_rmkdir (void)
     assert (fc->u.rmkdir.qid.version == fc2->u.rmkdir.qid.version);
     assert (fc->u.rmkdir.qid.path == fc2->u.rmkdir.qid.path);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -799,7 +810,7 @@ test_trenameat (void)
     assert (fc->u.trenameat.newdirfid == fc2->u.trenameat.newdirfid);
     assert (np_str9cmp (&fc->u.trenameat.newname, &fc2->u.trenameat.newname) == 0);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -812,7 +823,7 @@ test_rrenameat (void)
         msg_exit ("out of memory");
     fc2 = _rcv_buf (fc, P9_RRENAMEAT,  __FUNCTION__);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -829,7 +840,7 @@ test_tunlinkat (void)
     assert (np_str9cmp (&fc->u.tunlinkat.name, &fc2->u.tunlinkat.name) == 0);
     assert (fc->u.tunlinkat.flags == fc2->u.tunlinkat.flags);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -842,7 +853,7 @@ test_runlinkat (void)
         msg_exit ("out of memory");
     fc2 = _rcv_buf (fc, P9_RUNLINKAT,  __FUNCTION__);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -858,7 +869,7 @@ test_tversion (void)
     assert (fc->u.tversion.msize == fc2->u.tversion.msize);
     assert (np_str9cmp (&fc->u.tversion.version, &fc2->u.tversion.version) == 0);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -874,7 +885,7 @@ test_rversion (void)
     assert (fc->u.rversion.msize == fc2->u.rversion.msize);
     assert (np_str9cmp (&fc->u.rversion.version, &fc2->u.rversion.version) == 0);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -884,7 +895,7 @@ test_tauth (void)
     Npfcall *fc, *fc2;
 
     if (!(fc = np_create_tauth (1, "abc", "xyz", 4)))
-        msg_exit ("out of memory in %s", __FUNCTION__); 
+        msg_exit ("out of memory in %s", __FUNCTION__);
     fc2 = _rcv_buf (fc, P9_TAUTH, __FUNCTION__);
 
     assert (fc->u.tauth.afid == fc2->u.tauth.afid);
@@ -892,7 +903,7 @@ test_tauth (void)
     assert (np_str9cmp (&fc->u.tauth.aname, &fc2->u.tauth.aname) == 0);
     assert (fc->u.tauth.n_uname == fc2->u.tauth.n_uname);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -903,14 +914,14 @@ test_rauth (void)
     struct p9_qid qid = { 1, 2, 3 };
 
     if (!(fc = np_create_rauth (&qid)))
-        msg_exit ("out of memory in %s", __FUNCTION__); 
+        msg_exit ("out of memory in %s", __FUNCTION__);
     fc2 = _rcv_buf (fc, P9_RAUTH, __FUNCTION__);
 
     assert (fc->u.rauth.qid.type == fc2->u.rauth.qid.type);
     assert (fc->u.rauth.qid.version == fc2->u.rauth.qid.version);
     assert (fc->u.rauth.qid.path == fc2->u.rauth.qid.path);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -920,12 +931,12 @@ test_tflush (void)
     Npfcall *fc, *fc2;
 
     if (!(fc = np_create_tflush (1)))
-        msg_exit ("out of memory in %s", __FUNCTION__); 
+        msg_exit ("out of memory in %s", __FUNCTION__);
     fc2 = _rcv_buf (fc, P9_TFLUSH, __FUNCTION__);
 
     assert (fc->u.tflush.oldtag == fc2->u.tflush.oldtag);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -935,10 +946,10 @@ test_rflush (void)
     Npfcall *fc, *fc2;
 
     if (!(fc = np_create_rflush ()))
-        msg_exit ("out of memory in %s", __FUNCTION__); 
+        msg_exit ("out of memory in %s", __FUNCTION__);
     fc2 = _rcv_buf (fc, P9_RFLUSH, __FUNCTION__);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -948,7 +959,7 @@ test_tattach (void)
     Npfcall *fc, *fc2;
 
     if (!(fc = np_create_tattach (1, 2, "abc", "xyz", 5)))
-        msg_exit ("out of memory in %s", __FUNCTION__); 
+        msg_exit ("out of memory in %s", __FUNCTION__);
     fc2 = _rcv_buf (fc, P9_TATTACH, __FUNCTION__);
 
     assert (fc->u.tattach.fid == fc2->u.tattach.fid);
@@ -957,7 +968,7 @@ test_tattach (void)
     assert (np_str9cmp (&fc->u.tattach.aname, &fc2->u.tattach.aname) == 0);
     assert (fc->u.tattach.n_uname == fc2->u.tattach.n_uname);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -968,14 +979,14 @@ test_rattach (void)
     struct p9_qid qid = { 1, 2, 3 };
 
     if (!(fc = np_create_rattach (&qid)))
-        msg_exit ("out of memory in %s", __FUNCTION__); 
+        msg_exit ("out of memory in %s", __FUNCTION__);
     fc2 = _rcv_buf (fc, P9_RATTACH, __FUNCTION__);
 
     assert (fc->u.rattach.qid.type == fc2->u.rattach.qid.type);
     assert (fc->u.rattach.qid.version == fc2->u.rattach.qid.version);
     assert (fc->u.rattach.qid.path == fc2->u.rattach.qid.path);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -993,7 +1004,7 @@ test_twalk (void)
 
     assert (P9_MAXWELEM == 16);
     if (!(fc = np_create_twalk (1, 2, P9_MAXWELEM, wnames)))
-        msg_exit ("out of memory in %s", __FUNCTION__); 
+        msg_exit ("out of memory in %s", __FUNCTION__);
     fc2 = _rcv_buf (fc, P9_TWALK, __FUNCTION__);
 
     assert (fc->u.twalk.fid == fc2->u.twalk.fid);
@@ -1005,7 +1016,7 @@ test_twalk (void)
         assert (np_str9cmp (&fc->u.twalk.wnames[i], &fc2->u.twalk.wnames[i]) ==0);
     }
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -1024,7 +1035,7 @@ test_rwalk (void)
     assert (P9_MAXWELEM == 16);
 
     if (!(fc = np_create_rwalk (P9_MAXWELEM, wqids)))
-        msg_exit ("out of memory in %s", __FUNCTION__); 
+        msg_exit ("out of memory in %s", __FUNCTION__);
     fc2 = _rcv_buf (fc, P9_RWALK, __FUNCTION__);
 
     assert (fc->u.rwalk.nwqid == P9_MAXWELEM);
@@ -1036,7 +1047,7 @@ test_rwalk (void)
         assert (fc->u.rwalk.wqids[i].path == fc2->u.rwalk.wqids[i].path);
     }
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -1046,14 +1057,14 @@ test_tread (void)
     Npfcall *fc, *fc2;
 
     if (!(fc = np_create_tread (1, 2, 3)))
-        msg_exit ("out of memory in %s", __FUNCTION__); 
+        msg_exit ("out of memory in %s", __FUNCTION__);
     fc2 = _rcv_buf (fc, P9_TREAD, __FUNCTION__);
 
     assert (fc->u.tread.fid == fc2->u.tread.fid);
     assert (fc->u.tread.offset == fc2->u.tread.offset);
     assert (fc->u.tread.count == fc2->u.tread.count);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -1066,14 +1077,41 @@ test_rread (void)
     memset (buf, 0xf0, sizeof(buf));
 
     if (!(fc = np_create_rread (sizeof (buf), buf)))
-        msg_exit ("out of memory in %s", __FUNCTION__); 
+        msg_exit ("out of memory in %s", __FUNCTION__);
     np_set_rread_count (fc, sizeof (buf));
     fc2 = _rcv_buf (fc, P9_RREAD, __FUNCTION__);
 
     assert (fc->u.rread.count == fc2->u.rread.count);
     assert (memcmp (fc->u.rread.data, fc2->u.rread.data, fc->u.rread.count) == 0);
 
-    free (fc);
+    np_free_fcall (fc);
+    free (fc2);
+}
+
+static void
+_release (void *arg)
+{
+    (*(int *)arg)++;
+}
+
+static void
+test_rread_ext (void)
+{
+    Npfcall *fc, *fc2;
+    u8 buf[128];
+    int released = 0;
+
+    memset (buf, 0xf1, sizeof(buf));
+
+    if (!(fc = np_create_rread_ext (sizeof (buf), buf, _release, &released)))
+        msg_exit ("out of memory in %s", __FUNCTION__);
+    fc2 = _rcv_buf (fc, P9_RREAD, __FUNCTION__);
+
+    assert (fc->u.rread.count == fc2->u.rread.count);
+    assert (memcmp (buf, fc2->u.rread.data, fc2->u.rread.count) == 0);
+
+    np_free_fcall (fc);
+    assert (released == 1);
     free (fc2);
 }
 
@@ -1086,7 +1124,7 @@ test_twrite (void)
     memset (buf, 0x0f, sizeof(buf));
 
     if (!(fc = np_create_twrite (1, 2, sizeof (buf), buf)))
-        msg_exit ("out of memory in %s", __FUNCTION__); 
+        msg_exit ("out of memory in %s", __FUNCTION__);
     fc2 = _rcv_buf (fc, P9_TWRITE, __FUNCTION__);
 
     assert (fc->u.twrite.fid == fc2->u.twrite.fid);
@@ -1094,7 +1132,7 @@ test_twrite (void)
     assert (fc->u.twrite.count == fc2->u.twrite.count);
     assert (memcmp (fc->u.twrite.data, fc2->u.twrite.data, fc->u.twrite.count) == 0);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -1104,12 +1142,12 @@ test_rwrite (void)
     Npfcall *fc, *fc2;
 
     if (!(fc = np_create_rwrite (1)))
-        msg_exit ("out of memory in %s", __FUNCTION__); 
+        msg_exit ("out of memory in %s", __FUNCTION__);
     fc2 = _rcv_buf (fc, P9_RWRITE, __FUNCTION__);
 
     assert (fc->u.rwrite.count == fc2->u.rwrite.count);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -1119,12 +1157,12 @@ test_tclunk (void)
     Npfcall *fc, *fc2;
 
     if (!(fc = np_create_tclunk (1)))
-        msg_exit ("out of memory in %s", __FUNCTION__); 
+        msg_exit ("out of memory in %s", __FUNCTION__);
     fc2 = _rcv_buf (fc, P9_TCLUNK, __FUNCTION__);
 
     assert (fc->u.tclunk.fid == fc2->u.tclunk.fid);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -1134,10 +1172,10 @@ test_rclunk (void)
     Npfcall *fc, *fc2;
 
     if (!(fc = np_create_rclunk ()))
-        msg_exit ("out of memory in %s", __FUNCTION__); 
+        msg_exit ("out of memory in %s", __FUNCTION__);
     fc2 = _rcv_buf (fc, P9_RCLUNK, __FUNCTION__);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -1147,12 +1185,12 @@ test_tremove (void)
     Npfcall *fc, *fc2;
 
     if (!(fc = np_create_tremove (1)))
-        msg_exit ("out of memory in %s", __FUNCTION__); 
+        msg_exit ("out of memory in %s", __FUNCTION__);
     fc2 = _rcv_buf (fc, P9_TREMOVE, __FUNCTION__);
 
     assert (fc->u.tremove.fid == fc2->u.tremove.fid);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
@@ -1162,10 +1200,10 @@ test_rremove (void)
     Npfcall *fc, *fc2;
 
     if (!(fc = np_create_rremove ()))
-        msg_exit ("out of memory in %s", __FUNCTION__); 
+        msg_exit ("out of memory in %s", __FUNCTION__);
     fc2 = _rcv_buf (fc, P9_RREMOVE, __FUNCTION__);
 
-    free (fc);
+    np_free_fcall (fc);
     free (fc2);
 }
 
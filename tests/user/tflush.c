@@ -104,7 +104,7 @@ _flush_series (Npcfsys *fs, Npcfid *root)
         if (n < 0)
             errn_exit (np_rerror (), "np_trans_write");
         //msg ("sent tversion tag %d", tc->tag);
-        free(tc);
+        np_free_fcall(tc);
     }
     msg ("sent 100 tfsyncs");
 
@@ -116,7 +116,7 @@ _flush_series (Npcfsys *fs, Npcfid *root)
     if (np_trans_send(fs->trans, ac) < 0)
         errn_exit (np_rerror (), "np_trans_write");
     //msg ("sent tflush tag %d (flushing tag %d)", ac->tag, flushtag);
-    free (ac);
+    np_free_fcall (ac);
     msg ("sent 1 tflush");
         
     /* receive up to 101 responses with 1s timeout */
@@ -140,7 +140,7 @@ _flush_series (Npcfsys *fs, Npcfid *root)
         if (rc->type != P9_RFSYNC && rc->type != P9_RFLUSH)
             msg_exit ("received unexpected reply type (%d)", rc->type);
         //msg ("received tag %d", rc->tag);
-        free(rc);
+        np_free_fcall(rc);
         //npc_put_id(fs->tagpool, rc->tag);
     }
     if (i == 100 || i == 101)
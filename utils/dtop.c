@@ -100,6 +100,40 @@ typedef struct {
     sample_t wcount[NPSTATS_RWCOUNT_BINS];
 } Tpool;
 
+typedef struct {
+    Tpoolkey key;
+    int op;
+    Nplatency cur;
+    Nplatency prev;
+    time_t tcur;
+    time_t tprev;
+} Latop;
+
+typedef enum {
+    TALKER_CLIENT, TALKER_USER
+} talker_t;
+
+/* A client (all its connections to a server) or a user, from the
+ * connections or users ctl file.
+ */
+typedef struct {
+    char host[MAXHOSTNAMELEN];
+    char name[128];
+    talker_t kind;
+    sample_t nconns;
+    sample_t outstanding;
+    sample_t nreqs;
+    sample_t rbytes;
+    sample_t wbytes;
+    sample_t stime;
+    int seen;           /* lines summed in acct this poll */
+    Npacct acct;
+} Talker;
+
+typedef enum {
+    SORT_OPS, SORT_READ, SORT_WRITE, SORT_SVC
+} sort_t;
+
 typedef struct {
     char *host;
     char *port;
@@ -118,17 +152,22 @@ typedef struct {
     sample_t mem_dirty;
     sample_t nfs_ops;
     time_t last_poll;
+    int textstats;      /* server has no tpools.bin */
 } Server;
 
 #define TOPWIN_LINES    7
 
 static List tpools = NULL;
+static List latops = NULL;
+static List talkers = NULL;
+static sort_t talker_sort = SORT_OPS;
 static List servers = NULL;
 static pthread_mutex_t dtop_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static Server *_server_create (char *host, char *port, double poll_sec);
 static void _server_destroy (Server *sp);
 static void _destroy_tpool (Tpool *tp);
+static void _destroy_talker (Talker *tk);
 static void _curses_watcher (double update_secs);
 
 static int stale_secs = 5;
@@ -193,6 +232,10 @@ main (int argc, char *argv[])
 
     if (!(tpools = list_create ((ListDelF)_destroy_tpool)))
         err_exit ("out of memory");
+    if (!(latops = list_create ((ListDelF)free)))
+        err_exit ("out of memory");
+    if (!(talkers = list_create ((ListDelF)_destroy_talker)))
+        err_exit ("out of memory");
 
     sigemptyset (&sigs);
     sigaddset (&sigs, SIGPIPE);
@@ -388,6 +431,146 @@ _update_display_rwcount (WINDOW *win)
     wrefresh (win);
 }
 
+/* Return the upper bound in usec of the bin holding the pct percentile
+ * of the latencies counted between prev and cur.
+ */
+static double
+_lat_pct (u64 *cur, u64 *prev, u64 n, double pct)
+{
+    u64 sum = 0;
+    int i;
+
+    for (i = 0; i < NPSTATS_LAT_BINS - 1; i++) {
+        sum += cur[i] - prev[i];
+        if (sum >= n * pct)
+            break;
+    }
+    return (double)(1ULL << i);
+}
+
+static void
+_update_display_latency (WINDOW *win)
+{
+    ListIterator itr;
+    Latop *lp;
+    int y = 0;
+    time_t t = time(NULL);
+    u64 n;
+
+    wclear (win);
+    wmove (win, y++, 0);
+
+    wattron (win, A_REVERSE);
+    wprintw (win,
+             "%9.9s %10.10s %-9.9s %7.7s %7.7s %7.7s %7.7s %7.7s %7.7s",
+             "server", "aname", "op", "ops/s",
+             "queue", "q99", "svc", "s99", "reply");
+    wattroff (win, A_REVERSE);
+
+    xpthread_mutex_lock (&dtop_lock);
+    if (!(itr = list_iterator_create (latops)))
+        msg_exit ("out of memory");
+    while ((lp = list_next (itr))) {
+        if (t - lp->tcur >= stale_secs || lp->tcur <= lp->tprev)
+            continue;
+        if ((n = lp->cur.count - lp->prev.count) == 0)
+            continue;
+        mvwprintw (win, y++, 0,
+             "%9.9s %10.10s %-9.9s %7.0f %7.0f %7.0f %7.0f %7.0f %7.0f",
+                    lp->key.host, lp->key.aname, np_latop_name (lp->op),
+                    (double)n / (lp->tcur - lp->tprev),
+                    (double)(lp->cur.qtime - lp->prev.qtime) / n / 1000,
+                    _lat_pct (lp->cur.qbins, lp->prev.qbins, n, 0.99),
+                    (double)(lp->cur.stime - lp->prev.stime) / n / 1000,
+                    _lat_pct (lp->cur.sbins, lp->prev.sbins, n, 0.99),
+                    (double)(lp->cur.rtime - lp->prev.rtime) / n / 1000);
+    }
+    list_iterator_destroy (itr);
+    xpthread_mutex_unlock (&dtop_lock);
+    wrefresh (win);
+}
+
+static double
+_talker_key (Talker *tk, time_t t)
+{
+    switch (talker_sort) {
+        case SORT_OPS:
+            return sample_rate (tk->nreqs, t);
+        case SORT_READ:
+            return sample_rate (tk->rbytes, t);
+        case SORT_WRITE:
+            return sample_rate (tk->wbytes, t);
+        case SORT_SVC:
+            return sample_rate (tk->stime, t);
+    }
+    return 0;
+}
+
+/* Busiest first.
+ */
+static int
+_cmp_talker (Talker *x, Talker *y)
+{
+    time_t t = time (NULL);
+    double kx = _talker_key (x, t);
+    double ky = _talker_key (y, t);
+
+    return kx < ky ? 1 : kx > ky ? -1 : 0;
+}
+
+/* Rates of cumulative counters summed over connections go negative when
+ * a connection closes.  Show those as zero.
+ */
+static double
+_rate (sample_t s, time_t t)
+{
+    double r = sample_rate (s, t);
+
+    return r > 0 ? r : 0;
+}
+
+static void
+_update_display_talkers (WINDOW *win, talker_t kind)
+{
+    static char *sortname[] = { "ops/s", "rMB/s", "wMB/s", "svc%" };
+    ListIterator itr;
+    Talker *tk;
+    int i, y = 0;
+    time_t t = time(NULL);
+
+    wclear (win);
+    wmove (win, y++, 0);
+
+    wattron (win, A_REVERSE);
+    wprintw (win, "%10.10s %20.20s %5.5s %5.5s",
+             "server", kind == TALKER_CLIENT ? "client" : "user",
+             kind == TALKER_CLIENT ? "conns" : "", "reqs");
+    for (i = 0; i < sizeof (sortname) / sizeof (sortname[0]); i++)
+        wprintw (win, " %6.6s%c", sortname[i], i == talker_sort ? '*' : ' ');
+    wattroff (win, A_REVERSE);
+
+    xpthread_mutex_lock (&dtop_lock);
+    list_sort (talkers, (ListCmpF)_cmp_talker);
+    if (!(itr = list_iterator_create (talkers)))
+        msg_exit ("out of memory");
+    while ((tk = list_next (itr))) {
+        if (tk->kind != kind || sample_val (tk->nconns, t) == 0)
+            continue;
+        mvwprintw (win, y, 0, "%10.10s %20.20s ", tk->host, tk->name);
+        if (kind == TALKER_CLIENT)
+            mvwprintw (win, y, 32, "%5.0f", sample_val (tk->nconns, t));
+        mvwprintw (win, y++, 38, "%5.0f %7.0f %7.1f %7.1f %7.1f",
+                   sample_val (tk->outstanding, t),
+                   _rate (tk->nreqs, t),
+                   _rate (tk->rbytes, t) / (1024*1024),
+                   _rate (tk->wbytes, t) / (1024*1024),
+                   _rate (tk->stime, t) / 1E7);
+    }
+    list_iterator_destroy (itr);
+    xpthread_mutex_unlock (&dtop_lock);
+    wrefresh (win);
+}
+
 static int
 _match_serverhost (Server *sp, char *host)
 {
@@ -480,13 +663,20 @@ _update_display_help (WINDOW *win)
     mvwprintw (win, y++, 2, "n             Normal server/aname view");
     mvwprintw (win, y++, 2, "s             Diod server view");
     mvwprintw (win, y++, 2, "c             Display I/O size histograms ");
+    mvwprintw (win, y++, 2, "l             Display op latency in usec "
+               "(mean, 99th percentile)");
+    mvwprintw (win, y++, 2, "k             Display top clients");
+    mvwprintw (win, y++, 2, "u             Display top users");
+    mvwprintw (win, y++, 2, "t             Sort clients/users by next "
+               "column (ops, read, write, svc)");
     mvwprintw (win, y++, 2, "h|?           Display this help screen");
     mvwprintw (win, y++, 2, "q             Quit");
     wrefresh (win);
 }
 
 typedef enum {
-    VIEW_NORMAL, VIEW_SERVER, VIEW_RWCOUNT, VIEW_HELP
+    VIEW_NORMAL, VIEW_SERVER, VIEW_RWCOUNT, VIEW_LATENCY, VIEW_CLIENTS,
+    VIEW_USERS, VIEW_HELP
 } view_t;
 
 static void
@@ -522,6 +712,18 @@ _curses_watcher (double update_secs)
                 _update_display_topwin (topwin);
                 _update_display_rwcount (subwin);
                 break;
+            case VIEW_LATENCY:
+                _update_display_topwin (topwin);
+                _update_display_latency (subwin);
+                break;
+            case VIEW_CLIENTS:
+                _update_display_topwin (topwin);
+                _update_display_talkers (subwin, TALKER_CLIENT);
+                break;
+            case VIEW_USERS:
+                _update_display_topwin (topwin);
+                _update_display_talkers (subwin, TALKER_USER);
+                break;
              case VIEW_HELP:
                 _update_display_help (topwin);
                 break;
@@ -541,6 +743,18 @@ _curses_watcher (double update_secs)
             case 'c': /* rwcount view */
                 view = VIEW_RWCOUNT;
                 break;
+            case 'l': /* latency view */
+                view = VIEW_LATENCY;
+                break;
+            case 'k': /* top clients view */
+                view = VIEW_CLIENTS;
+                break;
+            case 'u': /* top users view */
+                view = VIEW_USERS;
+                break;
+            case 't': /* next sort key for clients/users */
+                talker_sort = (talker_sort + 1) % (SORT_SVC + 1);
+                break;
             case 'h': /* help view */
             case '?':
                 view = VIEW_HELP;
@@ -607,6 +821,38 @@ _destroy_tpool (Tpool *tp)
     free (tp);
 }
 
+static Talker *
+_create_talker (char *host, char *name, talker_t kind)
+{
+    Talker *tk;
+
+    if (!(tk = malloc (sizeof (*tk))))
+        msg_exit ("out of memory");
+    memset (tk, 0, sizeof (*tk));
+    snprintf (tk->host, sizeof (tk->host), "%s", host);
+    snprintf (tk->name, sizeof (tk->name), "%s", name);
+    tk->kind = kind;
+    tk->nconns = sample_create (stale_secs);
+    tk->outstanding = sample_create (stale_secs);
+    tk->nreqs = sample_create (stale_secs);
+    tk->rbytes = sample_create (stale_secs);
+    tk->wbytes = sample_create (stale_secs);
+    tk->stime = sample_create (stale_secs);
+    return tk;
+}
+
+static void
+_destroy_talker (Talker *tk)
+{
+    sample_destroy (tk->nconns);
+    sample_destroy (tk->outstanding);
+    sample_destroy (tk->nreqs);
+    sample_destroy (tk->rbytes);
+    sample_destroy (tk->wbytes);
+    sample_destroy (tk->stime);
+    free (tk);
+}
+
 static u64
 _sum_nreqs (Npstats *sp)
 {
@@ -619,16 +865,13 @@ _sum_nreqs (Npstats *sp)
 }
 
 static void
-_update (char *host, time_t t, char *s)
+_update_stats (char *host, time_t t, Npstats *sp)
 {
-    Npstats stats;
+    Npstats stats = *sp;
     Tpoolkey key;
     Tpool *tp;
     int i;
 
-    memset (stats.nreqs, 0, sizeof(stats.nreqs));
-    if (np_decode_tpools_str (s, &stats) < 0) /* mallocs stats.name */
-        return;
     snprintf (key.host, sizeof(key.host), "%s", host);
     snprintf (key.aname, sizeof(key.aname), "%s", stats.name);
 
@@ -653,13 +896,22 @@ _update (char *host, time_t t, char *s)
     }
         
     xpthread_mutex_unlock (&dtop_lock);
+}
 
-    if (stats.name)
-        free (stats.name);
+static void
+_update (char *host, time_t t, char *s)
+{
+    Npstats stats;
+
+    memset (stats.nreqs, 0, sizeof(stats.nreqs));
+    if (np_decode_tpools_str (s, &stats) < 0) /* mallocs stats.name */
+        return;
+    _update_stats (host, t, &stats);
+    free (stats.name);
 }
 
 static int
-_read_ctl_tpools (Server *sp)
+_read_ctl_tpools_text (Server *sp)
 {
     time_t now;
     char *buf, *s, *p;
@@ -677,6 +929,120 @@ _read_ctl_tpools (Server *sp)
     return 0;
 }
 
+static int
+_match_latop (Latop *x, Latop *key)
+{
+    if (x->op == key->op && !strcmp (key->key.host, x->key.host)
+                         && !strcmp (key->key.aname, x->key.aname))
+        return 1;
+    return 0;
+}
+
+static void
+_update_latop (char *host, time_t t, char *name, int op, Nplatency *lat)
+{
+    Latop key, *lp;
+
+    snprintf (key.key.host, sizeof (key.key.host), "%s", host);
+    snprintf (key.key.aname, sizeof (key.key.aname), "%s", name);
+    key.op = op;
+
+    xpthread_mutex_lock (&dtop_lock);
+    if (!(lp = list_find_first (latops, (ListFindF)_match_latop, &key))) {
+        if (!(lp = malloc (sizeof (*lp))))
+            msg_exit ("out of memory");
+        memset (lp, 0, sizeof (*lp));
+        lp->key = key.key;
+        lp->op = key.op;
+        if (!list_append (latops, lp))
+            msg_exit ("out of memory");
+    }
+    lp->prev = lp->cur;
+    lp->tprev = lp->tcur;
+    lp->cur = *lat;
+    lp->tcur = t;
+    xpthread_mutex_unlock (&dtop_lock);
+}
+
+static void
+_update_latency (char *host, time_t t, char *s)
+{
+    Nplatency lat;
+    char *name;
+    int op;
+
+    if (np_decode_latency_str (s, &name, &op, &lat) < 0)
+        return;
+    _update_latop (host, t, name, op, &lat);
+    free (name);
+}
+
+/* Older servers have no latency file, so this is not fatal.
+ */
+static int
+_read_ctl_latency (Server *sp)
+{
+    time_t now;
+    char *buf, *s, *p;
+
+    if ((buf = npc_aget (sp->root, "latency"))) {
+        now = time (NULL);
+        for (s = buf; s && *s; s = p) {
+            p = strchr (s, '\n');
+            if (p)
+                *p++ = '\0';
+            _update_latency (sp->host, now, s);
+        }
+        free (buf);
+    }
+    return 0;
+}
+
+/* Read tpools and latency together from tpools.bin, which saves parsing
+ * text for every server each poll, or from the text files if the server
+ * has no tpools.bin or a version of it we don't understand.
+ */
+static int
+_read_ctl_tpools (Server *sp)
+{
+    Npstats *stats;
+    Nplatency *lat;
+    time_t now;
+    char *buf;
+    int i, j, n, len;
+
+    if (sp->textstats) {
+        if (_read_ctl_tpools_text (sp) < 0 || _read_ctl_latency (sp) < 0)
+            return -1;
+        return 0;
+    }
+    if (!(buf = npc_aget_len (sp->root, "tpools.bin", &len))) {
+        if (np_rerror () != ENOENT)
+            return -1;
+        sp->textstats = 1;
+        return _read_ctl_tpools (sp);
+    }
+    n = np_decode_tpools_bin ((u8 *)buf, len, &stats, &lat);
+    free (buf);
+    if (n < 0) {
+        sp->textstats = 1;
+        return _read_ctl_tpools (sp);
+    }
+    now = time (NULL);
+    for (i = 0; i < n; i++) {
+        _update_stats (sp->host, now, &stats[i]);
+        for (j = 0; j < NPSTATS_LAT_NOPS; j++) {
+            if (lat[i * NPSTATS_LAT_NOPS + j].count > 0)
+                _update_latop (sp->host, now, stats[i].name, j,
+                               &lat[i * NPSTATS_LAT_NOPS + j]);
+        }
+        free (stats[i].name);
+    }
+    free (stats);
+    free (lat);
+    return 0;
+}
+
 static int
 _read_ctl_meminfo (Server *sp)
 {
@@ -725,22 +1091,102 @@ _read_ctl_nfsops (Server *sp)
     return 0;
 }
 
+/* Sum the Npacct of each line of buf, which follows nfields other
+ * fields, into the Talker named by the line's first field.
+ */
+static void
+_update_talkers (char *host, talker_t kind, int nfields, time_t t, char *buf)
+{
+    ListIterator itr;
+    Talker *tk;
+    Npacct acct;
+    char *s, *p, *q, *name;
+    u64 nreqs;
+    int i;
+
+    xpthread_mutex_lock (&dtop_lock);
+    if (!(itr = list_iterator_create (talkers)))
+        msg_exit ("out of memory");
+    while ((tk = list_next (itr))) {
+        if (tk->kind == kind && !strcmp (tk->host, host)) {
+            memset (&tk->acct, 0, sizeof (tk->acct));
+            tk->seen = 0;
+        }
+    }
+    for (s = buf; s && *s; s = p) {
+        p = strchr (s, '\n');
+        if (p)
+            *p++ = '\0';
+        name = s;
+        for (q = s, i = 0; i < nfields && q; i++) {
+            if ((q = strchr (q, ' ')))
+                *q++ = '\0';
+        }
+        if (!q || np_decode_acct_str (q, &acct) < 0)
+            continue;
+        list_iterator_reset (itr);
+        while ((tk = list_next (itr))) {
+            if (tk->kind == kind && !strcmp (tk->host, host)
+                                 && !strcmp (tk->name, name))
+                break;
+        }
+        if (!tk) {
+            tk = _create_talker (host, name, kind);
+            if (!list_append (talkers, tk))
+                msg_exit ("out of memory");
+        }
+        tk->acct.outstanding += acct.outstanding;
+        tk->acct.rbytes += acct.rbytes;
+        tk->acct.wbytes += acct.wbytes;
+        tk->acct.stime += acct.stime;
+        for (i = 0; i < NPSTATS_LAT_NOPS; i++)
+            tk->acct.nreqs[i] += acct.nreqs[i];
+        tk->seen++;
+    }
+    list_iterator_reset (itr);
+    while ((tk = list_next (itr))) {
+        if (tk->kind != kind || strcmp (tk->host, host) || !tk->seen)
+            continue;
+        for (nreqs = 0, i = 0; i < NPSTATS_LAT_NOPS; i++)
+            nreqs += tk->acct.nreqs[i];
+        sample_update (tk->nconns, (double)tk->seen, t);
+        sample_update (tk->outstanding, (double)tk->acct.outstanding, t);
+        sample_update (tk->nreqs, (double)nreqs, t);
+        sample_update (tk->rbytes, (double)tk->acct.rbytes, t);
+        sample_update (tk->wbytes, (double)tk->acct.wbytes, t);
+        sample_update (tk->stime, (double)tk->acct.stime, t);
+    }
+    list_iterator_destroy (itr);
+    xpthread_mutex_unlock (&dtop_lock);
+}
+
 static int
 _read_ctl_connections (Server *sp)
 {
-    char *buf, *s, *p;
+    char *buf, *s;
     int count = 0;
 
     if (!(buf = npc_aget (sp->root, "connections")))
         return -1;
-    for (s = buf; s && *s; s = p) {
-        p = strchr (s, '\n');
-        if (p)
-            *p++ = '\0';
+    for (s = buf; (s = strchr (s, '\n')); s++)
         count++;
-    }
-    free (buf);
     sp->numconns = count;
+    _update_talkers (sp->host, TALKER_CLIENT, 4, time (NULL), buf);
+    free (buf);
+    return 0;
+}
+
+/* Older servers have no users file, so this is not fatal.
+ */
+static int
+_read_ctl_users (Server *sp)
+{
+    char *buf;
+
+    if ((buf = npc_aget (sp->root, "users"))) {
+        _update_talkers (sp->host, TALKER_USER, 2, time (NULL), buf);
+        free (buf);
+    }
     return 0;
 }
 
@@ -754,15 +1200,18 @@ _reader (void *arg)
             sp->fd = diod_sock_connect (sp->host, sp->port, DIOD_SOCK_QUIET);
         if (sp->fd == -1)
             goto skip;
-        if (sp->root == NULL)
+        if (sp->root == NULL) {
             sp->root = npc_mount (sp->fd, sp->fd, 65536, "ctl", diod_auth);
+            sp->textstats = 0;
+        }
         if (sp->root == NULL) {
             (void)close (sp->fd);
             sp->fd = -1;
             goto skip;
         }
         if (_read_ctl_tpools (sp) < 0 || _read_ctl_meminfo (sp) < 0
-         || _read_ctl_nfsops (sp) < 0 || _read_ctl_connections (sp) < 0) {
+         || _read_ctl_nfsops (sp) < 0 || _read_ctl_connections (sp) < 0
+         || _read_ctl_users (sp) < 0) {
             (void)npc_umount (sp->root); /* closes fd */
             sp->root = NULL;
             sp->fd = -1;